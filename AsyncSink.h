@@ -0,0 +1,249 @@
+/*
+    Command Manager Asynchronous Output
+
+    Console output that never makes the parse path wait on a slow terminal or pipe.
+    Results are formatted (with writeResult, so the text is exactly what ConsoleSink prints) into a block of memory owned by the producing thread.
+    Full blocks are handed to a background thread, which writes each one with a single write() call.
+    While that thread is idle a block is handed over once it is a millisecond old so output isn't held back for long, while it is busy results accumulate into large blocks.
+    Output still in the producer's block is written by the next result after that, or by flush().
+    The queue of blocks waiting to be written is bounded; when it is full the sink either drops the block or waits, as chosen by OverflowPolicy.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+//Size a block is allowed to reach before it is handed to the writer thread.
+constexpr std::size_t kDefaultAsyncBlockSize = 64 * 1024;
+
+//How long output can sit in the producer's block while the writer thread is idle.
+constexpr std::chrono::microseconds kAsyncIdleHandOffDelay{ 1000 };
+
+//Number of blocks that can wait to be written before the overflow policy applies.
+constexpr std::size_t kDefaultAsyncQueueBlocks = 64;
+
+//What an AsyncConsoleSink does with output when the writer thread has fallen a whole queue behind.
+enum class OverflowPolicy : std::uint8_t {
+    //Discard the block, counting its bytes in droppedBytes(). The parse path never waits.
+    Drop,
+    //Wait for the writer to catch up, for output that must be complete such as a replay being diffed.
+    Block
+};
+
+//Stream buffer appending everything written to it onto a string, so writeResult can format straight into a block.
+//Characters are gathered in a small put area first, so the stream formats without a virtual call per character, and moved to the string on sync().
+class StringAppendBuffer : public std::streambuf {
+public:
+    StringAppendBuffer() {
+        setp(m_arrPutArea, m_arrPutArea + sizeof(m_arrPutArea));
+    }
+
+    void setTarget(std::string* pTarget) {
+        m_pTarget = pTarget;
+    }
+
+protected:
+    int_type overflow(int_type iCharacter) override {
+        sync();
+        if (!traits_type::eq_int_type(iCharacter, traits_type::eof())) {
+            m_pTarget->push_back(traits_type::to_char_type(iCharacter));
+        }
+        return traits_type::not_eof(iCharacter);
+    }
+
+    int sync() override {
+        m_pTarget->append(pbase(), static_cast<std::size_t>(pptr() - pbase()));
+        setp(m_arrPutArea, m_arrPutArea + sizeof(m_arrPutArea));
+        return 0;
+    }
+
+private:
+    char m_arrPutArea[1024];
+    std::string* m_pTarget = nullptr;
+};
+
+//Sink that prints results like ConsoleSink, but leaves the writing to a background thread.
+//onResult must not be called from more than one thread at a time, which holds for a parser's or pipeline's sink.
+class AsyncConsoleSink : public ResultSink {
+public:
+    //Write to a file descriptor, standard output by default.
+    explicit AsyncConsoleSink(int iFileDescriptor = 1, OverflowPolicy ePolicy = OverflowPolicy::Drop,
+        std::size_t uBlockSize = kDefaultAsyncBlockSize, std::size_t uQueueBlocks = kDefaultAsyncQueueBlocks)
+        : m_iFileDescriptor(iFileDescriptor), m_ePolicy(ePolicy), m_uBlockSize(uBlockSize), m_uQueueBlocks(uQueueBlocks == 0 ? 1 : uQueueBlocks), m_stream(&m_buffer) {
+        //Allocate every block up front so handing blocks back and forth never allocates.
+        //One more than the queue holds, so there is still a free block while the writer holds one.
+        m_vecFree.resize(m_uQueueBlocks + 1);
+        for (std::string& strBlock : m_vecFree) {
+            strBlock.reserve(m_uBlockSize * 2);
+        }
+        m_strBlock.reserve(m_uBlockSize * 2);
+        m_buffer.setTarget(&m_strBlock);
+        m_writer = std::thread([this] { runWriter(); });
+    }
+
+    AsyncConsoleSink(const AsyncConsoleSink&) = delete;
+    AsyncConsoleSink& operator=(const AsyncConsoleSink&) = delete;
+
+    ~AsyncConsoleSink() override {
+        stop();
+    }
+
+    void onResult(const ParseResult& result) override {
+        bool bWasEmpty = m_strBlock.empty();
+        writeResult(m_stream, result);
+        m_buffer.pubsync();
+        if (m_strBlock.empty()) {
+            return;
+        }
+        if (bWasEmpty) {
+            m_blockStart = std::chrono::steady_clock::now();
+        }
+        //Hand over a full block, or a block that has waited long enough if the writer has nothing to do.
+        if (m_strBlock.length() >= m_uBlockSize
+            || (m_bWriterIdle.load(std::memory_order_acquire) && std::chrono::steady_clock::now() - m_blockStart >= kAsyncIdleHandOffDelay)) {
+            handOff(m_ePolicy);
+        }
+    }
+
+    //Hand over any buffered output and wait until everything so far has been written, e.g. before other output to the same file.
+    void flush() {
+        if (!m_strBlock.empty()) {
+            handOff(OverflowPolicy::Block);
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cvSpace.wait(lock, [this] { return m_queue.empty() && !m_bWriting; });
+    }
+
+    //Flush and stop the writer thread. Results passed on afterwards are formatted but never written.
+    void stop() {
+        if (!m_writer.joinable()) {
+            return;
+        }
+        flush();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_bStopping = true;
+        }
+        m_cvWork.notify_one();
+        m_writer.join();
+    }
+
+    //Bytes of output discarded because the queue was full.
+    std::uint64_t droppedBytes() const {
+        return m_uDroppedBytes.load(std::memory_order_relaxed);
+    }
+
+    //Number of write() calls made.
+    std::uint64_t writes() const {
+        return m_uWrites.load(std::memory_order_relaxed);
+    }
+
+private:
+    //Queue the current block for writing and carry on in an empty one.
+    void handOff(OverflowPolicy ePolicy) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_queue.size() >= m_uQueueBlocks) {
+            if (ePolicy == OverflowPolicy::Drop) {
+                m_uDroppedBytes.fetch_add(m_strBlock.length(), std::memory_order_relaxed);
+                m_strBlock.clear();
+                return;
+            }
+            m_cvSpace.wait(lock, [this] { return m_queue.size() < m_uQueueBlocks; });
+        }
+        m_queue.push_back(std::move(m_strBlock));
+        //There is always a free block while the queue has space, see the constructor.
+        m_strBlock = std::move(m_vecFree.back());
+        m_vecFree.pop_back();
+        m_bWriterIdle.store(false, std::memory_order_relaxed);
+        lock.unlock();
+        m_cvWork.notify_one();
+    }
+
+    void runWriter() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            if (m_queue.empty()) {
+                if (m_bStopping) {
+                    return;
+                }
+                m_bWriterIdle.store(true, std::memory_order_release);
+                m_cvWork.wait(lock, [this] { return !m_queue.empty() || m_bStopping; });
+                continue;
+            }
+            std::string strBlock = std::move(m_queue.front());
+            m_queue.pop_front();
+            m_bWriting = true;
+            lock.unlock();
+            writeBlock(strBlock);
+            strBlock.clear();
+            lock.lock();
+            m_bWriting = false;
+            m_vecFree.push_back(std::move(strBlock));
+            m_cvSpace.notify_all();
+        }
+    }
+
+    //Write a whole block, retrying after partial writes and interrupts. Output is abandoned if the descriptor fails.
+    void writeBlock(const std::string& strBlock) {
+        const char* pData = strBlock.data();
+        std::size_t uRemaining = strBlock.length();
+        while (uRemaining > 0) {
+#if defined(_WIN32)
+            int iWritten = _write(m_iFileDescriptor, pData, static_cast<unsigned int>(uRemaining));
+#else
+            ssize_t iWritten = ::write(m_iFileDescriptor, pData, uRemaining);
+            if (iWritten < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            m_uWrites.fetch_add(1, std::memory_order_relaxed);
+            if (iWritten <= 0) {
+                return;
+            }
+            pData += iWritten;
+            uRemaining -= static_cast<std::size_t>(iWritten);
+        }
+    }
+
+    const int m_iFileDescriptor;
+    const OverflowPolicy m_ePolicy;
+    const std::size_t m_uBlockSize;
+    const std::size_t m_uQueueBlocks;
+    //Producer side, only touched by the thread calling onResult.
+    std::string m_strBlock;
+    std::chrono::steady_clock::time_point m_blockStart;
+    StringAppendBuffer m_buffer;
+    std::ostream m_stream;
+    //Shared with the writer thread, guarded by m_mutex. The mutex is never held while writing.
+    std::mutex m_mutex;
+    std::condition_variable m_cvWork;
+    std::condition_variable m_cvSpace;
+    std::deque<std::string> m_queue;
+    std::vector<std::string> m_vecFree;
+    bool m_bWriting = false;
+    bool m_bStopping = false;
+    std::atomic<bool> m_bWriterIdle{ false };
+    std::atomic<std::uint64_t> m_uDroppedBytes{ 0 };
+    std::atomic<std::uint64_t> m_uWrites{ 0 };
+    std::thread m_writer;
+};
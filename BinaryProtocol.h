@@ -0,0 +1,441 @@
+/*
+    Command Manager Binary Protocol
+
+    Compact binary framing for high-rate channels, as an alternative to the text '#' protocol (which stays the default).
+    Binary frames are decoded into the same DecodedCommand as text messages and committed through the parser, so they reach the same
+    extension (HandlerRegistry / StaticHandlers), sink and history.
+
+    Frame layout, all integers little endian:
+    - uint8 marker kBinaryFrameMarker, which can't start a text message as opcodes are ASCII
+    - uint8 flags, bit 0 set if the opcode is given as a 2 byte ID rather than its 10 characters
+    - the opcode: 10 characters, or a uint16 ID (the built-in opcodes use their OpCode value, others are registered with BinaryDecoder::registerOpCodeId)
+    - uint32 payload length, then the payload:
+        RUN_NO____, POLAR_NO__  int32
+        USR_MSG___              the message text
+        D_USR_FLD_              uint16 count, then count pairs of uint16 name ID and float64 value. Name IDs index a ParameterInterner both ends agree on.
+        HISTORY___              empty
+        other opcodes           passed to the extension unchanged
+    A payload that doesn't fit its opcode produces a ParseError with InvalidBinaryPayload and isn't added to the history.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+#include "ParameterTable.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//First byte of every binary frame.
+constexpr unsigned char kBinaryFrameMarker = 0xB7;
+
+//Flag set when the opcode is sent as a 2 byte ID.
+constexpr unsigned char kBinaryOpCodeIdFlag = 0x01;
+
+//Header lengths: marker, flags, opcode and payload length.
+constexpr std::size_t kBinaryHeaderLength = 2 + kOpCodeLength + 4;
+constexpr std::size_t kBinaryIdHeaderLength = 2 + 2 + 4;
+
+//Largest binary frame accepted, longer frames are skipped.
+constexpr std::size_t kDefaultMaxBinaryFrameLength = 64 * 1024;
+
+//Names of the built-in opcodes, indexed by OpCode.
+inline constexpr std::array<std::string_view, 6> kOpCodeNames = { {
+    "", "RUN_NO____", "POLAR_NO__", "USR_MSG___", "D_USR_FLD_", "HISTORY___"
+} };
+
+//A D_USR_FLD_ parameter as sent in binary.
+struct BinaryParameter {
+    std::uint16_t uNameId = 0;
+    double dblValue = 0.0;
+};
+
+inline std::uint16_t readLittleEndian16(const char* pData) {
+    const unsigned char* pBytes = reinterpret_cast<const unsigned char*>(pData);
+    return static_cast<std::uint16_t>(pBytes[0] | (pBytes[1] << 8));
+}
+
+inline std::uint32_t readLittleEndian32(const char* pData) {
+    const unsigned char* pBytes = reinterpret_cast<const unsigned char*>(pData);
+    return static_cast<std::uint32_t>(pBytes[0]) | (static_cast<std::uint32_t>(pBytes[1]) << 8) | (static_cast<std::uint32_t>(pBytes[2]) << 16) | (static_cast<std::uint32_t>(pBytes[3]) << 24);
+}
+
+inline double readLittleEndianDouble(const char* pData) {
+    std::uint64_t uBits = readLittleEndian32(pData) | (static_cast<std::uint64_t>(readLittleEndian32(pData + 4)) << 32);
+    double dblValue = 0.0;
+    std::memcpy(&dblValue, &uBits, sizeof(dblValue));
+    return dblValue;
+}
+
+inline void appendLittleEndian16(std::string& strOut, std::uint16_t uValue) {
+    strOut.push_back(static_cast<char>(uValue & 0xFF));
+    strOut.push_back(static_cast<char>(uValue >> 8));
+}
+
+inline void appendLittleEndian32(std::string& strOut, std::uint32_t uValue) {
+    for (unsigned i = 0; i < 4; i++) {
+        strOut.push_back(static_cast<char>((uValue >> (8 * i)) & 0xFF));
+    }
+}
+
+inline void appendLittleEndianDouble(std::string& strOut, double dblValue) {
+    std::uint64_t uBits = 0;
+    std::memcpy(&uBits, &dblValue, sizeof(uBits));
+    appendLittleEndian32(strOut, static_cast<std::uint32_t>(uBits));
+    appendLittleEndian32(strOut, static_cast<std::uint32_t>(uBits >> 32));
+}
+
+//Length of the binary frame at the start of svData, or 0 if not enough of the header has arrived to tell. svData must start with the marker.
+inline std::size_t binaryFrameLength(std::string_view svData) {
+    if (svData.length() < 2) {
+        return 0;
+    }
+    std::size_t uHeaderLength = (static_cast<unsigned char>(svData[1]) & kBinaryOpCodeIdFlag) ? kBinaryIdHeaderLength : kBinaryHeaderLength;
+    if (svData.length() < uHeaderLength) {
+        return 0;
+    }
+    return uHeaderLength + readLittleEndian32(svData.data() + uHeaderLength - 4);
+}
+
+//Writers for binary frames, each appends one frame to strOut.
+namespace BinaryEncoder {
+    //A frame for a 10 character opcode.
+    inline void appendFrame(std::string& strOut, std::string_view svOpCode, std::string_view svPayload) {
+        strOut.push_back(static_cast<char>(kBinaryFrameMarker));
+        strOut.push_back(0);
+        strOut.append(svOpCode.substr(0, kOpCodeLength));
+        appendLittleEndian32(strOut, static_cast<std::uint32_t>(svPayload.length()));
+        strOut.append(svPayload);
+    }
+
+    //A frame for an opcode ID, e.g. a built-in OpCode.
+    inline void appendFrame(std::string& strOut, std::uint16_t uOpCodeId, std::string_view svPayload) {
+        strOut.push_back(static_cast<char>(kBinaryFrameMarker));
+        strOut.push_back(static_cast<char>(kBinaryOpCodeIdFlag));
+        appendLittleEndian16(strOut, uOpCodeId);
+        appendLittleEndian32(strOut, static_cast<std::uint32_t>(svPayload.length()));
+        strOut.append(svPayload);
+    }
+
+    //Start a frame for an opcode ID whose payload is appended afterwards, returns the offset of the length to fill in with finishFrame.
+    inline std::size_t beginFrame(std::string& strOut, std::uint16_t uOpCodeId) {
+        strOut.push_back(static_cast<char>(kBinaryFrameMarker));
+        strOut.push_back(static_cast<char>(kBinaryOpCodeIdFlag));
+        appendLittleEndian16(strOut, uOpCodeId);
+        std::size_t uLengthOffset = strOut.length();
+        appendLittleEndian32(strOut, 0);
+        return uLengthOffset;
+    }
+
+    inline void finishFrame(std::string& strOut, std::size_t uLengthOffset) {
+        std::uint32_t uLength = static_cast<std::uint32_t>(strOut.length() - uLengthOffset - 4);
+        for (unsigned i = 0; i < 4; i++) {
+            strOut[uLengthOffset + i] = static_cast<char>((uLength >> (8 * i)) & 0xFF);
+        }
+    }
+
+    inline void appendRunNumber(std::string& strOut, std::int32_t iRunNumber) {
+        std::size_t uLengthOffset = beginFrame(strOut, static_cast<std::uint16_t>(OpCode::RunNumber));
+        appendLittleEndian32(strOut, static_cast<std::uint32_t>(iRunNumber));
+        finishFrame(strOut, uLengthOffset);
+    }
+
+    inline void appendPolarNumber(std::string& strOut, std::int32_t iPolarNumber) {
+        std::size_t uLengthOffset = beginFrame(strOut, static_cast<std::uint16_t>(OpCode::PolarNumber));
+        appendLittleEndian32(strOut, static_cast<std::uint32_t>(iPolarNumber));
+        finishFrame(strOut, uLengthOffset);
+    }
+
+    inline void appendUserMessage(std::string& strOut, std::string_view svMessage) {
+        appendFrame(strOut, static_cast<std::uint16_t>(OpCode::UserMessage), svMessage);
+    }
+
+    inline void appendUserFields(std::string& strOut, const BinaryParameter* pParameters, std::size_t uCount) {
+        std::size_t uLengthOffset = beginFrame(strOut, static_cast<std::uint16_t>(OpCode::UserFields));
+        appendLittleEndian16(strOut, static_cast<std::uint16_t>(uCount));
+        for (std::size_t i = 0; i < uCount; i++) {
+            appendLittleEndian16(strOut, pParameters[i].uNameId);
+            appendLittleEndianDouble(strOut, pParameters[i].dblValue);
+        }
+        finishFrame(strOut, uLengthOffset);
+    }
+
+    inline void appendUserFields(std::string& strOut, const std::vector<BinaryParameter>& vecParameters) {
+        appendUserFields(strOut, vecParameters.data(), vecParameters.size());
+    }
+
+    inline void appendHistoryRequest(std::string& strOut) {
+        appendFrame(strOut, static_cast<std::uint16_t>(OpCode::History), std::string_view());
+    }
+}
+
+//Splits a byte stream into binary frames using their length prefix, carrying partial frames across chunks like MessageFramer.
+//Frames lying wholly inside a chunk are passed on as views into it, a frame split across chunks is copied into a reused buffer.
+class BinaryFramer {
+public:
+    explicit BinaryFramer(std::size_t uMaxFrameLength = kDefaultMaxBinaryFrameLength) : m_uMaxFrameLength(uMaxFrameLength) {}
+
+    //Frame a chunk, calling onFrame(std::string_view) with every complete frame. A frame finished from the buffer is only valid during the call.
+    template <typename TCallback>
+    void feed(std::string_view svChunk, TCallback&& onFrame) {
+        while (!svChunk.empty()) {
+            //The rest of a frame that was too long.
+            if (m_uSkipRemaining > 0) {
+                std::size_t uSkip = m_uSkipRemaining < svChunk.length() ? m_uSkipRemaining : svChunk.length();
+                svChunk.remove_prefix(uSkip);
+                m_uSkipRemaining -= uSkip;
+                continue;
+            }
+            //Finish a buffered frame, first its header and then its payload.
+            if (!m_strPartial.empty()) {
+                std::size_t uLength = binaryFrameLength(m_strPartial);
+                std::size_t uNeeded = uLength != 0 ? uLength : headerLength(m_strPartial);
+                std::size_t uTake = uNeeded - m_strPartial.length();
+                if (uTake > svChunk.length()) {
+                    uTake = svChunk.length();
+                }
+                m_strPartial.append(svChunk.data(), uTake);
+                svChunk.remove_prefix(uTake);
+                if (m_strPartial.length() < uNeeded) {
+                    continue;
+                }
+                if (uLength == 0) {
+                    //The header is complete, check the frame isn't too long before buffering its payload.
+                    if (binaryFrameLength(m_strPartial) > m_uMaxFrameLength) {
+                        skipFrame(binaryFrameLength(m_strPartial) - m_strPartial.length());
+                        m_strPartial.clear();
+                    }
+                    continue;
+                }
+                onFrame(std::string_view(m_strPartial));
+                m_strPartial.clear();
+                continue;
+            }
+            //Bytes that don't start a frame are skipped up to the next marker.
+            if (static_cast<unsigned char>(svChunk.front()) != kBinaryFrameMarker) {
+                const void* pMarker = std::memchr(svChunk.data(), kBinaryFrameMarker, svChunk.length());
+                std::size_t uSkip = pMarker != nullptr ? static_cast<std::size_t>(static_cast<const char*>(pMarker) - svChunk.data()) : svChunk.length();
+                m_uSkippedBytes += uSkip;
+                svChunk.remove_prefix(uSkip);
+                continue;
+            }
+            std::size_t uLength = binaryFrameLength(svChunk);
+            if (uLength > m_uMaxFrameLength) {
+                std::size_t uSkip = uLength < svChunk.length() ? uLength : svChunk.length();
+                skipFrame(uLength - uSkip);
+                svChunk.remove_prefix(uSkip);
+                continue;
+            }
+            //Whole frame inside the chunk, pass it on without copying.
+            if (uLength != 0 && uLength <= svChunk.length()) {
+                onFrame(svChunk.substr(0, uLength));
+                svChunk.remove_prefix(uLength);
+                continue;
+            }
+            //Otherwise buffer the start of the frame.
+            m_strPartial.assign(svChunk.data(), svChunk.length());
+            svChunk = {};
+        }
+    }
+
+    //Number of bytes skipped looking for a frame marker.
+    std::size_t skippedBytes() const {
+        return m_uSkippedBytes;
+    }
+
+    //Number of frames dropped for being longer than the maximum frame length.
+    std::size_t droppedFrames() const {
+        return m_uDroppedFrames;
+    }
+
+    //Forget any partial frame, e.g. after the connection is re-established.
+    void reset() {
+        m_strPartial.clear();
+        m_uSkipRemaining = 0;
+    }
+
+private:
+    static std::size_t headerLength(std::string_view svData) {
+        if (svData.length() < 2) {
+            return 2;
+        }
+        return (static_cast<unsigned char>(svData[1]) & kBinaryOpCodeIdFlag) ? kBinaryIdHeaderLength : kBinaryHeaderLength;
+    }
+
+    void skipFrame(std::size_t uRemaining) {
+        m_uSkipRemaining = uRemaining;
+        m_uDroppedFrames++;
+    }
+
+    std::string m_strPartial;
+    std::size_t m_uMaxFrameLength;
+    std::size_t m_uSkipRemaining = 0;
+    std::size_t m_uSkippedBytes = 0;
+    std::size_t m_uDroppedFrames = 0;
+};
+
+//Decodes binary frames and commits them through a parser, so they are handled exactly like the equivalent text messages.
+//The interner gives the names of D_USR_FLD_ name IDs and must outlive the decoder.
+class BinaryDecoder {
+public:
+    explicit BinaryDecoder(const ParameterInterner& names) : m_names(names) {}
+
+    //Map an opcode ID to a 10 character opcode, for site-specific opcodes sent by ID. IDs up to 255 are reserved for built-in opcodes.
+    //Returns false if the ID is reserved or already mapped, or the opcode isn't 10 characters.
+    bool registerOpCodeId(std::uint16_t uOpCodeId, std::string_view svOpCode) {
+        if (uOpCodeId <= 0xFF || svOpCode.length() != kOpCodeLength || findOpCodeId(uOpCodeId) != nullptr) {
+            return false;
+        }
+        std::array<char, kOpCodeLength> arrName{};
+        std::memcpy(arrName.data(), svOpCode.data(), kOpCodeLength);
+        m_vecOpCodeIds.push_back({ uOpCodeId, arrName });
+        return true;
+    }
+
+    //Decode one complete frame, as given by BinaryFramer. Returns false if it isn't a binary frame at all, e.g. it is too short or the opcode ID is unknown.
+    //Views in command point into the frame, the interner or the decoder and are valid until the next decode.
+    bool decode(std::string_view svFrame, DecodedCommand& command) {
+        command = DecodedCommand();
+        std::size_t uLength = svFrame.empty() || static_cast<unsigned char>(svFrame[0]) != kBinaryFrameMarker ? 0 : binaryFrameLength(svFrame);
+        if (uLength == 0 || uLength != svFrame.length()) {
+            return false;
+        }
+        std::size_t uHeaderLength = 0;
+        if (static_cast<unsigned char>(svFrame[1]) & kBinaryOpCodeIdFlag) {
+            uHeaderLength = kBinaryIdHeaderLength;
+            std::uint16_t uOpCodeId = readLittleEndian16(svFrame.data() + 2);
+            if (uOpCodeId > 0 && uOpCodeId < kOpCodeNames.size()) {
+                command.svOpCode = kOpCodeNames[uOpCodeId];
+            }
+            else if (const OpCodeIdEntry* pEntry = findOpCodeId(uOpCodeId)) {
+                command.svOpCode = std::string_view(pEntry->arrName.data(), kOpCodeLength);
+            }
+            else {
+                return false;
+            }
+        }
+        else {
+            uHeaderLength = kBinaryHeaderLength;
+            command.svOpCode = svFrame.substr(2, kOpCodeLength);
+        }
+        std::string_view svPayload = svFrame.substr(uHeaderLength);
+        command.svMessageContent = svPayload;
+        command.key = makeOpCodeKey(command.svOpCode);
+        command.eOpCode = lookupOpCode(command.key);
+        command.bRecordHistory = true;
+        switch (command.eOpCode) {
+        case OpCode::RunNumber:
+        case OpCode::PolarNumber: {
+            if (svPayload.length() != 4) {
+                return invalidPayload(command);
+            }
+            std::int32_t iValue = static_cast<std::int32_t>(readLittleEndian32(svPayload.data()));
+            if (command.eOpCode == OpCode::RunNumber) {
+                command.result = RunNumber{ iValue };
+            }
+            else {
+                command.result = PolarNumber{ iValue };
+            }
+            break;
+        }
+        case OpCode::UserMessage: {
+            command.result = UserMessage{ svPayload };
+            break;
+        }
+        case OpCode::UserFields: {
+            if (svPayload.length() < 2) {
+                return invalidPayload(command);
+            }
+            std::size_t uCount = readLittleEndian16(svPayload.data());
+            if (svPayload.length() != 2 + uCount * 10) {
+                return invalidPayload(command);
+            }
+            m_vecParameters.clear();
+            const char* pPair = svPayload.data() + 2;
+            for (std::size_t i = 0; i < uCount; i++, pPair += 10) {
+                std::uint16_t uNameId = readLittleEndian16(pPair);
+                //Both ends must agree on the names, a frame naming an unknown ID is rejected as a whole.
+                if (uNameId >= m_names.size()) {
+                    return invalidPayload(command);
+                }
+                m_vecParameters.push_back({ m_names.name(uNameId), std::string_view(), readLittleEndianDouble(pPair + 2), ParameterStatus::Valid });
+            }
+            command.result = ParameterList{ m_vecParameters.data(), m_vecParameters.size(), RunContext{} };
+            break;
+        }
+        case OpCode::History: {
+            command.bRecordHistory = false;
+            command.result = HistoryQuery{};
+            break;
+        }
+        case OpCode::Unknown:
+        default: {
+            command.bRecordHistory = false;
+            command.result = ParseError{ ParseErrorReason::UnknownOpCode, command.svOpCode, svPayload };
+            break;
+        }
+        }
+        return true;
+    }
+
+    //Decode a frame and commit it through the parser. Returns false, committing nothing, if it isn't a binary frame.
+    template <typename TParser>
+    bool parse(TParser& parser, std::string_view svFrame) {
+        LatencyTimer timer;
+        if (!decode(svFrame, m_command)) {
+            m_uRejectedFrames++;
+            return false;
+        }
+        timer.stop(static_cast<std::size_t>(m_command.eOpCode));
+        parser.commit(m_command);
+        return true;
+    }
+
+    //Frame a chunk of a binary stream and commit every complete frame through the parser.
+    template <typename TParser>
+    void feed(TParser& parser, std::string_view svChunk) {
+        m_framer.feed(svChunk, [this, &parser](std::string_view svFrame) { parse(parser, svFrame); });
+    }
+
+    const BinaryFramer& framer() const {
+        return m_framer;
+    }
+
+    //Number of frames that couldn't be decoded at all.
+    std::size_t rejectedFrames() const {
+        return m_uRejectedFrames;
+    }
+
+private:
+    struct OpCodeIdEntry {
+        std::uint16_t uOpCodeId;
+        std::array<char, kOpCodeLength> arrName;
+    };
+
+    const OpCodeIdEntry* findOpCodeId(std::uint16_t uOpCodeId) const {
+        for (const OpCodeIdEntry& entry : m_vecOpCodeIds) {
+            if (entry.uOpCodeId == uOpCodeId) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    static bool invalidPayload(DecodedCommand& command) {
+        command.bRecordHistory = false;
+        command.result = ParseError{ ParseErrorReason::InvalidBinaryPayload, command.svOpCode, command.svMessageContent };
+        return true;
+    }
+
+    const ParameterInterner& m_names;
+    std::vector<OpCodeIdEntry> m_vecOpCodeIds;
+    std::pmr::vector<Parameter> m_vecParameters;
+    DecodedCommand m_command;
+    BinaryFramer m_framer;
+    std::size_t m_uRejectedFrames = 0;
+};
@@ -0,0 +1,1507 @@
+/*
+    Command Manager Message Parser
+
+    Implements parsing logic for text-based Command Manager messages used to control wind tunnel measurement subsystems. 
+    Supports opcode-based commands, parameter parsing, and history tracking of recently received commands.
+
+    Assumptions: 
+    - All messages are UTF-8 encoded and terminate with a '#' character.
+    - Opcodes are exactly 10 characters in length
+    - D_USR_FLD_ messages contain comma-separated parameter name/value pairs.
+    - Parameter names are no longer than 15 characters.
+    - Parameter values are valid floating-point numbers with up to 6 decimal places.
+    - Invalid or unknown opcodes are ignored safely.
+
+    Developed as a technical assessment using C++17 in Visual Studio 2019.
+*/
+
+#pragma once
+
+#include "DelimiterScan.h"
+#include "NumericParse.h"
+#include "ParseArena.h"
+#include "ParserMetrics.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+//Every opcode is exactly 10 characters long.
+constexpr std::size_t kOpCodeLength = 10;
+
+//Opcodes the parser knows how to handle. Anything else maps to Unknown.
+enum class OpCode : std::uint8_t {
+    Unknown,
+    RunNumber,
+    PolarNumber,
+    UserMessage,
+    UserFields,
+    History
+};
+
+static_assert(static_cast<std::size_t>(OpCode::History) + 1 == kMetricsOpCodeSlots, "Every opcode needs a metrics slot");
+
+//As opcodes are always 10 characters they are packed into a fixed-width key (the first 8 bytes and the last 2 bytes), so comparing two opcodes is two integer compares rather than a string compare.
+struct OpCodeKey {
+    std::uint64_t uLow = 0;
+    std::uint16_t uHigh = 0;
+};
+
+constexpr bool operator==(const OpCodeKey& keyLeft, const OpCodeKey& keyRight) {
+    return keyLeft.uLow == keyRight.uLow && keyLeft.uHigh == keyRight.uHigh;
+}
+
+constexpr bool operator!=(const OpCodeKey& keyLeft, const OpCodeKey& keyRight) {
+    return !(keyLeft == keyRight);
+}
+
+//Pack the first 10 characters of svOpCode into a key. The caller must make sure at least 10 characters are available.
+//Bytes are packed little-endian, which compilers fold into plain loads.
+constexpr OpCodeKey makeOpCodeKey(std::string_view svOpCode) {
+    OpCodeKey key;
+    for (std::size_t i = 0; i < 8; i++) {
+        key.uLow |= static_cast<std::uint64_t>(static_cast<unsigned char>(svOpCode[i])) << (8 * i);
+    }
+    key.uHigh = static_cast<std::uint16_t>(static_cast<unsigned char>(svOpCode[8]) | (static_cast<unsigned char>(svOpCode[9]) << 8));
+    return key;
+}
+
+//Hash a key down to uBits bits. Multiplicative hashing spreads the differing opcode characters into the top bits, which are the ones kept.
+constexpr std::size_t hashOpCodeKey(const OpCodeKey& key, unsigned uBits) {
+    std::uint64_t uMixed = key.uLow ^ key.uHigh ^ (static_cast<std::uint64_t>(key.uHigh) << 48);
+    return static_cast<std::size_t>((uMixed * 0x9E3779B97F4A7C15ull) >> (64 - uBits));
+}
+
+//Pairing of an opcode key with the opcode it identifies.
+struct OpCodeEntry {
+    OpCodeKey key;
+    OpCode eOpCode = OpCode::Unknown;
+};
+
+//The built-in opcodes.
+inline constexpr std::array<OpCodeEntry, 5> kBuiltInOpCodes = { {
+    { makeOpCodeKey("RUN_NO____"), OpCode::RunNumber },
+    { makeOpCodeKey("POLAR_NO__"), OpCode::PolarNumber },
+    { makeOpCodeKey("USR_MSG___"), OpCode::UserMessage },
+    { makeOpCodeKey("D_USR_FLD_"), OpCode::UserFields },
+    { makeOpCodeKey("HISTORY___"), OpCode::History }
+} };
+
+//The dispatch table has 16 slots, enough for the built-in opcodes to hash without collisions.
+constexpr unsigned kOpCodeTableBits = 4;
+constexpr std::size_t kOpCodeTableSize = std::size_t(1) << kOpCodeTableBits;
+
+//Check at compile time that no two built-in opcodes share a slot, which makes the table a perfect hash.
+constexpr bool isPerfectOpCodeTable() {
+    for (std::size_t i = 0; i < kBuiltInOpCodes.size(); i++) {
+        for (std::size_t j = i + 1; j < kBuiltInOpCodes.size(); j++) {
+            if (hashOpCodeKey(kBuiltInOpCodes[i].key, kOpCodeTableBits) == hashOpCodeKey(kBuiltInOpCodes[j].key, kOpCodeTableBits)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+static_assert(isPerfectOpCodeTable(), "Built-in opcodes collide in the dispatch table, change kOpCodeTableBits or the hash");
+
+//Build the dispatch table, empty slots hold a zero key mapped to Unknown.
+constexpr std::array<OpCodeEntry, kOpCodeTableSize> makeOpCodeTable() {
+    std::array<OpCodeEntry, kOpCodeTableSize> arrTable{};
+    for (const OpCodeEntry& entry : kBuiltInOpCodes) {
+        arrTable[hashOpCodeKey(entry.key, kOpCodeTableBits)] = entry;
+    }
+    return arrTable;
+}
+inline constexpr std::array<OpCodeEntry, kOpCodeTableSize> kOpCodeTable = makeOpCodeTable();
+
+//Look up an opcode with one hash and one key compare, so every opcode (including unknown ones) costs the same.
+constexpr OpCode lookupOpCode(const OpCodeKey& key) {
+    const OpCodeEntry& entry = kOpCodeTable[hashOpCodeKey(key, kOpCodeTableBits)];
+    return entry.key == key ? entry.eOpCode : OpCode::Unknown;
+}
+
+//What an extension did with an opcode that isn't built in.
+enum class HandlerOutcome : std::uint8_t {
+    NotHandled,
+    Handled,
+    HandledWithoutHistory
+};
+
+//Scheduling class of an opcode in a CommandPipeline. High messages are decoded first and passed to the sink as soon as they are decoded,
+//ahead of Normal messages that arrived before them, while the history still records every opcode in arrival order.
+enum class CommandPriority : std::uint8_t {
+    High,
+    Normal
+};
+
+//Number of priority classes, a CommandPipeline has a queue for each.
+constexpr std::size_t kPriorityLanes = 2;
+
+//The control opcodes RUN_NO____, POLAR_NO__ and USR_MSG___ are High. D_USR_FLD_ and HISTORY___, which reports the history as of its position, are Normal.
+constexpr CommandPriority defaultPriority(OpCode eOpCode) {
+    return eOpCode == OpCode::RunNumber || eOpCode == OpCode::PolarNumber || eOpCode == OpCode::UserMessage ? CommandPriority::High : CommandPriority::Normal;
+}
+
+//Priority of every opcode, the defaults for built-in opcodes and Normal for the rest until changed.
+//Overrides for opcodes that aren't built in are few, so they are a short array searched only for those opcodes.
+class PriorityTable {
+public:
+    PriorityTable() {
+        for (std::size_t i = 0; i < kBuiltInCount; i++) {
+            m_arrBuiltIn[i] = defaultPriority(static_cast<OpCode>(i));
+        }
+    }
+
+    //Set the priority of a 10 character opcode. Returns false if it isn't 10 characters or too many opcodes that aren't built in have been set.
+    bool set(std::string_view svOpCode, CommandPriority ePriority) {
+        if (svOpCode.length() != kOpCodeLength) {
+            return false;
+        }
+        OpCodeKey key = makeOpCodeKey(svOpCode);
+        OpCode eOpCode = lookupOpCode(key);
+        if (eOpCode != OpCode::Unknown) {
+            m_arrBuiltIn[static_cast<std::size_t>(eOpCode)] = ePriority;
+            return true;
+        }
+        for (std::size_t i = 0; i < m_uOverrides; i++) {
+            if (m_arrOverrides[i].key == key) {
+                m_arrOverrides[i].ePriority = ePriority;
+                return true;
+            }
+        }
+        if (m_uOverrides == kMaxOverrides) {
+            return false;
+        }
+        m_arrOverrides[m_uOverrides++] = { key, ePriority };
+        return true;
+    }
+
+    //Priority of a message, from its opcode. Messages too short to have one are Normal.
+    CommandPriority get(std::string_view svMessage) const {
+        if (svMessage.length() < kOpCodeLength) {
+            return CommandPriority::Normal;
+        }
+        OpCodeKey key = makeOpCodeKey(svMessage);
+        OpCode eOpCode = lookupOpCode(key);
+        if (eOpCode != OpCode::Unknown) {
+            return m_arrBuiltIn[static_cast<std::size_t>(eOpCode)];
+        }
+        for (std::size_t i = 0; i < m_uOverrides; i++) {
+            if (m_arrOverrides[i].key == key) {
+                return m_arrOverrides[i].ePriority;
+            }
+        }
+        return CommandPriority::Normal;
+    }
+
+private:
+    static constexpr std::size_t kBuiltInCount = static_cast<std::size_t>(OpCode::History) + 1;
+    static constexpr std::size_t kMaxOverrides = 16;
+
+    struct Override {
+        OpCodeKey key;
+        CommandPriority ePriority = CommandPriority::Normal;
+    };
+
+    std::array<CommandPriority, kBuiltInCount> m_arrBuiltIn{};
+    std::array<Override, kMaxOverrides> m_arrOverrides{};
+    std::size_t m_uOverrides = 0;
+};
+
+//Handler for a user-registered opcode, it receives the message content with the opcode and trailing # removed.
+using OpCodeHandler = std::function<void(std::string_view svMessageContent)>;
+
+//Runtime registry of site-specific opcodes, consulted by the parser for any opcode that isn't built in.
+//Handlers are kept in a small open-addressed table keyed on the packed opcode, so lookup is a hash and usually a single compare.
+class HandlerRegistry {
+public:
+    //Register a handler for a 10 character opcode. If bRecordHistory is set the opcode is added to the history whenever it is handled.
+    //Returns false if the opcode isn't 10 characters, is built in, is already registered, or the registry is full.
+    bool registerHandler(std::string_view svOpCode, OpCodeHandler handler, bool bRecordHistory = true) {
+        if (svOpCode.length() != kOpCodeLength || !handler || m_uCount >= kMaxHandlers) {
+            return false;
+        }
+        OpCodeKey key = makeOpCodeKey(svOpCode);
+        if (lookupOpCode(key) != OpCode::Unknown) {
+            return false;
+        }
+        //Linear probe from the hashed slot until we find the key or an empty slot.
+        std::size_t uSlot = hashOpCodeKey(key, kTableBits);
+        while (m_arrEntries[uSlot].handler) {
+            if (m_arrEntries[uSlot].key == key) {
+                return false;
+            }
+            uSlot = (uSlot + 1) & (kTableSize - 1);
+        }
+        m_arrEntries[uSlot] = { key, std::move(handler), bRecordHistory };
+        m_uCount++;
+        return true;
+    }
+
+    //Number of registered handlers.
+    std::size_t size() const {
+        return m_uCount;
+    }
+
+    //Set the priority of an opcode in a CommandPipeline, built in or not and whether or not it has a handler (see PriorityTable::set).
+    //Set priorities before a pipeline starts, its reader thread reads them without locking.
+    bool setPriority(std::string_view svOpCode, CommandPriority ePriority) {
+        return m_priorities.set(svOpCode, ePriority);
+    }
+
+    CommandPriority priority(std::string_view svMessage) const {
+        return m_priorities.get(svMessage);
+    }
+
+    //Run the handler registered for key, if any.
+    HandlerOutcome operator()(const OpCodeKey& key, std::string_view svMessageContent) const {
+        if (m_uCount == 0) {
+            return HandlerOutcome::NotHandled;
+        }
+        std::size_t uSlot = hashOpCodeKey(key, kTableBits);
+        while (m_arrEntries[uSlot].handler) {
+            if (m_arrEntries[uSlot].key == key) {
+                m_arrEntries[uSlot].handler(svMessageContent);
+                return m_arrEntries[uSlot].bRecordHistory ? HandlerOutcome::Handled : HandlerOutcome::HandledWithoutHistory;
+            }
+            uSlot = (uSlot + 1) & (kTableSize - 1);
+        }
+        return HandlerOutcome::NotHandled;
+    }
+
+private:
+    //64 slots, filled to at most three quarters so probe sequences stay short.
+    static constexpr unsigned kTableBits = 6;
+    static constexpr std::size_t kTableSize = std::size_t(1) << kTableBits;
+    static constexpr std::size_t kMaxHandlers = kTableSize * 3 / 4;
+
+    struct Entry {
+        OpCodeKey key;
+        OpCodeHandler handler;
+        bool bRecordHistory = true;
+    };
+
+    std::array<Entry, kTableSize> m_arrEntries;
+    std::size_t m_uCount = 0;
+    PriorityTable m_priorities;
+};
+
+//Compile-time set of site-specific handlers. Each THandler provides a static constexpr OpCodeKey kOpCode and a call operator taking the message content.
+//Dispatch is a chain of inlined key compares with the handlers called directly, so there is no std::function or virtual call per message.
+//Handlers handled here are always added to the history.
+template <typename... THandlers>
+class StaticHandlers {
+public:
+    static_assert(((lookupOpCode(THandlers::kOpCode) == OpCode::Unknown) && ...), "Static handlers cannot replace built-in opcodes");
+
+    StaticHandlers() = default;
+    explicit StaticHandlers(THandlers... handlers) : m_tupHandlers(std::move(handlers)...) {}
+
+    //Access a handler, e.g. to read back state it has collected.
+    template <typename THandler>
+    THandler& get() {
+        return std::get<THandler>(m_tupHandlers);
+    }
+
+    //Run the handler whose opcode matches key, if any.
+    HandlerOutcome operator()(const OpCodeKey& key, std::string_view svMessageContent) {
+        return dispatch(key, svMessageContent, std::index_sequence_for<THandlers...>{}) ? HandlerOutcome::Handled : HandlerOutcome::NotHandled;
+    }
+
+    //Pipeline priorities, as for HandlerRegistry.
+    bool setPriority(std::string_view svOpCode, CommandPriority ePriority) {
+        return m_priorities.set(svOpCode, ePriority);
+    }
+
+    CommandPriority priority(std::string_view svMessage) const {
+        return m_priorities.get(svMessage);
+    }
+
+private:
+    template <std::size_t... Is>
+    bool dispatch(const OpCodeKey& key, std::string_view svMessageContent, std::index_sequence<Is...>) {
+        return ((key == THandlers::kOpCode && (std::get<Is>(m_tupHandlers)(svMessageContent), true)) || ...);
+    }
+
+    std::tuple<THandlers...> m_tupHandlers;
+    PriorityTable m_priorities;
+};
+
+//Vector that keeps its first N elements inline and only uses the heap once it grows past N, so typical sizes never allocate. T must be trivially copyable.
+//Heap capacity is kept across clear(), so a reused SmallVector stops allocating once it has seen its largest size.
+template <typename T, std::size_t N>
+class SmallVector {
+public:
+    void push_back(const T& value) {
+        if (m_uSize < N) {
+            m_arrInline[m_uSize] = value;
+        }
+        else {
+            //On the first element past the inline capacity, move everything to the heap.
+            if (m_uSize == N) {
+                m_vecOverflow.assign(m_arrInline.begin(), m_arrInline.end());
+            }
+            m_vecOverflow.push_back(value);
+        }
+        m_uSize++;
+    }
+
+    void clear() {
+        m_uSize = 0;
+        m_vecOverflow.clear();
+    }
+
+    std::size_t size() const {
+        return m_uSize;
+    }
+
+    bool empty() const {
+        return m_uSize == 0;
+    }
+
+    const T* data() const {
+        return m_uSize > N ? m_vecOverflow.data() : m_arrInline.data();
+    }
+
+    const T& operator[](std::size_t i) const {
+        return data()[i];
+    }
+
+    const T* begin() const {
+        return data();
+    }
+
+    const T* end() const {
+        return data() + m_uSize;
+    }
+
+private:
+    std::array<T, N> m_arrInline{};
+    std::vector<T> m_vecOverflow;
+    std::size_t m_uSize = 0;
+};
+
+//A parameter name/value pair viewed in place in a D_USR_FLD_ message.
+//Parameter names longer than this are rejected.
+constexpr std::size_t kMaxParameterNameLength = 15;
+
+//A name/value pair from D_USR_FLD_ content. bNameTooLong is set when the name is over kMaxParameterNameLength.
+struct ParameterToken {
+    std::string_view svName;
+    std::string_view svValue;
+    bool bNameTooLong = false;
+};
+
+//Number of parameter pairs a D_USR_FLD_ message can have before the tokenizer spills onto the heap.
+constexpr std::size_t kInlineParameterCount = 128;
+
+//Parameter pairs for one D_USR_FLD_ message.
+using ParameterTokens = SmallVector<ParameterToken, kInlineParameterCount>;
+
+//Split D_USR_FLD_ content on commas into name/value pairs in a single pass, without copying. Empty tokens are ignored.
+//Commas are found with the vectorised scanDelimiters, and name lengths are checked as each pair is completed.
+//TContainer needs clear() and push_back(ParameterToken), e.g. ParameterTokens or std::vector<ParameterToken>.
+//Returns false if there is an odd number of tokens, i.e. a parameter name with no value.
+template <typename TContainer>
+bool tokenizeParameters(std::string_view svContent, TContainer& parameters) {
+    parameters.clear();
+    std::string_view svPendingName;
+    bool bHaveName = false;
+    std::size_t uStart = 0;
+    //Take the token ending at uEnd, the last token runs to the end of the content.
+    auto takeToken = [&](std::size_t uEnd) {
+        //Ignore empty tokens, otherwise alternate between taking a name and completing a pair with its value.
+        if (uEnd > uStart) {
+            std::string_view svToken(svContent.data() + uStart, uEnd - uStart);
+            if (bHaveName) {
+                parameters.push_back({ svPendingName, svToken, svPendingName.length() > kMaxParameterNameLength });
+            }
+            else {
+                svPendingName = svToken;
+            }
+            bHaveName = !bHaveName;
+        }
+        uStart = uEnd + 1;
+    };
+    scanDelimiters(svContent, ',', takeToken);
+    takeToken(svContent.length());
+    return !bHaveName;
+}
+
+//Number of previous opcodes shown by HISTORY___ unless a different depth is set.
+constexpr std::size_t kDefaultHistoryDepth = 5;
+
+//Fixed-capacity circular buffer holding the history of recognised opcodes, newest first.
+//Opcodes are stored inline as 10 characters, so recording one is a 10 byte copy with no allocation.
+//N is the capacity fixed at compile time, the depth (how many entries are kept and reported) can be changed at runtime up to N.
+template <std::size_t N>
+class HistoryRing {
+public:
+    static_assert(N > 0, "HistoryRing needs a capacity of at least one entry");
+
+    explicit HistoryRing(std::size_t uDepth = kDefaultHistoryDepth) {
+        setDepth(uDepth);
+    }
+
+    //Maximum depth, fixed at compile time.
+    static constexpr std::size_t capacity() {
+        return N;
+    }
+
+    //Set how many opcodes are kept, clamped to the capacity. Reducing the depth drops the oldest entries.
+    void setDepth(std::size_t uDepth) {
+        m_uDepth = uDepth < N ? uDepth : N;
+        if (m_uSize > m_uDepth) {
+            m_uSize = m_uDepth;
+        }
+    }
+
+    std::size_t depth() const {
+        return m_uDepth;
+    }
+
+    std::size_t size() const {
+        return m_uSize;
+    }
+
+    bool empty() const {
+        return m_uSize == 0;
+    }
+
+    //Add an opcode as the newest entry, overwriting the oldest once the history is at its depth.
+    void push(std::string_view svOpCode) {
+        std::array<char, kOpCodeLength>& arrEntry = m_arrEntries[m_uNext];
+        for (std::size_t i = 0; i < kOpCodeLength; i++) {
+            arrEntry[i] = i < svOpCode.length() ? svOpCode[i] : ' ';
+        }
+        m_uNext = (m_uNext + 1) % N;
+        if (m_uSize < m_uDepth) {
+            m_uSize++;
+        }
+    }
+
+    //Entry i of the history, where 0 is the most recent opcode.
+    std::string_view operator[](std::size_t i) const {
+        const std::array<char, kOpCodeLength>& arrEntry = m_arrEntries[(m_uNext + N - 1 - i) % N];
+        return std::string_view(arrEntry.data(), kOpCodeLength);
+    }
+
+    void clear() {
+        m_uSize = 0;
+    }
+
+private:
+    std::array<std::array<char, kOpCodeLength>, N> m_arrEntries{};
+    std::size_t m_uNext = 0;
+    std::size_t m_uSize = 0;
+    std::size_t m_uDepth = 0;
+};
+
+//Capacity of the parser's history. The default depth matches HISTORY___ showing the last 5 entries, more can be kept for post-run diagnostics.
+constexpr std::size_t kHistoryCapacity = 1024;
+
+//History type used by the parser.
+using CommandHistory = HistoryRing<kHistoryCapacity>;
+
+//Largest message the framer will buffer while waiting for its '#'. Anything longer is dropped up to the next '#'.
+constexpr std::size_t kDefaultMaxFrameLength = 64 * 1024;
+
+//Splits a byte stream (e.g. from a TCP or serial link) into '#' terminated messages, where chunks can split or join messages at any point.
+//Messages lying wholly inside a chunk are passed on as views into the chunk. Only a message split across chunks is copied, into a buffer that is reused.
+//Line breaks between messages are skipped, so a capture with one message per line frames the same as a raw stream.
+class MessageFramer {
+public:
+    explicit MessageFramer(std::size_t uMaxFrameLength = kDefaultMaxFrameLength) : m_uMaxFrameLength(uMaxFrameLength) {}
+
+    //Frame a chunk, calling onMessage(std::string_view) with every complete message (including its '#').
+    //Any trailing partial message is carried over to the next chunk.
+    template <typename TCallback>
+    void feed(std::string_view svChunk, TCallback&& onMessage) {
+        std::string_view svMessage;
+        while (next(svChunk, svMessage)) {
+            onMessage(svMessage);
+        }
+    }
+
+    //Take the next complete message from svChunk, advancing svChunk past it.
+    //Returns false once svChunk is used up, with any partial message buffered. A message finished from the buffer is valid until the next call.
+    bool next(std::string_view& svChunk, std::string_view& svMessage) {
+        //The buffered message was handed out by the previous call, so it can be reused now.
+        if (m_bPartialTaken) {
+            m_strPartial.clear();
+            m_bPartialTaken = false;
+        }
+        while (!svChunk.empty()) {
+            //Skip line breaks between messages.
+            if (m_strPartial.empty() && !m_bDiscarding) {
+                std::size_t uStart = svChunk.find_first_not_of("\r\n");
+                if (uStart == std::string_view::npos) {
+                    svChunk = {};
+                    break;
+                }
+                svChunk.remove_prefix(uStart);
+            }
+            //memchr is vectorised by the C library, so this finds the delimiter many bytes at a time.
+            const char* pTerminator = static_cast<const char*>(std::memchr(svChunk.data(), '#', svChunk.length()));
+            //No terminator, so buffer the rest of the chunk unless the message has grown too long.
+            if (pTerminator == nullptr) {
+                if (!m_bDiscarding) {
+                    if (m_strPartial.length() + svChunk.length() > m_uMaxFrameLength) {
+                        dropPartial();
+                    }
+                    else {
+                        m_strPartial.append(svChunk);
+                    }
+                }
+                svChunk = {};
+                break;
+            }
+            std::size_t uLength = static_cast<std::size_t>(pTerminator - svChunk.data()) + 1;
+            std::string_view svHead = svChunk.substr(0, uLength);
+            svChunk.remove_prefix(uLength);
+            //This # ends a message that was too long, resume framing after it.
+            if (m_bDiscarding) {
+                m_bDiscarding = false;
+                continue;
+            }
+            if (m_strPartial.length() + uLength > m_uMaxFrameLength) {
+                m_strPartial.clear();
+                m_uDroppedFrames++;
+                continue;
+            }
+            //Whole message inside the chunk, pass it on without copying.
+            if (m_strPartial.empty()) {
+                svMessage = svHead;
+                return true;
+            }
+            //Otherwise finish the buffered message.
+            m_strPartial.append(svHead);
+            svMessage = m_strPartial;
+            m_bPartialTaken = true;
+            return true;
+        }
+        return false;
+    }
+
+    //Frame a buffer that starts on a message boundary entirely in place, calling onMessage(std::string_view) with every complete message.
+    //Line breaks between messages are skipped as in next(). Returns the trailing bytes after the last '#', which the caller can carry into the next buffer.
+    template <typename TCallback>
+    static std::string_view frameBuffer(std::string_view svBuffer, TCallback&& onMessage) {
+        while (!svBuffer.empty()) {
+            std::size_t uStart = svBuffer.find_first_not_of("\r\n");
+            if (uStart == std::string_view::npos) {
+                return {};
+            }
+            svBuffer.remove_prefix(uStart);
+            const char* pTerminator = static_cast<const char*>(std::memchr(svBuffer.data(), '#', svBuffer.length()));
+            if (pTerminator == nullptr) {
+                break;
+            }
+            std::size_t uLength = static_cast<std::size_t>(pTerminator - svBuffer.data()) + 1;
+            onMessage(svBuffer.substr(0, uLength));
+            svBuffer.remove_prefix(uLength);
+        }
+        return svBuffer;
+    }
+
+    //Number of bytes of a partial message waiting for its '#'.
+    std::size_t pendingLength() const {
+        return m_bPartialTaken ? 0 : m_strPartial.length();
+    }
+
+    //Number of messages dropped for being longer than the maximum frame length.
+    std::size_t droppedFrames() const {
+        return m_uDroppedFrames;
+    }
+
+    //Forget any partial message, e.g. after the connection is re-established.
+    void reset() {
+        m_strPartial.clear();
+        m_bPartialTaken = false;
+        m_bDiscarding = false;
+    }
+
+private:
+    void dropPartial() {
+        m_strPartial.clear();
+        m_bDiscarding = true;
+        m_uDroppedFrames++;
+    }
+
+    std::string m_strPartial;
+    std::size_t m_uMaxFrameLength;
+    std::size_t m_uDroppedFrames = 0;
+    bool m_bPartialTaken = false;
+    bool m_bDiscarding = false;
+};
+
+//Run number from a RUN_NO____ message.
+struct RunNumber {
+    int iRunNumber = 0;
+};
+
+//Polar number from a POLAR_NO__ message.
+struct PolarNumber {
+    int iPolarNumber = 0;
+};
+
+//Run or polar number recorded before the first RUN_NO____ or POLAR_NO__ message.
+constexpr std::int32_t kNoContext = std::numeric_limits<std::int32_t>::min();
+
+//The latest RUN_NO____ and POLAR_NO__ values, which the D_USR_FLD_ values that follow belong to.
+struct RunContext {
+    std::int32_t iRunNumber = kNoContext;
+    std::int32_t iPolarNumber = kNoContext;
+};
+
+//Text of a USR_MSG___ message, viewed in the input.
+struct UserMessage {
+    std::string_view svMessage;
+};
+
+//Outcome of parsing a single D_USR_FLD_ parameter.
+enum class ParameterStatus : std::uint8_t {
+    Valid,
+    NameTooLong,
+    InvalidValue
+};
+
+//A D_USR_FLD_ parameter. The name and value text are viewed in the input and dblValue is only set when eStatus is Valid.
+struct Parameter {
+    std::string_view svName;
+    std::string_view svValue;
+    double dblValue = 0.0;
+    ParameterStatus eStatus = ParameterStatus::Valid;
+};
+
+//Parameters from a D_USR_FLD_ message, in message order. The storage belongs to the parser and is reused by the next message.
+struct ParameterList {
+    const Parameter* pParameters = nullptr;
+    std::size_t uCount = 0;
+    //Run and polar numbers in force when the message was dispatched, set by the parser in message order.
+    RunContext context;
+
+    std::size_t size() const {
+        return uCount;
+    }
+
+    const Parameter* begin() const {
+        return pParameters;
+    }
+
+    const Parameter* end() const {
+        return pParameters + uCount;
+    }
+};
+
+//Default number of frames a SchemaBuffer holds before it wraps around.
+constexpr std::size_t kDefaultSchemaRows = 1024;
+
+//Ordered list of the parameter names expected in every D_USR_FLD_ message of a run.
+class ParameterSchema {
+public:
+    ParameterSchema() = default;
+
+    ParameterSchema(std::initializer_list<std::string_view> names) {
+        for (std::string_view svName : names) {
+            addField(svName);
+        }
+    }
+
+    //Add the next expected name. Returns false, leaving the schema unchanged, if the name could never match:
+    //it is empty, longer than kMaxParameterNameLength or contains a ',' or '#'.
+    bool addField(std::string_view svName) {
+        if (svName.empty() || svName.length() > kMaxParameterNameLength || svName.find_first_of(",#") != std::string_view::npos) {
+            return false;
+        }
+        m_vecNames.emplace_back(svName);
+        return true;
+    }
+
+    std::size_t size() const {
+        return m_vecNames.size();
+    }
+
+    std::string_view name(std::size_t uField) const {
+        return m_vecNames[uField];
+    }
+
+private:
+    std::vector<std::string> m_vecNames;
+};
+
+//Struct-of-arrays store for D_USR_FLD_ messages that match a schema: one column of values per field, one row per message.
+//Rows form a ring of uRows, so once full the oldest row is overwritten. Consumers read a column as a contiguous array of doubles.
+class SchemaBuffer {
+public:
+    explicit SchemaBuffer(ParameterSchema schema, std::size_t uRows = kDefaultSchemaRows)
+        : m_schema(std::move(schema)), m_uRows(uRows == 0 ? 1 : uRows), m_uStride(m_uRows + kColumnPadding), m_vecValues(m_schema.size() * m_uStride),
+          m_vecStaging(m_schema.size()) {}
+
+    //Match D_USR_FLD_ content against the schema and, if every name is in place and every value is a valid number, write the values into the next row.
+    //Anything else, e.g. a missing or reordered name, an empty field or a bad value, returns false so the message goes through the general path.
+    //On success uRow is the row written. Nothing is written until the whole frame has matched, so a failed frame leaves every row as it was.
+    bool appendFrame(std::string_view svContent, std::size_t& uRow) {
+        //Each name is matched in place, as the schema gives its length, so only values are searched for the comma that ends them. Values are
+        //short, and findDelimiter's inlined 16 byte compare finds the comma in one step where a memchr call costs more than the search.
+        //Names can't contain a comma, so this splits the content exactly as tokenizeParameters would.
+        std::size_t uOffset = 0;
+        for (std::size_t uField = 0; uField < m_schema.size(); uField++) {
+            std::string_view svName = m_schema.name(uField);
+            if (uOffset + svName.length() >= svContent.length() || svContent[uOffset + svName.length()] != ','
+                || svContent.compare(uOffset, svName.length(), svName) != 0) {
+                return fallBack();
+            }
+            uOffset += svName.length() + 1;
+            std::size_t uEnd = findDelimiter(svContent, ',', uOffset);
+            if (uEnd == std::string_view::npos) {
+                uEnd = svContent.length();
+            }
+            //Staged, as once the ring has wrapped the next row still holds the oldest published frame.
+            if (uEnd == uOffset || parseDouble(svContent.substr(uOffset, uEnd - uOffset), m_vecStaging[uField]) != std::errc()) {
+                return fallBack();
+            }
+            uOffset = uEnd + 1;
+        }
+        //Only trailing commas, i.e. empty tokens, may follow the last value.
+        if (svContent.find_first_not_of(',', uOffset) != std::string_view::npos) {
+            return fallBack();
+        }
+        std::size_t uNextRow = static_cast<std::size_t>(m_uFrames % m_uRows);
+        for (std::size_t uField = 0; uField < m_schema.size(); uField++) {
+            m_vecValues[uField * m_uStride + uNextRow] = m_vecStaging[uField];
+        }
+        uRow = uNextRow;
+        m_uFrames++;
+        return true;
+    }
+
+    const ParameterSchema& schema() const {
+        return m_schema;
+    }
+
+    //Values of one field, indexed by row.
+    const double* column(std::size_t uField) const {
+        return m_vecValues.data() + uField * m_uStride;
+    }
+
+    double value(std::size_t uField, std::size_t uRow) const {
+        return m_vecValues[uField * m_uStride + uRow];
+    }
+
+    //Number of rows before the buffer wraps.
+    std::size_t rowCapacity() const {
+        return m_uRows;
+    }
+
+    //Messages written so far. The latest is in row (frames() - 1) % rowCapacity().
+    std::uint64_t frames() const {
+        return m_uFrames;
+    }
+
+    //D_USR_FLD_ messages that didn't match the schema.
+    std::uint64_t fallbacks() const {
+        return m_uFallbacks;
+    }
+
+private:
+    bool fallBack() {
+        m_uFallbacks++;
+        return false;
+    }
+
+    ParameterSchema m_schema;
+    //Doubles between the start of one column and the next: a cache line more than the rows. Writing a row stores one value per column, and with
+    //an unpadded power of two stride (e.g. 8KB for 1024 rows) every one of those stores maps to the same few cache sets and evicts the others.
+    static constexpr std::size_t kColumnPadding = 64 / sizeof(double);
+
+    std::size_t m_uRows;
+    std::size_t m_uStride;
+    //Column-major, field f of row r is at f * m_uStride + r.
+    std::vector<double> m_vecValues;
+    //Values of the frame being matched, one per field.
+    std::vector<double> m_vecStaging;
+    std::uint64_t m_uFrames = 0;
+    std::uint64_t m_uFallbacks = 0;
+};
+
+//A D_USR_FLD_ message that matched the parser's schema, its values are in row uRow of the buffer. Every parameter is valid.
+struct SchemaFrame {
+    const SchemaBuffer* pBuffer = nullptr;
+    std::size_t uRow = 0;
+    //As for ParameterList.
+    RunContext context;
+};
+
+//A HISTORY___ request, giving the history as it stood when the request arrived.
+struct HistoryQuery {
+    const CommandHistory* pHistory = nullptr;
+};
+
+//Why a message was rejected.
+enum class ParseErrorReason : std::uint8_t {
+    MissingTerminator,
+    TooShort,
+    UnknownOpCode,
+    InvalidRunNumber,
+    InvalidPolarNumber,
+    OddParameterCount,
+    //A binary frame whose payload doesn't fit its opcode (see BinaryProtocol.h).
+    InvalidBinaryPayload,
+    //Rejected by validation, see ValidationRules.
+    MessageTooLong,
+    InvalidCharacter,
+    TooManyParameters
+};
+
+static_assert(static_cast<std::size_t>(ParseErrorReason::TooManyParameters) + 1 == kMetricsReasonSlots, "Every rejection reason needs a metrics slot");
+
+//A rejected message. svOpCode is empty if the message was rejected before the opcode was read, svText is the text at fault.
+struct ParseError {
+    ParseErrorReason eReason = ParseErrorReason::UnknownOpCode;
+    std::string_view svOpCode;
+    std::string_view svText;
+};
+
+//Typed result of parsing one message. String views point into the input message (or parser storage) and are only valid until the next message is parsed.
+using ParseResult = std::variant<RunNumber, PolarNumber, UserMessage, ParameterList, SchemaFrame, HistoryQuery, ParseError>;
+
+//Receives the result of every message the parser handles. Messages handled by a registered or static handler don't produce a result.
+class ResultSink {
+public:
+    virtual ~ResultSink() = default;
+    virtual void onResult(const ParseResult& result) = 0;
+};
+
+//Told about every opcode the parser records in its history, e.g. to mirror the history somewhere other threads can read it.
+//Called on the thread that commits messages.
+class HistoryListener {
+public:
+    virtual ~HistoryListener() = default;
+    virtual void onRecord(std::string_view svOpCode) = 0;
+
+    //The parser's history was emptied and now keeps uDepth entries, e.g. before a snapshot replays its entries through onRecord.
+    virtual void onClear(std::size_t /*uDepth*/) {}
+};
+
+//Write a result as the console text the parser has always printed. Errors other than invalid run or polar numbers print nothing.
+inline void writeResult(std::ostream& os, const ParseResult& result) {
+    std::visit([&os](const auto& value) {
+        using T = std::decay_t<decltype(value)>;
+        if constexpr (std::is_same_v<T, RunNumber>) {
+            os << "Run number: " << value.iRunNumber << "\n";
+        }
+        else if constexpr (std::is_same_v<T, PolarNumber>) {
+            os << "Polar number: " << value.iPolarNumber << "\n";
+        }
+        else if constexpr (std::is_same_v<T, UserMessage>) {
+            os << value.svMessage << "\n";
+        }
+        else if constexpr (std::is_same_v<T, ParameterList>) {
+            os << "Parameters:\n";
+            for (const Parameter& parameter : value) {
+                switch (parameter.eStatus) {
+                case ParameterStatus::Valid:
+                    os << parameter.svName << " = " << parameter.dblValue << "\n";
+                    break;
+                case ParameterStatus::NameTooLong:
+                    os << "Parameter name too long: " << parameter.svName << "\n";
+                    break;
+                case ParameterStatus::InvalidValue:
+                    os << "Invalid parameter value for parameter: " << parameter.svName << "\n";
+                    break;
+                }
+            }
+        }
+        else if constexpr (std::is_same_v<T, SchemaFrame>) {
+            os << "Parameters:\n";
+            const ParameterSchema& schema = value.pBuffer->schema();
+            for (std::size_t uField = 0; uField < schema.size(); uField++) {
+                os << schema.name(uField) << " = " << value.pBuffer->value(uField, value.uRow) << "\n";
+            }
+        }
+        else if constexpr (std::is_same_v<T, HistoryQuery>) {
+            for (std::size_t i = 0; i < value.pHistory->size(); i++) {
+                os << (*value.pHistory)[i] << "\n";
+            }
+        }
+        else if constexpr (std::is_same_v<T, ParseError>) {
+            if (value.eReason == ParseErrorReason::InvalidRunNumber) {
+                os << "Invalid Run number: " << value.svText << "\n";
+            }
+            else if (value.eReason == ParseErrorReason::InvalidPolarNumber) {
+                os << "Invalid Polar number: " << value.svText << "\n";
+            }
+        }
+    }, result);
+}
+
+//Sink that prints results to a stream, std::cout by default.
+class ConsoleSink : public ResultSink {
+public:
+    explicit ConsoleSink(std::ostream& os = std::cout) : m_os(os) {}
+
+    void onResult(const ParseResult& result) override {
+        writeResult(m_os, result);
+    }
+
+private:
+    std::ostream& m_os;
+};
+
+//Find a message's opcode without decoding it. Messages that aren't framed or don't have a built-in opcode are Unknown.
+inline OpCode classifyCommand(std::string_view svInput) {
+    if (svInput.length() < kOpCodeLength + 1 || svInput.back() != '#') {
+        return OpCode::Unknown;
+    }
+    return lookupOpCode(makeOpCodeKey(svInput));
+}
+
+//A message after decoding, before it has been recorded in the history or passed to the sink.
+struct DecodedCommand {
+    OpCode eOpCode = OpCode::Unknown;
+    OpCodeKey key;
+    //The opcode and message content, empty if the message was rejected before they could be read.
+    std::string_view svOpCode;
+    std::string_view svMessageContent;
+    ParseResult result;
+    //Recognised opcodes are added to the history (HISTORY___, unknown opcodes and dropped messages are excluded).
+    bool bRecordHistory = false;
+};
+
+//Adapts a Parameter vector so tokenizeParameters can fill it directly.
+struct ParameterAppender {
+    std::pmr::vector<Parameter>& vecParameters;
+
+    void clear() {
+        vecParameters.clear();
+    }
+
+    void push_back(const ParameterToken& token) {
+        vecParameters.push_back({ token.svName, token.svValue, 0.0, token.bNameTooLong ? ParameterStatus::NameTooLong : ParameterStatus::Valid });
+    }
+};
+
+//Split D_USR_FLD_ content into vecParameters and convert each value. Returns false if a parameter name has no value.
+inline bool decodeParameters(std::string_view svMessageContent, std::pmr::vector<Parameter>& vecParameters) {
+    //Split the message content on commas into parameter name and value pairs, viewed in place rather than copied.
+    ParameterAppender appender{ vecParameters };
+    if (!tokenizeParameters(svMessageContent, appender)) {
+        return false;
+    }
+    for (Parameter& parameter : vecParameters) {
+        //Names over 15 characters were marked by the tokenizer, their values aren't converted.
+        if (parameter.eStatus == ParameterStatus::NameTooLong) {
+            continue;
+        }
+        //Attempt to convert the parameter value to a double. If it fails, it's not a number and is therefore invalid.
+        if (parseDouble(parameter.svValue, parameter.dblValue) != std::errc()) {
+            parameter.eStatus = ParameterStatus::InvalidValue;
+        }
+    }
+    return true;
+}
+
+//Decode one message without touching any parser state. The input is only viewed, never copied, so the opcode and message content are sliced in place.
+//D_USR_FLD_ parameters are written to vecParameters, which is cleared first and keeps its capacity so a reused vector stops allocating.
+//The vector can allocate from any memory resource, the parser itself uses its ParseArena.
+inline void decodeCommand(std::string_view svInput, std::pmr::vector<Parameter>& vecParameters, DecodedCommand& command) {
+
+    command = DecodedCommand();
+
+    //Check whether the message ends in a #
+    if (svInput.empty() || svInput.back() != '#') {
+        command.result = ParseError{ ParseErrorReason::MissingTerminator, {}, svInput };
+        return;
+    }
+    //If the length of the input is under 11, it doesn't have enough characters for a valid opcode (10 for the opcode plus #).
+    if (svInput.length() < kOpCodeLength + 1) {
+        command.result = ParseError{ ParseErrorReason::TooShort, {}, svInput };
+        return;
+    }
+
+    //View the opcode as the first 10 letters of the input, and anything between the opcode and the trailing # as the message content.
+    command.svOpCode = svInput.substr(0, kOpCodeLength);
+    command.svMessageContent = svInput.substr(kOpCodeLength, svInput.length() - kOpCodeLength - 1);
+    std::string_view svMessageContent = command.svMessageContent;
+
+    //Pick the handler through the opcode table rather than comparing the opcode against each name in turn.
+    command.key = makeOpCodeKey(command.svOpCode);
+    command.eOpCode = lookupOpCode(command.key);
+    switch (command.eOpCode) {
+    //If the opcode is RUN_NO____ give the run number.
+    case OpCode::RunNumber: {
+        command.bRecordHistory = true;
+        //Convert the message content to an int and check whether it's a valid number.
+        int iRunNumber = 0;
+        if (parseInt(svMessageContent, iRunNumber) == std::errc()) {
+            command.result = RunNumber{ iRunNumber };
+        }
+        else {
+            command.result = ParseError{ ParseErrorReason::InvalidRunNumber, command.svOpCode, svMessageContent };
+        }
+        break;
+    }
+    //if the opcode is POLAR_NO__ give the polar number.
+    case OpCode::PolarNumber: {
+        command.bRecordHistory = true;
+        //Convert the message content to an int and check whether it's a valid number.
+        int iPolarNumber = 0;
+        if (parseInt(svMessageContent, iPolarNumber) == std::errc()) {
+            command.result = PolarNumber{ iPolarNumber };
+        }
+        else {
+            command.result = ParseError{ ParseErrorReason::InvalidPolarNumber, command.svOpCode, svMessageContent };
+        }
+        break;
+    }
+    //if the opcode is USR_MSG___ give the message contents.
+    case OpCode::UserMessage: {
+        command.bRecordHistory = true;
+        command.result = UserMessage{ svMessageContent };
+        break;
+    }
+    //if the OpCode is D_USR_FLD_, give the list of parameter names and values.
+    case OpCode::UserFields: {
+        //Check whether we have an equal number of parameter names and parameter values, if not the message is dropped.
+        if (!decodeParameters(svMessageContent, vecParameters)) {
+            command.result = ParseError{ ParseErrorReason::OddParameterCount, command.svOpCode, svMessageContent };
+            break;
+        }
+        command.bRecordHistory = true;
+        command.result = ParameterList{ vecParameters.data(), vecParameters.size(), RunContext{} };
+        break;
+    }
+    //If the OpCode is HISTORY___, the parser fills in its history when the request is committed.
+    case OpCode::History: {
+        command.result = HistoryQuery{};
+        break;
+    }
+    //The entry is not a built-in OpCode, the parser offers it to its handlers when committing.
+    case OpCode::Unknown:
+    default: {
+        command.result = ParseError{ ParseErrorReason::UnknownOpCode, command.svOpCode, svMessageContent };
+        break;
+    }
+    }
+}
+
+//Decode a D_USR_FLD_ message through a schema's fast path, writing its values straight into the buffer.
+//Returns false, leaving command untouched, if the message isn't a framed D_USR_FLD_ message matching the schema.
+inline bool decodeSchemaFrame(std::string_view svInput, SchemaBuffer& buffer, DecodedCommand& command) {
+    if (classifyCommand(svInput) != OpCode::UserFields) {
+        return false;
+    }
+    std::string_view svMessageContent = svInput.substr(kOpCodeLength, svInput.length() - kOpCodeLength - 1);
+    std::size_t uRow = 0;
+    if (!buffer.appendFrame(svMessageContent, uRow)) {
+        return false;
+    }
+    command = DecodedCommand();
+    command.eOpCode = OpCode::UserFields;
+    command.svOpCode = svInput.substr(0, kOpCodeLength);
+    command.key = makeOpCodeKey(command.svOpCode);
+    command.svMessageContent = svMessageContent;
+    command.result = SchemaFrame{ &buffer, uRow, RunContext{} };
+    command.bRecordHistory = true;
+    return true;
+}
+
+//Default limits for validation, see ValidationRules.
+constexpr std::size_t kDefaultMaxMessageLength = 64 * 1024;
+constexpr std::size_t kDefaultMaxParameters = 1024;
+
+//Checks run on every message before it is decoded when a parser has validation enabled, so malformed input is turned away after a quick scan
+//rather than a full parse. A message passing validation decodes exactly as it would without it.
+//- Messages longer than uMaxMessageLength are rejected as MessageTooLong.
+//- Opcodes may only hold capital letters, digits and '_', and message content may not hold control characters; either is InvalidCharacter.
+//- RUN_NO____ and POLAR_NO__ content must be a whole integer with an optional sign, with nothing after it.
+//- D_USR_FLD_ content needs an even number of tokens and at most uMaxParameters pairs, both counted without tokenizing.
+struct ValidationRules {
+    std::size_t uMaxMessageLength = kDefaultMaxMessageLength;
+    std::size_t uMaxParameters = kDefaultMaxParameters;
+};
+
+//True if svText is an optional sign and then digits only, the strict form of a run or polar number.
+inline bool isStrictInteger(std::string_view svText) {
+    std::size_t uStart = (!svText.empty() && (svText.front() == '+' || svText.front() == '-')) ? 1 : 0;
+    if (svText.length() == uStart) {
+        return false;
+    }
+    for (std::size_t i = uStart; i < svText.length(); i++) {
+        if (svText[i] < '0' || svText[i] > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Check a message against the rules without decoding it. Returns false, with the reason in eReason, if it should be rejected.
+//Messages without a '#' or too short for an opcode pass, and are rejected by decodeCommand as usual.
+inline bool validateMessage(std::string_view svInput, const ValidationRules& rules, ParseErrorReason& eReason) {
+    if (svInput.length() > rules.uMaxMessageLength) {
+        eReason = ParseErrorReason::MessageTooLong;
+        return false;
+    }
+    if (svInput.length() < kOpCodeLength + 1 || svInput.back() != '#') {
+        return true;
+    }
+    for (std::size_t i = 0; i < kOpCodeLength; i++) {
+        char chOpCode = svInput[i];
+        if (!((chOpCode >= 'A' && chOpCode <= 'Z') || (chOpCode >= '0' && chOpCode <= '9') || chOpCode == '_')) {
+            eReason = ParseErrorReason::InvalidCharacter;
+            return false;
+        }
+    }
+    std::string_view svMessageContent = svInput.substr(kOpCodeLength, svInput.length() - kOpCodeLength - 1);
+    if (findControlCharacter(svMessageContent) != std::string_view::npos) {
+        eReason = ParseErrorReason::InvalidCharacter;
+        return false;
+    }
+    switch (lookupOpCode(makeOpCodeKey(svInput))) {
+    case OpCode::RunNumber:
+        eReason = ParseErrorReason::InvalidRunNumber;
+        return isStrictInteger(svMessageContent);
+    case OpCode::PolarNumber:
+        eReason = ParseErrorReason::InvalidPolarNumber;
+        return isStrictInteger(svMessageContent);
+    case OpCode::UserFields: {
+        std::size_t uTokens = countTokens(svMessageContent, ',');
+        if (uTokens % 2 != 0) {
+            eReason = ParseErrorReason::OddParameterCount;
+            return false;
+        }
+        if (uTokens / 2 > rules.uMaxParameters) {
+            eReason = ParseErrorReason::TooManyParameters;
+            return false;
+        }
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+//Report a message validateMessage rejected. Invalid run and polar numbers are reported exactly as decodeCommand reports them.
+//Other rejections aren't recorded in the history or offered to handlers: command.svOpCode is left empty, while the error still names the opcode.
+inline void rejectCommand(std::string_view svInput, ParseErrorReason eReason, DecodedCommand& command) {
+    command = DecodedCommand();
+    if (eReason == ParseErrorReason::MessageTooLong) {
+        command.result = ParseError{ eReason, {}, svInput };
+        return;
+    }
+    std::string_view svOpCode = svInput.substr(0, kOpCodeLength);
+    std::string_view svMessageContent = svInput.substr(kOpCodeLength, svInput.length() - kOpCodeLength - 1);
+    command.key = makeOpCodeKey(svOpCode);
+    command.eOpCode = lookupOpCode(command.key);
+    command.svMessageContent = svMessageContent;
+    command.result = ParseError{ eReason, svOpCode, svMessageContent };
+    if (eReason == ParseErrorReason::InvalidRunNumber || eReason == ParseErrorReason::InvalidPolarNumber) {
+        command.svOpCode = svOpCode;
+        command.bRecordHistory = true;
+    }
+}
+
+//Count a message in the calling thread's metrics (see ParserMetrics.h), compiled out if metrics are disabled.
+inline void countDispatched(const DecodedCommand& command, bool bHandled) {
+#if COMMANDMANAGER_ENABLE_METRICS
+    MetricsShard& shard = MetricsShard::local();
+    shard.countMessage(static_cast<std::size_t>(command.eOpCode));
+    if (bHandled) {
+        shard.countHandled();
+    }
+    else if (const ParseError* pError = std::get_if<ParseError>(&command.result)) {
+        shard.countRejected(static_cast<std::size_t>(pError->eReason));
+    }
+#else
+    static_cast<void>(command);
+    static_cast<void>(bHandled);
+#endif
+}
+
+//Main class to parse command manager messages. Each message is decoded into a typed result, which is passed to the sink and recorded in the history.
+//Opcodes that aren't built in are passed to the extension as extension(key, svMessageContent), which returns a HandlerOutcome.
+//Use CommandParser for opcodes registered at runtime, or BasicCommandParser<StaticHandlers<...>> for opcodes registered at compile time.
+//Scratch storage for each message or batch comes from the parser's arena, which is reset when the next one starts.
+template <typename TExtension>
+class BasicCommandParser {
+public:
+    explicit BasicCommandParser(ResultSink& sink, TExtension extension = TExtension(), std::size_t uArenaBlockSize = kDefaultArenaBlockSize)
+        : m_pSink(&sink), m_extension(std::move(extension)), m_arena(uArenaBlockSize) {}
+
+    BasicCommandParser(const BasicCommandParser&) = delete;
+    BasicCommandParser& operator=(const BasicCommandParser&) = delete;
+
+    //Parse one message and pass its result to the sink.
+    void parse(std::string_view svInput) {
+        resetScratch();
+        parseMessage(svInput);
+    }
+
+    //Parse a batch of framed messages, e.g. from a replay or a network read.
+    //Results reach the sink, and opcodes the history, in message order exactly as parsing each message in turn would, but scratch storage is only reset once per batch.
+    void parseBatch(const std::string_view* pMessages, std::size_t uCount) {
+        resetScratch();
+        runBatch(pMessages, uCount);
+    }
+
+    void parseBatch(const std::vector<std::string_view>& vecMessages) {
+        parseBatch(vecMessages.data(), vecMessages.size());
+    }
+
+    //Frame a buffer of messages in place and parse them as one batch.
+    //Returns the trailing bytes after the last '#', which the caller can carry into the next buffer.
+    std::string_view parseBuffer(std::string_view svBuffer) {
+        resetScratch();
+        m_vecBatchFrames.reserve(m_uBatchFrameCapacity);
+        std::string_view svRemainder = MessageFramer::frameBuffer(svBuffer, [this](std::string_view svMessage) { m_vecBatchFrames.push_back(svMessage); });
+        runBatch(m_vecBatchFrames.data(), m_vecBatchFrames.size());
+        return svRemainder;
+    }
+
+    //Pass a decoded message to the sink and record it in the history. Unknown opcodes are first offered to the extension.
+    void commit(DecodedCommand& command) {
+        // Add only recognised opcodes to history (HISTORY___ and unknown opcodes are excluded)
+        if (dispatch(command)) {
+            recordHistory(command.svOpCode);
+        }
+    }
+
+    //Pass a decoded message to the extension or the sink without touching the history. Returns true if its opcode should be recorded.
+    //With bApplyContext false a RUN_NO____ / POLAR_NO__ result doesn't change the run context yet, for a message passed on ahead of earlier ones
+    //whose D_USR_FLD_ values still belong to the old context; call applyRunContext when its turn comes.
+    bool dispatch(DecodedCommand& command, bool bApplyContext = true) {
+        if (command.eOpCode == OpCode::Unknown && !command.svOpCode.empty()) {
+            //Handled opcodes don't produce a result, the handler is their consumer.
+            HandlerOutcome eOutcome = m_extension(command.key, command.svMessageContent);
+            if (eOutcome != HandlerOutcome::NotHandled) {
+                countDispatched(command, true);
+                return eOutcome == HandlerOutcome::Handled;
+            }
+        }
+        countDispatched(command, false);
+        if (bApplyContext) {
+            applyRunContext(command);
+        }
+        if (ParameterList* pParameters = std::get_if<ParameterList>(&command.result)) {
+            pParameters->context = m_runContext;
+        }
+        else if (SchemaFrame* pFrame = std::get_if<SchemaFrame>(&command.result)) {
+            pFrame->context = m_runContext;
+        }
+        else if (HistoryQuery* pQuery = std::get_if<HistoryQuery>(&command.result)) {
+            pQuery->pHistory = m_pHistory;
+        }
+        m_pSink->onResult(command.result);
+        return command.bRecordHistory;
+    }
+
+    //Update the run context from a RUN_NO____ / POLAR_NO__ message, for one dispatch() passed on earlier without applying it. Other messages are ignored.
+    void applyRunContext(const DecodedCommand& command) {
+        if (const RunNumber* pRun = std::get_if<RunNumber>(&command.result)) {
+            m_runContext.iRunNumber = pRun->iRunNumber;
+        }
+        else if (const PolarNumber* pPolar = std::get_if<PolarNumber>(&command.result)) {
+            m_runContext.iPolarNumber = pPolar->iPolarNumber;
+        }
+    }
+
+    //Add an opcode to the history, for a message that dispatch() passed on earlier and said should be recorded.
+    void recordHistory(std::string_view svOpCode) {
+        m_pHistory->push(svOpCode);
+        if (m_pHistoryListener != nullptr) {
+            m_pHistoryListener->onRecord(svOpCode);
+        }
+    }
+
+    //Empty the history, telling the listener so a mirror of it is emptied too.
+    void clearHistory() {
+        m_pHistory->clear();
+        if (m_pHistoryListener != nullptr) {
+            m_pHistoryListener->onClear(m_pHistory->depth());
+        }
+    }
+
+    //Register a handler for a site-specific opcode, forwarded to the extension (see HandlerRegistry::registerHandler).
+    template <typename... TArgs>
+    bool registerHandler(TArgs&&... args) {
+        return m_extension.registerHandler(std::forward<TArgs>(args)...);
+    }
+
+    TExtension& extension() {
+        return m_extension;
+    }
+
+    CommandHistory& history() {
+        return *m_pHistory;
+    }
+
+    const CommandHistory& history() const {
+        return *m_pHistory;
+    }
+
+    //Record opcodes in history, which must outlive the parser, rather than the parser's own history, e.g. for a history kept across short-lived parsers.
+    void useHistory(CommandHistory& history) {
+        m_pHistory = &history;
+    }
+
+    //The latest run and polar numbers passed to the sink, kNoContext until the first of each.
+    const RunContext& runContext() const {
+        return m_runContext;
+    }
+
+    //Set the run and polar context, e.g. when restoring a snapshot (see ParserSnapshot.h).
+    void setRunContext(const RunContext& context) {
+        m_runContext = context;
+    }
+
+    ResultSink& sink() {
+        return *m_pSink;
+    }
+
+    void setSink(ResultSink& sink) {
+        m_pSink = &sink;
+    }
+
+    //Set a listener told about every opcode recorded in the history, or nullptr for none.
+    void setHistoryListener(HistoryListener* pListener) {
+        m_pHistoryListener = pListener;
+    }
+
+    //Bind D_USR_FLD_ messages to a schema, or nullptr for none. Messages matching the schema are written to the buffer and reported as a SchemaFrame,
+    //others still produce a ParameterList. Applies to parse, parseBatch and parseBuffer; a CommandPipeline's workers always use the general path.
+    void setSchema(SchemaBuffer* pSchemaBuffer) {
+        m_pSchemaBuffer = pSchemaBuffer;
+    }
+
+    //Validate every message against rules before decoding it, or nullptr to decode everything as it is (the default).
+    //Applies to parse, parseBatch and parseBuffer; a CommandPipeline's workers don't validate.
+    void setValidation(const ValidationRules* pRules) {
+        m_pValidation = pRules;
+    }
+
+    //Scratch storage for the current message or batch. A sink or handler can copy text into it with ParseArena::copy
+    //to keep it after the input buffer is reused, until the next call to parse, parseBatch or parseBuffer.
+    ParseArena& arena() {
+        return m_arena;
+    }
+
+private:
+    //Parse a batch in message order, see parseBatch.
+    void runBatch(const std::string_view* pMessages, std::size_t uCount) {
+        for (std::size_t i = 0; i < uCount; i++) {
+            parseMessage(pMessages[i]);
+        }
+    }
+
+    void parseMessage(std::string_view svInput) {
+        //Only the decode is timed, as on every other path, so the latency doesn't include the history, handlers or the sink's own work.
+        LatencyTimer timer;
+        decodeMessage(svInput);
+        timer.stop(static_cast<std::size_t>(m_command.eOpCode));
+        commit(m_command);
+    }
+
+    //Decode into m_command, through the schema if one is set and the message matches it.
+    void decodeMessage(std::string_view svInput) {
+        ParseErrorReason eReason = ParseErrorReason::UnknownOpCode;
+        if (m_pValidation != nullptr && !validateMessage(svInput, *m_pValidation, eReason)) {
+            rejectCommand(svInput, eReason, m_command);
+            return;
+        }
+        if (m_pSchemaBuffer == nullptr || !decodeSchemaFrame(svInput, *m_pSchemaBuffer, m_command)) {
+            decodeCommand(svInput, m_vecParameters, m_command);
+        }
+    }
+
+    //Release the previous message or batch's scratch vectors and rewind the arena. The vectors are emptied first so nothing points into the arena as it rewinds,
+    //then the parameter vector takes back the capacity it had, in one allocation from the rewound arena, so wide D_USR_FLD_ messages don't regrow it every time.
+    void resetScratch() {
+        std::size_t uParameters = m_vecParameters.capacity();
+        if (m_vecBatchFrames.capacity() > m_uBatchFrameCapacity) {
+            m_uBatchFrameCapacity = m_vecBatchFrames.capacity();
+        }
+        m_vecParameters = std::pmr::vector<Parameter>(&m_arena);
+        m_vecBatchFrames = std::pmr::vector<std::string_view>(&m_arena);
+        m_arena.reset();
+        m_vecParameters.reserve(uParameters);
+    }
+
+    ResultSink* m_pSink;
+    HistoryListener* m_pHistoryListener = nullptr;
+    SchemaBuffer* m_pSchemaBuffer = nullptr;
+    const ValidationRules* m_pValidation = nullptr;
+    TExtension m_extension;
+    CommandHistory m_history;
+    CommandHistory* m_pHistory = &m_history;
+    RunContext m_runContext;
+    //Declared before the scratch vectors so it outlives them.
+    ParseArena m_arena;
+    //Scratch storage allocated from the arena, so once it has grown to fit, steady state parsing doesn't allocate.
+    std::pmr::vector<Parameter> m_vecParameters{ &m_arena };
+    DecodedCommand m_command;
+    //Messages framed by parseBuffer, also in the arena, and the most it has held, reserved again only by parseBuffer.
+    std::pmr::vector<std::string_view> m_vecBatchFrames{ &m_arena };
+    std::size_t m_uBatchFrameCapacity = 0;
+};
+
+//Parser with site-specific opcodes registered at runtime.
+using CommandParser = BasicCommandParser<HandlerRegistry>;
+
+//Scratch storage and run context for parseCommand, one per thread so the free function stays cheap and reentrant across threads.
+struct LegacyParseState {
+    //Keeps its capacity between calls, so D_USR_FLD_ parameters only allocate when a message is wider than any before it on this thread.
+    std::pmr::vector<Parameter> vecParameters;
+    DecodedCommand command;
+    RunContext context;
+
+    static LegacyParseState& local() {
+        thread_local LegacyParseState state;
+        return state;
+    }
+};
+
+//Parse one message with the built-in opcodes, recording it in history and passing its result to sink.
+//Kept for callers of the original free function. It decodes and dispatches directly, without the extension, schema, validation or latency timing
+//of a CommandParser, so it is as cheap as a reused parser. The run context that D_USR_FLD_ results are stamped with is kept per thread.
+inline void parseCommand(std::string_view svInput, CommandHistory& history, ResultSink& sink) {
+    LegacyParseState& state = LegacyParseState::local();
+    DecodedCommand& command = state.command;
+    decodeCommand(svInput, state.vecParameters, command);
+    countDispatched(command, false);
+    if (const RunNumber* pRun = std::get_if<RunNumber>(&command.result)) {
+        state.context.iRunNumber = pRun->iRunNumber;
+    }
+    else if (const PolarNumber* pPolar = std::get_if<PolarNumber>(&command.result)) {
+        state.context.iPolarNumber = pPolar->iPolarNumber;
+    }
+    else if (ParameterList* pParameters = std::get_if<ParameterList>(&command.result)) {
+        pParameters->context = state.context;
+    }
+    else if (HistoryQuery* pQuery = std::get_if<HistoryQuery>(&command.result)) {
+        pQuery->pHistory = &history;
+    }
+    sink.onResult(command.result);
+    // Add only recognised opcodes to history (HISTORY___ and unknown opcodes are excluded)
+    if (command.bRecordHistory) {
+        history.push(command.svOpCode);
+    }
+}
+
+//The original signature, printing the result to std::cout.
+inline void parseCommand(const std::string& strInput, CommandHistory& history) {
+    ConsoleSink consoleSink;
+    parseCommand(std::string_view(strInput), history, consoleSink);
+}
@@ -0,0 +1,90 @@
+/*
+    Command Manager Coroutine Example
+
+    Parses a file, or stdin, with a coroutine awaiting AsyncCommandParser::next() and printing each result.
+    By default the file is read in small chunks by a loop standing in for an event loop, which pushes each one to a ChunkChannel and so resumes
+    the coroutine from inside push(). With --pull the coroutine reads the file itself through a FileReadSource.
+
+    Needs C++20, and CMake only builds it when the compiler supports it.
+*/
+
+#include "CoroutineParser.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#if defined(COMMANDMANAGER_HAS_COROUTINES)
+
+//A coroutine nobody waits for, as an event loop would spawn for each connection.
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+template <typename TSource>
+DetachedTask printResults(AsyncCommandParser<TSource>& parser, std::size_t& uResults) {
+    ConsoleSink consoleSink;
+    while (std::optional<ParseResult> result = co_await parser.next()) {
+        consoleSink.onResult(*result);
+        uResults++;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    bool bPull = false;
+    const char* pPath = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--pull") == 0) {
+            bPull = true;
+        }
+        else {
+            pPath = argv[i];
+        }
+    }
+    std::FILE* pFile = pPath != nullptr ? std::fopen(pPath, "rb") : stdin;
+    if (pFile == nullptr) {
+        std::cerr << "Can't open " << pPath << "\n";
+        return 1;
+    }
+
+    std::size_t uResults = 0;
+    if (bPull) {
+        FileReadSource source(pFile);
+        AsyncCommandParser<FileReadSource> parser(source);
+        printResults(parser, uResults);
+    }
+    else {
+        ChunkChannel channel;
+        AsyncCommandParser<ChunkChannel> parser(channel);
+        printResults(parser, uResults);
+        //Small reads so messages are split across chunks, as they are off a socket.
+        char arrChunk[256];
+        std::size_t uBytes;
+        while ((uBytes = std::fread(arrChunk, 1, sizeof(arrChunk), pFile)) > 0) {
+            channel.push(std::string_view(arrChunk, uBytes));
+        }
+        channel.close();
+    }
+    if (pFile != stdin) {
+        std::fclose(pFile);
+    }
+    std::cerr << uResults << " results\n";
+    return 0;
+}
+
+#else
+
+int main()
+{
+    std::cerr << "CommandManagerAsync needs a compiler with C++20 coroutines\n";
+    return 1;
+}
+
+#endif
@@ -0,0 +1,715 @@
+/*
+    Command Manager Parser Benchmarks
+
+    Google Benchmark suite for the parser hot paths. Each opcode case parses one message per iteration, so the
+    reported time is ns/message and items_per_second is messages/sec. Every case also reports allocs/msg,
+    counted by replacing the global operator new in this file, so regressions in the allocation-free paths show up.
+
+    Numeric parsing compares the std::from_chars based parseInt / parseDouble used by the parser
+    against the std::stoi / std::stod + exception handling it previously used, for both valid and malformed fields.
+*/
+
+#include "AsyncSink.h"
+#include "BinaryProtocol.h"
+#include "CommandManager.h"
+#include "CommandPipeline.h"
+#include "CommandReplay.h"
+#include "ParameterCapture.h"
+#include "ParameterTable.h"
+#include "ParserMetrics.h"
+#include "ParserSnapshot.h"
+#include "SharedHistory.h"
+#include "StaticOpCodes.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <exception>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//The replacement operators below pair malloc with free, GCC can't see that once they are inlined and warns about a mismatch.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+//Count of every global allocation made by the process.
+static std::atomic<std::size_t> g_uAllocations{ 0 };
+
+void* operator new(std::size_t uSize) {
+    g_uAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* pMemory = std::malloc(uSize == 0 ? 1 : uSize)) {
+        return pMemory;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t uSize) {
+    return operator new(uSize);
+}
+
+void operator delete(void* pMemory) noexcept {
+    std::free(pMemory);
+}
+
+void operator delete[](void* pMemory) noexcept {
+    std::free(pMemory);
+}
+
+void operator delete(void* pMemory, std::size_t) noexcept {
+    std::free(pMemory);
+}
+
+void operator delete[](void* pMemory, std::size_t) noexcept {
+    std::free(pMemory);
+}
+
+//Sink that keeps results alive without doing any I/O, so only parsing is measured.
+class NullSink : public ResultSink {
+public:
+    void onResult(const ParseResult& result) override {
+        benchmark::DoNotOptimize(&result);
+    }
+};
+
+//Build a D_USR_FLD_ message with iCount parameters in the format the Command Manager sends.
+static std::string makeUserFields(int iCount) {
+    std::string strMessage = "D_USR_FLD_";
+    for (int i = 0; i < iCount; i++) {
+        strMessage += "Parameter" + std::to_string(i) + "," + std::to_string(0.000001 * (i + 1) + i) + ",";
+    }
+    strMessage += "#";
+    return strMessage;
+}
+
+//Parse the same message repeatedly through a CommandParser, reporting messages/sec and allocations per message.
+static void parseMessage(benchmark::State& state, const std::string& strMessage, const ValidationRules* pValidation = nullptr) {
+    NullSink sink;
+    CommandParser parser(sink);
+    parser.setValidation(pValidation);
+    //Warm up once so scratch buffers have reached their steady state size.
+    parser.parse(strMessage);
+    std::size_t uAllocationsBefore = g_uAllocations.load(std::memory_order_relaxed);
+    for (auto _ : state) {
+        parser.parse(strMessage);
+    }
+    std::size_t uAllocations = g_uAllocations.load(std::memory_order_relaxed) - uAllocationsBefore;
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(strMessage.length()));
+    state.counters["allocs/msg"] = benchmark::Counter(static_cast<double>(uAllocations), benchmark::Counter::kAvgIterations);
+}
+
+static void BM_Parse_RunNumber(benchmark::State& state) {
+    parseMessage(state, "RUN_NO____123#");
+}
+
+static void BM_Parse_PolarNumber(benchmark::State& state) {
+    parseMessage(state, "POLAR_NO__2#");
+}
+
+static void BM_Parse_UserMessage(benchmark::State& state) {
+    parseMessage(state, "USR_MSG___Start Tunnel#");
+}
+
+static void BM_Parse_UserFields(benchmark::State& state) {
+    parseMessage(state, makeUserFields(static_cast<int>(state.range(0))));
+    state.counters["params/msg"] = static_cast<double>(state.range(0));
+}
+
+static void BM_Parse_History(benchmark::State& state) {
+    parseMessage(state, "HISTORY___#");
+}
+
+static void BM_Parse_UnknownOpCode(benchmark::State& state) {
+    parseMessage(state, "UNKNOWN___test#");
+}
+
+static void BM_Parse_InvalidRunNumber(benchmark::State& state) {
+    parseMessage(state, "RUN_NO____ABC#");
+}
+
+static void BM_Parse_MissingTerminator(benchmark::State& state) {
+    parseMessage(state, "RUN_NO____123");
+}
+
+static void BM_Parse_OddParameterCount(benchmark::State& state) {
+    parseMessage(state, "D_USR_FLD_Parameter1,0.004947,Parameter2#");
+}
+
+BENCHMARK(BM_Parse_RunNumber);
+BENCHMARK(BM_Parse_PolarNumber);
+BENCHMARK(BM_Parse_UserMessage);
+BENCHMARK(BM_Parse_UserFields)->Arg(2)->Arg(32)->Arg(512);
+BENCHMARK(BM_Parse_History);
+BENCHMARK(BM_Parse_UnknownOpCode);
+BENCHMARK(BM_Parse_InvalidRunNumber);
+BENCHMARK(BM_Parse_MissingTerminator);
+BENCHMARK(BM_Parse_OddParameterCount);
+
+//A D_USR_FLD_ message whose last name has no value, with or without validation rejecting it before it is tokenized.
+static void BM_Validate_OddParameterCount(benchmark::State& state) {
+    ValidationRules rules;
+    std::string strMessage = makeUserFields(static_cast<int>(state.range(1)));
+    strMessage.insert(strMessage.length() - 1, "Unpaired");
+    parseMessage(state, strMessage, state.range(0) != 0 ? &rules : nullptr);
+}
+
+//The cost of validation on messages that pass it.
+static void BM_Validate_UserFields(benchmark::State& state) {
+    ValidationRules rules;
+    parseMessage(state, makeUserFields(static_cast<int>(state.range(1))), state.range(0) != 0 ? &rules : nullptr);
+}
+
+static void BM_Validate_InvalidRunNumber(benchmark::State& state) {
+    ValidationRules rules;
+    parseMessage(state, "RUN_NO____ABC#", state.range(0) != 0 ? &rules : nullptr);
+}
+
+BENCHMARK(BM_Validate_OddParameterCount)->ArgNames({ "validate", "params" })->ArgsProduct({ { 0, 1 }, { 32, 512 } });
+BENCHMARK(BM_Validate_UserFields)->ArgNames({ "validate", "params" })->ArgsProduct({ { 0, 1 }, { 32, 512 } });
+BENCHMARK(BM_Validate_InvalidRunNumber)->ArgName("validate")->Arg(0)->Arg(1);
+
+//A parser specialised for one opcode at compile time, to compare with the runtime dispatch above.
+template <typename TOpCode>
+static void parseStaticOpCode(benchmark::State& state, const std::string& strMessage) {
+    StaticOpCodeParser<TOpCode> parser;
+    typename StaticOpCodeParser<TOpCode>::Payload payload{};
+    parser.parse(strMessage, payload);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parser.parse(strMessage, payload));
+        benchmark::DoNotOptimize(&payload);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(strMessage.length()));
+}
+
+static void BM_StaticOpCode_RunNumber(benchmark::State& state) {
+    parseStaticOpCode<RunNumberOpCode>(state, "RUN_NO____123#");
+}
+
+static void BM_StaticOpCode_UserFields(benchmark::State& state) {
+    parseStaticOpCode<UserFieldsOpCode>(state, makeUserFields(static_cast<int>(state.range(0))));
+    state.counters["params/msg"] = static_cast<double>(state.range(0));
+}
+
+//Matching each message of a mixed set against the opcodes of a StaticOpCodeSwitch.
+static void BM_StaticOpCodeSwitch(benchmark::State& state) {
+    const std::vector<std::string> vecMessages = { "RUN_NO____123#", "POLAR_NO__45#", "USR_MSG___Test message#", makeUserFields(2) };
+    StaticOpCodeSwitch<RunNumberOpCode, PolarNumberOpCode, UserMessageOpCode, UserFieldsOpCode> parser;
+    std::size_t uMessage = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parser.parse(vecMessages[uMessage], [](auto, const auto& payload) { benchmark::DoNotOptimize(&payload); }));
+        uMessage = (uMessage + 1) & 3;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_StaticOpCode_RunNumber);
+BENCHMARK(BM_StaticOpCode_UserFields)->Arg(2)->Arg(32)->Arg(512);
+BENCHMARK(BM_StaticOpCodeSwitch);
+
+//A mixed stream of every opcode, parsed one message at a time and as a batch.
+static std::string makeMixedStream() {
+    std::string strStream;
+    for (int i = 0; i < 64; i++) {
+        strStream += "RUN_NO____" + std::to_string(i) + "#POLAR_NO__" + std::to_string(i % 4) + "#USR_MSG___Start Tunnel#";
+        strStream += makeUserFields(32);
+        strStream += (i % 16 == 0) ? "HISTORY___#" : "UNKNOWN___test#";
+    }
+    return strStream;
+}
+
+static void BM_Parse_MixedStream(benchmark::State& state) {
+    std::string strStream = makeMixedStream();
+    std::vector<std::string_view> vecMessages;
+    MessageFramer::frameBuffer(strStream, [&vecMessages](std::string_view svMessage) { vecMessages.push_back(svMessage); });
+    NullSink sink;
+    CommandParser parser(sink);
+    bool bBatch = state.range(0) != 0;
+    for (auto _ : state) {
+        if (bBatch) {
+            parser.parseBatch(vecMessages);
+        }
+        else {
+            for (std::string_view svMessage : vecMessages) {
+                parser.parse(svMessage);
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(vecMessages.size()));
+}
+
+BENCHMARK(BM_Parse_MixedStream)->ArgName("batch")->Arg(0)->Arg(1);
+
+//Replaying a 4MB in-memory capture of the mixed stream, one line per message, as replayFile does once the file is mapped.
+static void BM_Replay_MixedStream(benchmark::State& state) {
+    std::string strMessages = makeMixedStream();
+    std::string strCapture;
+    std::size_t uMessages = 0;
+    while (strCapture.length() < 4 * 1024 * 1024) {
+        MessageFramer::frameBuffer(strMessages, [&](std::string_view svMessage) {
+            strCapture.append(svMessage);
+            strCapture += '\n';
+            uMessages++;
+        });
+    }
+    NullSink sink;
+    CommandParser parser(sink);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(replayBuffer(parser, strCapture));
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(uMessages));
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(strCapture.length()));
+}
+
+BENCHMARK(BM_Replay_MixedStream)->Unit(benchmark::kMillisecond);
+
+//The mixed stream fed through a CommandPipeline with a varying number of decode workers, including the hand-off to the commit thread.
+static void BM_Pipeline_MixedStream(benchmark::State& state) {
+    std::string strStream = makeMixedStream();
+    std::size_t uMessages = 0;
+    MessageFramer::frameBuffer(strStream, [&uMessages](std::string_view) { uMessages++; });
+    NullSink sink;
+    CommandParser parser(sink);
+    CommandPipeline<> pipeline(parser, static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        pipeline.feed(strStream);
+        pipeline.flush();
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(uMessages));
+}
+
+BENCHMARK(BM_Pipeline_MixedStream)->ArgName("workers")->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+
+//Records when the commit thread passes on a RUN_NO____, and how many D_USR_FLD_ results it passed on since the previous one.
+class RunArrivalSink : public ResultSink {
+public:
+    void onResult(const ParseResult& result) override {
+        if (std::holds_alternative<RunNumber>(result)) {
+            m_uFramesBefore = m_uFrames;
+            m_uFrames = 0;
+            m_iArrival.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_release);
+        }
+        else if (std::holds_alternative<ParameterList>(result)) {
+            m_uFrames++;
+        }
+    }
+
+    //Read once arrival() has moved on.
+    std::size_t framesBefore() const {
+        return m_uFramesBefore;
+    }
+
+    std::int64_t arrival() const {
+        return m_iArrival.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<std::int64_t> m_iArrival{ 0 };
+    std::size_t m_uFrames = 0;
+    std::size_t m_uFramesBefore = 0;
+};
+
+//Time for a RUN_NO____ queued behind 256 large D_USR_FLD_ frames to reach the sink, with RUN_NO____ at its default High priority or set to Normal,
+//and how many of those frames reached the sink first. Latency needs more cores than pipeline threads to mean much, the frame count doesn't.
+static void BM_Pipeline_ControlLatency(benchmark::State& state) {
+    std::string strFrame = makeUserFields(512);
+    RunArrivalSink sink;
+    CommandParser parser(sink);
+    if (state.range(0) == 0) {
+        parser.extension().setPriority("RUN_NO____", CommandPriority::Normal);
+    }
+    CommandPipeline<> pipeline(parser, 2);
+    double dblLatency = 0.0;
+    double dblFramesBefore = 0.0;
+    for (auto _ : state) {
+        for (int i = 0; i < 256; i++) {
+            pipeline.parse(strFrame);
+        }
+        std::int64_t iQueued = std::chrono::steady_clock::now().time_since_epoch().count();
+        pipeline.parse("RUN_NO____123#");
+        while (sink.arrival() < iQueued) {
+            std::this_thread::yield();
+        }
+        dblLatency += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::duration(sink.arrival() - iQueued)).count();
+        pipeline.flush();
+        dblFramesBefore += static_cast<double>(sink.framesBefore());
+    }
+    state.counters["run_latency_us"] = benchmark::Counter(dblLatency, benchmark::Counter::kAvgIterations);
+    state.counters["frames_before_run"] = benchmark::Counter(dblFramesBefore, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_Pipeline_ControlLatency)->ArgName("priority")->Arg(0)->Arg(1)->UseRealTime();
+
+//Cost the shared history adds to every recognised message, mirroring the parser's history for other threads.
+static void BM_Parse_RunNumberSharedHistory(benchmark::State& state) {
+    NullSink sink;
+    CommandParser parser(sink);
+    SharedCommandHistory sharedHistory;
+    parser.setHistoryListener(&sharedHistory);
+    for (auto _ : state) {
+        parser.parse("RUN_NO____123#");
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+//A reader taking snapshots of a full shared history while no writer is active.
+static void BM_SharedHistory_Snapshot(benchmark::State& state) {
+    SharedCommandHistory sharedHistory(static_cast<std::size_t>(state.range(0)));
+    for (std::size_t i = 0; i < sharedHistory.depth(); i++) {
+        sharedHistory.push("RUN_NO____");
+    }
+    std::vector<OpCodeName> vecSnapshot;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sharedHistory.snapshot(vecSnapshot));
+        benchmark::DoNotOptimize(vecSnapshot.data());
+    }
+}
+
+BENCHMARK(BM_Parse_RunNumberSharedHistory);
+BENCHMARK(BM_SharedHistory_Snapshot)->ArgName("depth")->Arg(5)->Arg(1024);
+
+//Adding up every thread's metrics, as an exporter would on each scrape. The cost of recording shows in the parse benchmarks against a build without metrics.
+static void BM_Metrics_Snapshot(benchmark::State& state) {
+    NullSink sink;
+    CommandParser parser(sink);
+    parser.parse("RUN_NO____123#");
+    for (auto _ : state) {
+        MetricsSnapshot snapshot = ParserMetrics::instance().snapshot();
+        benchmark::DoNotOptimize(snapshot);
+    }
+    state.counters["enabled"] = COMMANDMANAGER_ENABLE_METRICS;
+}
+
+BENCHMARK(BM_Metrics_Snapshot);
+
+//D_USR_FLD_ messages matching a registered schema, parsed positionally straight into a SchemaBuffer. Compare with BM_Parse_UserFields, which
+//only decodes: the schema path also stores every value, yet should stay ahead of it at every width (about 10% at 32 fields, 5% at 512).
+static void BM_Parse_UserFieldsSchema(benchmark::State& state) {
+    int iCount = static_cast<int>(state.range(0));
+    std::string strMessage = makeUserFields(iCount);
+    ParameterSchema schema;
+    for (int i = 0; i < iCount; i++) {
+        schema.addField("Parameter" + std::to_string(i));
+    }
+    SchemaBuffer buffer(std::move(schema));
+    NullSink sink;
+    CommandParser parser(sink);
+    parser.setSchema(&buffer);
+    parser.parse(strMessage);
+    std::size_t uAllocationsBefore = g_uAllocations.load(std::memory_order_relaxed);
+    for (auto _ : state) {
+        parser.parse(strMessage);
+    }
+    std::size_t uAllocations = g_uAllocations.load(std::memory_order_relaxed) - uAllocationsBefore;
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(strMessage.length()));
+    state.counters["allocs/msg"] = benchmark::Counter(static_cast<double>(uAllocations), benchmark::Counter::kAvgIterations);
+    state.counters["fallbacks"] = static_cast<double>(buffer.fallbacks());
+}
+
+BENCHMARK(BM_Parse_UserFieldsSchema)->Arg(2)->Arg(32)->Arg(512);
+
+//Parsing D_USR_FLD_ messages into a ParameterTable, which interns each name and stores its value by ID.
+static void BM_Parse_UserFieldsTable(benchmark::State& state) {
+    std::string strMessage = makeUserFields(static_cast<int>(state.range(0)));
+    ParameterTable table;
+    ParameterTableSink sink(table);
+    CommandParser parser(sink);
+    parser.parse(strMessage);
+    std::size_t uAllocationsBefore = g_uAllocations.load(std::memory_order_relaxed);
+    for (auto _ : state) {
+        parser.parse(strMessage);
+    }
+    std::size_t uAllocations = g_uAllocations.load(std::memory_order_relaxed) - uAllocationsBefore;
+    state.SetItemsProcessed(state.iterations());
+    state.counters["allocs/msg"] = benchmark::Counter(static_cast<double>(uAllocations), benchmark::Counter::kAvgIterations);
+    state.counters["params/msg"] = static_cast<double>(state.range(0));
+}
+
+BENCHMARK(BM_Parse_UserFieldsTable)->Arg(32)->Arg(512);
+
+//A consumer reading a parameter value, by ID as the table allows against looking its name up every time.
+static void BM_ParameterLookup(benchmark::State& state) {
+    std::string strMessage = makeUserFields(512);
+    ParameterTable table;
+    ParameterTableSink sink(table);
+    CommandParser parser(sink);
+    parser.parse(strMessage);
+    bool bById = state.range(0) != 0;
+    std::uint32_t uId = table.interner().find("Parameter300");
+    for (auto _ : state) {
+        if (bById) {
+            benchmark::DoNotOptimize(table.value(uId));
+        }
+        else {
+            benchmark::DoNotOptimize(table.value(table.interner().find("Parameter300")));
+        }
+    }
+}
+
+BENCHMARK(BM_ParameterLookup)->ArgName("byid")->Arg(0)->Arg(1);
+
+//Control loop stand-in that does some work for every parameter it is given.
+class ParameterConsumerSink : public ResultSink {
+public:
+    void onResult(const ParseResult& result) override {
+        if (const ParameterList* pParameters = std::get_if<ParameterList>(&result)) {
+            for (const Parameter& parameter : *pParameters) {
+                m_dblSum += parameter.dblValue;
+            }
+            benchmark::DoNotOptimize(m_dblSum);
+        }
+    }
+
+private:
+    double m_dblSum = 0.0;
+};
+
+//512 parameter frames where only some values change from frame to frame, with the consumer given every parameter against only the changed ones.
+static void BM_Parse_UserFieldsDelta(benchmark::State& state) {
+    bool bDelta = state.range(0) != 0;
+    int iChanged = static_cast<int>(state.range(1));
+    std::string arrMessages[2];
+    for (int iFrame = 0; iFrame < 2; iFrame++) {
+        arrMessages[iFrame] = "D_USR_FLD_";
+        for (int i = 0; i < 512; i++) {
+            arrMessages[iFrame] += "Parameter" + std::to_string(i) + "," + std::to_string(i < iChanged ? i + iFrame : i) + ",";
+        }
+        arrMessages[iFrame] += "#";
+    }
+    ParameterTable table;
+    ParameterConsumerSink consumer;
+    ParameterTableSink fullSink(table, &consumer);
+    ParameterDeltaSink deltaSink(table, consumer);
+    CommandParser parser(bDelta ? static_cast<ResultSink&>(deltaSink) : static_cast<ResultSink&>(fullSink));
+    parser.parse(arrMessages[0]);
+    parser.parse(arrMessages[1]);
+    std::size_t uFrame = 0;
+    for (auto _ : state) {
+        parser.parse(arrMessages[uFrame++ & 1]);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["changed/msg"] = static_cast<double>(iChanged);
+}
+
+BENCHMARK(BM_Parse_UserFieldsDelta)->ArgNames({ "delta", "changed" })->ArgsProduct({ { 0, 1 }, { 8, 512 } });
+
+//Capturing D_USR_FLD_ values into columns, cleared every 4096 rows as a flush would.
+static void BM_Parse_UserFieldsCapture(benchmark::State& state) {
+    std::string strMessage = makeUserFields(static_cast<int>(state.range(0)));
+    ParameterCapture capture;
+    CaptureSink sink(capture);
+    CommandParser parser(sink);
+    parser.parse(strMessage);
+    for (auto _ : state) {
+        parser.parse(strMessage);
+        if (capture.rows() == 4096) {
+            capture.clear();
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["params/msg"] = static_cast<double>(state.range(0));
+}
+
+BENCHMARK(BM_Parse_UserFieldsCapture)->Arg(32)->Arg(512);
+
+//Snapshotting a parser and a ParameterTable holding range(0) parameters, and restoring a fresh parser and table from it.
+static void BM_Snapshot(benchmark::State& state) {
+    bool bRestore = state.range(1) != 0;
+    ParameterTable table;
+    ParameterTableSink sink(table);
+    CommandParser parser(sink);
+    parser.parse("RUN_NO____123#");
+    parser.parse("POLAR_NO__2#");
+    parser.parse(makeUserFields(static_cast<int>(state.range(0))));
+    std::string strSnapshot;
+    appendSnapshot(strSnapshot, parser, &table);
+    std::string strError;
+    for (auto _ : state) {
+        if (bRestore) {
+            ParameterTable restoredTable;
+            CommandParser restoredParser(sink);
+            benchmark::DoNotOptimize(restoreSnapshot(strSnapshot, restoredParser, &restoredTable, strError));
+        }
+        else {
+            strSnapshot.clear();
+            appendSnapshot(strSnapshot, parser, &table);
+            benchmark::DoNotOptimize(strSnapshot.data());
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(strSnapshot.size()));
+}
+
+BENCHMARK(BM_Snapshot)->ArgNames({ "params", "restore" })->ArgsProduct({ { 512, 16384 }, { 0, 1 } });
+
+//Finding the commas in 512 D_USR_FLD_ parameters with the vectorised scanner against a byte at a time. bytes_per_second is the scan rate.
+static void BM_ScanCommas(benchmark::State& state) {
+    std::string strMessage = makeUserFields(512);
+    std::string_view svContent(strMessage.data() + kOpCodeLength, strMessage.length() - kOpCodeLength - 1);
+    bool bVectorised = state.range(0) != 0;
+    std::size_t uCommas = 0;
+    auto countComma = [&uCommas](std::size_t) { uCommas++; };
+    for (auto _ : state) {
+        if (bVectorised) {
+            scanDelimiters(svContent, ',', countComma);
+        }
+        else {
+            scanDelimitersScalar(svContent, ',', countComma);
+        }
+        benchmark::DoNotOptimize(uCommas);
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(svContent.length()));
+    state.SetLabel(bVectorised ? kDelimiterScanner : "scalar");
+}
+
+BENCHMARK(BM_ScanCommas)->ArgName("simd")->Arg(0)->Arg(1);
+
+#if defined(_WIN32)
+static const char* const kNullDevice = "NUL";
+#define COMMANDMANAGER_FILENO _fileno
+#else
+static const char* const kNullDevice = "/dev/null";
+#define COMMANDMANAGER_FILENO fileno
+#endif
+
+//Cost on the parse path of printing a D_USR_FLD_ message, through a ConsoleSink writing a stream against an AsyncConsoleSink, both to the null device.
+static void BM_Sink_Console(benchmark::State& state) {
+    std::string strMessage = makeUserFields(8);
+    std::ofstream nullStream(kNullDevice);
+    ConsoleSink sink(nullStream);
+    CommandParser parser(sink);
+    for (auto _ : state) {
+        parser.parse(strMessage);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_Sink_Async(benchmark::State& state) {
+    std::string strMessage = makeUserFields(8);
+    std::FILE* pNullFile = std::fopen(kNullDevice, "wb");
+    {
+        AsyncConsoleSink sink(COMMANDMANAGER_FILENO(pNullFile), OverflowPolicy::Block);
+        CommandParser parser(sink);
+        for (auto _ : state) {
+            parser.parse(strMessage);
+        }
+        sink.flush();
+        state.counters["writes"] = static_cast<double>(sink.writes());
+    }
+    std::fclose(pNullFile);
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_Sink_Console);
+BENCHMARK(BM_Sink_Async);
+
+//Decode the same binary frame repeatedly and commit it through a CommandParser, to compare with the text benchmarks above.
+static void parseBinaryFrame(benchmark::State& state, const ParameterInterner& names, const std::string& strFrame) {
+    NullSink sink;
+    CommandParser parser(sink);
+    BinaryDecoder decoder(names);
+    decoder.parse(parser, strFrame);
+    std::size_t uAllocationsBefore = g_uAllocations.load(std::memory_order_relaxed);
+    for (auto _ : state) {
+        decoder.parse(parser, strFrame);
+    }
+    std::size_t uAllocations = g_uAllocations.load(std::memory_order_relaxed) - uAllocationsBefore;
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(strFrame.length()));
+    state.counters["allocs/msg"] = benchmark::Counter(static_cast<double>(uAllocations), benchmark::Counter::kAvgIterations);
+}
+
+static void BM_Binary_RunNumber(benchmark::State& state) {
+    ParameterInterner names;
+    std::string strFrame;
+    BinaryEncoder::appendRunNumber(strFrame, 123);
+    parseBinaryFrame(state, names, strFrame);
+}
+
+//The binary equivalent of BM_Parse_UserFields, with the names agreed up front as interned IDs.
+static void BM_Binary_UserFields(benchmark::State& state) {
+    int iCount = static_cast<int>(state.range(0));
+    ParameterInterner names;
+    std::vector<BinaryParameter> vecParameters;
+    for (int i = 0; i < iCount; i++) {
+        vecParameters.push_back({ static_cast<std::uint16_t>(names.intern("Parameter" + std::to_string(i))), 0.000001 * (i + 1) + i });
+    }
+    std::string strFrame;
+    BinaryEncoder::appendUserFields(strFrame, vecParameters);
+    parseBinaryFrame(state, names, strFrame);
+    state.counters["params/msg"] = static_cast<double>(iCount);
+}
+
+BENCHMARK(BM_Binary_RunNumber);
+BENCHMARK(BM_Binary_UserFields)->Arg(2)->Arg(32)->Arg(512);
+
+//Previous run/polar number parsing: copy into a std::string, convert with std::stoi and catch the exception on failure.
+static bool legacyParseInt(std::string_view svText, int& iValue) {
+    try {
+        iValue = std::stoi(std::string(svText));
+        return true;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+//Previous parameter value parsing with std::stod.
+static bool legacyParseDouble(std::string_view svText, double& dblValue) {
+    try {
+        dblValue = std::stod(std::string(svText));
+        return true;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+static void BM_RunNumber_Stoi(benchmark::State& state, std::string_view svText) {
+    int iValue = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(legacyParseInt(svText, iValue));
+        benchmark::DoNotOptimize(iValue);
+    }
+}
+
+static void BM_RunNumber_FromChars(benchmark::State& state, std::string_view svText) {
+    int iValue = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parseInt(svText, iValue));
+        benchmark::DoNotOptimize(iValue);
+    }
+}
+
+static void BM_ParameterValue_Stod(benchmark::State& state, std::string_view svText) {
+    double dblValue = 0.0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(legacyParseDouble(svText, dblValue));
+        benchmark::DoNotOptimize(dblValue);
+    }
+}
+
+static void BM_ParameterValue_FromChars(benchmark::State& state, std::string_view svText) {
+    double dblValue = 0.0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parseDouble(svText, dblValue));
+        benchmark::DoNotOptimize(dblValue);
+    }
+}
+
+BENCHMARK_CAPTURE(BM_RunNumber_Stoi, valid, std::string_view("123"));
+BENCHMARK_CAPTURE(BM_RunNumber_FromChars, valid, std::string_view("123"));
+BENCHMARK_CAPTURE(BM_RunNumber_Stoi, malformed, std::string_view("ABC"));
+BENCHMARK_CAPTURE(BM_RunNumber_FromChars, malformed, std::string_view("ABC"));
+BENCHMARK_CAPTURE(BM_ParameterValue_Stod, valid, std::string_view("0.203044"));
+BENCHMARK_CAPTURE(BM_ParameterValue_FromChars, valid, std::string_view("0.203044"));
+BENCHMARK_CAPTURE(BM_ParameterValue_Stod, malformed, std::string_view("garbage"));
+BENCHMARK_CAPTURE(BM_ParameterValue_FromChars, malformed, std::string_view("garbage"));
+
+BENCHMARK_MAIN();
@@ -0,0 +1,16 @@
+/*
+    Command Manager Demo
+
+    Runs the example messages through a parser and exits, showing the output for each OpCode and the failsafes.
+*/
+
+#include "CommandManager.h"
+#include "ConsoleSession.h"
+
+int main()
+{
+    ConsoleSink consoleSink;
+    CommandParser parser(consoleSink);
+    runExampleMessages(parser);
+    return 0;
+}
@@ -0,0 +1,964 @@
+/*
+    Command Manager Differential Fuzzer
+
+    Runs every message through the original parseCommand, kept here as it was written apart from printing to a stream, through CommandParser and
+    through the parseCommand free function kept for its callers, and stops at the first message where their output or history differ.
+    Performance work on the parser can't then quietly change what the Command Manager sees, e.g. whether an odd token count drops a D_USR_FLD_ message
+    or how std::stoi / std::stod read a number.
+
+    Inputs:
+    - CommandManagerFuzz --random <count> [--seed <n>]    generated messages, biased towards the edge cases of each opcode
+    - CommandManagerFuzz --capture <file>...              recorded captures, framed on '#' as a replay does
+    - CommandManagerFuzz [file...]                        one message per line as typed at the prompt, from stdin without files; AFL runs it this way
+    Add --validate to also check that messages passing ValidationRules decode the same, and that those it rejects do nothing else.
+    With --batch the generated messages are instead joined into buffers and checked through parseBatch and parseBuffer against parsing each
+    message in turn, comparing output, history and the run and polar numbers ParameterCapture tags each D_USR_FLD_ row with.
+    With --pipeline they go through a CommandPipeline with the default priorities instead, which may pass RUN_NO____, POLAR_NO__ and USR_MSG___ on
+    ahead of earlier messages. Within each priority the output must match parsing each message in turn, as must the history, the run context and
+    the captured run and polar numbers.
+    With --ingest they are spread over two TCP connections to an IngestServer on loopback, open at the same time, and each connection's source must
+    match its own parser fed the same bytes: output, history and run context, so one controller's messages never reach another's history.
+
+    Built with COMMANDMANAGER_LIBFUZZER defined (and -fsanitize=fuzzer) it is instead a libFuzzer target taking each input one message per line.
+*/
+
+#include "CommandManager.h"
+#include "CommandPipeline.h"
+#include "NetworkIngest.h"
+#include "ParameterCapture.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//The original implementation. Only std::cout has been replaced by os.
+
+void legacyUpdateHistory(std::deque<std::string>& strHistory, const std::string& strOpCode) {
+    strHistory.push_front(strOpCode);
+    if (strHistory.size() > 5) {
+        strHistory.pop_back();
+    }
+}
+
+void legacyParseCommand(const std::string& strInput, std::deque<std::string>& strHistory, std::ostream& os) {
+    bool bRecognised = false;
+    if (strInput.empty() || strInput.back() != '#') {
+        return;
+    }
+    if (strInput.length() >= 11) {
+        std::string strOpCode = strInput.substr(0, 10);
+        std::string strMessageContent = strInput.substr(10);
+        if (!strMessageContent.empty() && strMessageContent.back() == '#') {
+            strMessageContent.pop_back();
+        }
+        if (strOpCode == "RUN_NO____") {
+            bRecognised = true;
+            try {
+                int iRunNumber = std::stoi(strMessageContent);
+                os << "Run number: " << iRunNumber << "\n";
+            }
+            catch (const std::exception&) {
+                os << "Invalid Run number: " << strMessageContent << "\n";
+            }
+        }
+        else if (strOpCode == "POLAR_NO__") {
+            bRecognised = true;
+            try {
+                int iPolarNumber = std::stoi(strMessageContent);
+                os << "Polar number: " << iPolarNumber << "\n";
+            }
+            catch (const std::exception&) {
+                os << "Invalid Polar number: " << strMessageContent << "\n";
+            }
+        }
+        else if (strOpCode == "USR_MSG___") {
+            bRecognised = true;
+            os << strMessageContent << "\n";
+        }
+        else if (strOpCode == "D_USR_FLD_") {
+            bRecognised = true;
+            std::vector<std::string> vecTokens;
+            std::stringstream ssMessageContent(strMessageContent);
+            std::string strToken;
+            while (std::getline(ssMessageContent, strToken, ',')) {
+                if (!strToken.empty()) {
+                    vecTokens.push_back(strToken);
+                }
+            }
+            if (vecTokens.size() % 2 != 0) {
+                return;
+            }
+            os << "Parameters:\n";
+            for (size_t i = 0; i + 1 < vecTokens.size(); i += 2) {
+                if (vecTokens[i].length() > 15) {
+                    os << "Parameter name too long: " << vecTokens[i] << "\n";
+                    continue;
+                }
+                try {
+                    std::string strParmName = vecTokens[i];
+                    double dblParmValue = std::stod(vecTokens[i + 1]);
+                    os << strParmName << " = " << dblParmValue << "\n";
+                }
+                catch (const std::exception&) {
+                    os << "Invalid parameter value for parameter: " << vecTokens[i] << "\n";
+                }
+            }
+        }
+        else if (strOpCode == "HISTORY___") {
+            for (size_t i = 0; i < strHistory.size(); i++) {
+                os << strHistory[i] << "\n";
+            }
+        }
+        if (bRecognised) {
+            legacyUpdateHistory(strHistory, strOpCode);
+        }
+    }
+}
+
+//Write a string with anything unprintable escaped, so the failing message can be copied back into a test.
+static void writeEscaped(std::ostream& os, std::string_view svText) {
+    for (char ch : svText) {
+        unsigned char uByte = static_cast<unsigned char>(ch);
+        if (uByte < 0x20 || uByte >= 0x7F || ch == '\\' || ch == '"') {
+            os << "\\x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<unsigned int>(uByte) << std::dec << std::setfill(' ');
+        }
+        else {
+            os << ch;
+        }
+    }
+}
+
+//Both implementations side by side, each with its own history, fed the same messages.
+class DifferentialRunner {
+public:
+    explicit DifferentialRunner(bool bValidate) : m_parser(m_sink), m_validatedParser(m_validatedSink) {
+        if (bValidate) {
+            m_validatedParser.setValidation(&m_rules);
+        }
+        m_bValidate = bValidate;
+    }
+
+    //Run one message through both. Returns false, having described the difference on os, if they disagree.
+    bool check(const std::string& strMessage, std::ostream& os) {
+        m_uMessages++;
+        m_ssLegacy.str(std::string());
+        m_ssParser.str(std::string());
+        m_ssFreeFunction.str(std::string());
+        legacyParseCommand(strMessage, m_legacyHistory, m_ssLegacy);
+        m_parser.parse(strMessage);
+        if (m_ssLegacy.str() != m_ssParser.str() || !sameHistory(m_parser.history())) {
+            describe(strMessage, "CommandParser", m_ssParser.str(), m_parser.history(), os);
+            return false;
+        }
+        parseCommand(std::string_view(strMessage), m_freeFunctionHistory, m_freeFunctionSink);
+        if (m_ssLegacy.str() != m_ssFreeFunction.str() || !sameHistory(m_freeFunctionHistory)) {
+            describe(strMessage, "parseCommand free function", m_ssFreeFunction.str(), m_freeFunctionHistory, os);
+            return false;
+        }
+        if (m_bValidate) {
+            m_ssValidated.str(std::string());
+            std::size_t uHistoryBefore = m_validatedParser.history().size();
+            ParseErrorReason eReason{};
+            bool bValid = validateMessage(strMessage, m_rules, eReason);
+            m_validatedParser.parse(strMessage);
+            if (bValid) {
+                if (m_ssLegacy.str() != m_ssValidated.str() || !sameHistory(m_validatedParser.history())) {
+                    describe(strMessage, "CommandParser with validation", m_ssValidated.str(), m_validatedParser.history(), os);
+                    return false;
+                }
+                return true;
+            }
+            m_uRejected++;
+            //A RUN_NO____ / POLAR_NO__ value that isn't strictly an integer is reported as invalid and recorded, as std::stoi failing would be.
+            //Any other rejection must not print or touch the history.
+            std::string strExpected;
+            bool bRecorded = eReason == ParseErrorReason::InvalidRunNumber || eReason == ParseErrorReason::InvalidPolarNumber;
+            if (bRecorded) {
+                strExpected = (eReason == ParseErrorReason::InvalidRunNumber ? "Invalid Run number: " : "Invalid Polar number: ")
+                    + strMessage.substr(kOpCodeLength, strMessage.length() - kOpCodeLength - 1) + "\n";
+            }
+            if (m_ssValidated.str() != strExpected || (bRecorded ? !sameHistory(m_validatedParser.history()) : m_validatedParser.history().size() != uHistoryBefore)) {
+                describe(strMessage, "CommandParser with validation (rejected)", m_ssValidated.str(), m_validatedParser.history(), os);
+                return false;
+            }
+            //The legacy history may have moved on without the validated parser's, so restart it from the legacy one.
+            resyncValidatedHistory();
+        }
+        return true;
+    }
+
+    std::size_t messages() const {
+        return m_uMessages;
+    }
+
+    //Messages the validation stage rejected, which are only checked for having no effect.
+    std::size_t rejected() const {
+        return m_uRejected;
+    }
+
+private:
+    bool sameHistory(const CommandHistory& history) const {
+        if (history.size() != m_legacyHistory.size()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < history.size(); i++) {
+            if (history[i] != m_legacyHistory[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void resyncValidatedHistory() {
+        CommandHistory& history = m_validatedParser.history();
+        history.clear();
+        for (std::size_t i = m_legacyHistory.size(); i-- > 0;) {
+            history.push(m_legacyHistory[i]);
+        }
+    }
+
+    void describe(const std::string& strMessage, const char* szParser, const std::string& strOutput, const CommandHistory& history, std::ostream& os) const {
+        os << "Difference at message " << m_uMessages << ": \"";
+        writeEscaped(os, strMessage);
+        os << "\"\nparseCommand printed:\n" << m_ssLegacy.str() << "history:";
+        for (const std::string& strOpCode : m_legacyHistory) {
+            os << " " << strOpCode;
+        }
+        os << "\n" << szParser << " printed:\n" << strOutput << "history:";
+        for (std::size_t i = 0; i < history.size(); i++) {
+            os << " " << history[i];
+        }
+        os << "\n";
+    }
+
+    std::ostringstream m_ssLegacy;
+    std::ostringstream m_ssParser;
+    std::ostringstream m_ssValidated;
+    std::ostringstream m_ssFreeFunction;
+    ConsoleSink m_sink{ m_ssParser };
+    ConsoleSink m_freeFunctionSink{ m_ssFreeFunction };
+    CommandHistory m_freeFunctionHistory;
+    ConsoleSink m_validatedSink{ m_ssValidated };
+    std::deque<std::string> m_legacyHistory;
+    CommandParser m_parser;
+    CommandParser m_validatedParser;
+    ValidationRules m_rules;
+    bool m_bValidate = false;
+    std::size_t m_uMessages = 0;
+    std::size_t m_uRejected = 0;
+};
+
+//Check each line of svInput as a message, as the prompt reads them. Returns false at the first difference.
+static bool checkLines(DifferentialRunner& runner, std::string_view svInput, std::ostream& os) {
+    while (!svInput.empty()) {
+        std::size_t uEnd = svInput.find('\n');
+        std::string strLine(svInput.substr(0, uEnd));
+        if (!runner.check(strLine, os)) {
+            return false;
+        }
+        svInput.remove_prefix(uEnd == std::string_view::npos ? svInput.length() : uEnd + 1);
+    }
+    return true;
+}
+
+#if defined(COMMANDMANAGER_LIBFUZZER)
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* pData, std::size_t uSize) {
+    //Fresh state per input, so a failure reproduces from its input alone.
+    DifferentialRunner runner(true);
+    if (!checkLines(runner, std::string_view(reinterpret_cast<const char*>(pData), uSize), std::cerr)) {
+        std::abort();
+    }
+    return 0;
+}
+
+#else
+
+//Generates messages that are mostly well formed, with the mistakes and corner cases each opcode has to handle mixed in.
+class MessageGenerator {
+public:
+    explicit MessageGenerator(std::uint64_t uSeed) : m_random(uSeed) {}
+
+    std::string next() {
+        static const char* const kOpCodes[] = { "RUN_NO____", "POLAR_NO__", "USR_MSG___", "D_USR_FLD_", "HISTORY___", "UNKNOWN___", "RUN_NO___", "run_no____", "D_USR_FLD" };
+        std::string strMessage = pick(kOpCodes);
+        if (strMessage == "RUN_NO____" || strMessage == "POLAR_NO__") {
+            strMessage += number();
+        }
+        else if (strMessage.compare(0, 9, "D_USR_FLD") == 0) {
+            strMessage += parameters();
+        }
+        else if (chance(50)) {
+            strMessage += text();
+        }
+        //Occasionally drop or double the terminator, or corrupt a byte.
+        int iRoll = roll(100);
+        if (iRoll >= 4) {
+            strMessage += '#';
+        }
+        if (iRoll == 2) {
+            strMessage += "##";
+        }
+        if (iRoll == 3 && !strMessage.empty()) {
+            strMessage[roll(static_cast<int>(strMessage.length()))] = static_cast<char>(roll(256));
+        }
+        return strMessage;
+    }
+
+private:
+    std::string number() {
+        static const char* const kNumbers[] = { "0", "7", "123", "-5", "+5", " 12", "\t3", "12abc", "1.5", "1e3", "0x1A", "2147483647", "2147483648",
+            "-2147483648", "-2147483649", "99999999999999999999", "", " ", "-", "+", "abc", "00042", "--1", "1 2", "\xe2\x82\xac" "1" };
+        if (chance(30)) {
+            return std::to_string(static_cast<int>(m_random()));
+        }
+        return pick(kNumbers);
+    }
+
+    std::string value() {
+        static const char* const kValues[] = { "0.004947", "0.203044", "1", "-0", "+2.5", " 3.25", "1e5", "1e-5", "1e400", "-1e400", "1e-400", "inf", "-INF",
+            "nan", "NaN(1)", "0x1p4", "0x", ".5", "5.", ".", "1.2.3", "12abc", "abc", "", "1d", "infinity", "0.1234567", "99999999999999999999999",
+            //Subnormals: strtod accepts exact hexadecimal ones and rejects any that lose bits, including those that round up to DBL_MIN.
+            "0x1p-1074", "0x1.8p-1073", "-0x1p-1074", "0x.8p-1073", "0x400p-1084", "0x1p-1075", "0x1.4p-1074", "0x1.fffffffffffffp-1023",
+            "0x0.fffffffffffff8p-1022", "0x1p-1022", "4.9406564584124654e-324", "1e-310", "0x1p+-3", "0x1p-+3", "0x1p++3", "0x1p-" };
+        if (chance(30)) {
+            return std::to_string(static_cast<double>(static_cast<std::int64_t>(m_random())) / static_cast<double>(1 + roll(1000000)));
+        }
+        return pick(kValues);
+    }
+
+    std::string name() {
+        static const char* const kNames[] = { "Parameter1", "Parameter2", "P", "ParameterT", "Exactly15Chars_", "Exactly16Chars__", "AVeryLongParameterName", " Spaced" };
+        return pick(kNames);
+    }
+
+    std::string parameters() {
+        std::string strContent;
+        int iTokens = roll(chance(5) ? 400 : 9);
+        for (int i = 0; i < iTokens; i++) {
+            strContent += i % 2 == 0 ? name() : value();
+            strContent += ',';
+            //Empty tokens are ignored, so they shouldn't change which tokens pair up.
+            if (chance(10)) {
+                strContent += ',';
+            }
+        }
+        if (chance(30) && !strContent.empty()) {
+            strContent.pop_back();
+        }
+        return strContent;
+    }
+
+    std::string text() {
+        static const char* const kTexts[] = { "Start Tunnel", "test", "", " ", "#", "a#b", "\t", "\xc3\xa9", "RUN_NO____1" };
+        return pick(kTexts);
+    }
+
+    template <std::size_t N>
+    const char* pick(const char* const (&arrChoices)[N]) {
+        return arrChoices[roll(static_cast<int>(N))];
+    }
+
+    int roll(int iCount) {
+        return static_cast<int>(m_random() % static_cast<std::uint64_t>(iCount));
+    }
+
+    bool chance(int iPercent) {
+        return roll(100) < iPercent;
+    }
+
+    std::mt19937_64 m_random;
+};
+
+//One parser with its output, capture and schema, so each way of feeding messages in can be compared with the others.
+struct BatchLane {
+    BatchLane() : captureSink(capture, &consoleSink), schemaBuffer(ParameterSchema{ "Parameter1", "Parameter2" }), parser(captureSink) {
+        //Messages naming exactly these parameters take the schema path, the rest the general one.
+        parser.setSchema(&schemaBuffer);
+    }
+
+    std::ostringstream ssOutput;
+    ConsoleSink consoleSink{ ssOutput };
+    ParameterCapture capture;
+    CaptureSink captureSink;
+    SchemaBuffer schemaBuffer;
+    CommandParser parser;
+};
+
+//Checks parseBatch and parseBuffer against parse() one message at a time, buffer by buffer.
+class BatchRunner {
+public:
+    //Add messages to the pending bytes and run every complete message through each lane. Returns false, having described it on os, at a difference.
+    bool check(const std::vector<std::string>& vecMessages, std::ostream& os) {
+        for (const std::string& strMessage : vecMessages) {
+            m_strPending += strMessage;
+        }
+        std::vector<std::string_view> vecFrames;
+        std::string_view svRemainder = MessageFramer::frameBuffer(m_strPending, [&](std::string_view svMessage) { vecFrames.push_back(svMessage); });
+        for (std::string_view svMessage : vecFrames) {
+            m_sequential.parser.parse(svMessage);
+        }
+        m_batch.parser.parseBatch(vecFrames);
+        std::string_view svBufferRemainder = m_buffer.parser.parseBuffer(m_strPending);
+        m_uMessages += vecFrames.size();
+        m_uBatches++;
+        bool bSame = sameAs(m_batch, "parseBatch", os) && sameAs(m_buffer, "parseBuffer", os);
+        if (bSame && svBufferRemainder != svRemainder) {
+            os << "Difference in batch " << m_uBatches << ": parseBuffer left " << svBufferRemainder.length() << " bytes, framing left " << svRemainder.length() << "\n";
+            bSame = false;
+        }
+        if (!bSame) {
+            os << "Buffer: \"";
+            writeEscaped(os, m_strPending);
+            os << "\"\n";
+            return false;
+        }
+        m_strPending = std::string(svRemainder);
+        for (BatchLane* pLane : { &m_sequential, &m_batch, &m_buffer }) {
+            pLane->ssOutput.str(std::string());
+            pLane->capture.clear();
+        }
+        return true;
+    }
+
+    std::size_t messages() const {
+        return m_uMessages;
+    }
+
+    std::size_t batches() const {
+        return m_uBatches;
+    }
+
+private:
+    bool sameAs(const BatchLane& lane, const char* szMethod, std::ostream& os) const {
+        const char* szWhat = nullptr;
+        if (lane.ssOutput.str() != m_sequential.ssOutput.str()) {
+            szWhat = "output";
+        }
+        else if (!sameHistory(lane.parser.history(), m_sequential.parser.history())) {
+            szWhat = "history";
+        }
+        else if (lane.capture.runNumbers() != m_sequential.capture.runNumbers() || lane.capture.polarNumbers() != m_sequential.capture.polarNumbers()) {
+            szWhat = "captured run or polar numbers";
+        }
+        if (szWhat == nullptr) {
+            return true;
+        }
+        os << "Difference in batch " << m_uBatches << ": " << szMethod << " " << szWhat << " differs from parsing each message\n"
+            << "parse printed:\n" << m_sequential.ssOutput.str() << szMethod << " printed:\n" << lane.ssOutput.str();
+        writeRuns(os, "parse", m_sequential.capture);
+        writeRuns(os, szMethod, lane.capture);
+        return false;
+    }
+
+    static void writeRuns(std::ostream& os, const char* szMethod, const ParameterCapture& capture) {
+        os << szMethod << " captured runs:";
+        for (std::int32_t iRunNumber : capture.runNumbers()) {
+            os << " " << iRunNumber;
+        }
+        os << "\n";
+    }
+
+    static bool sameHistory(const CommandHistory& history, const CommandHistory& expected) {
+        if (history.size() != expected.size()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < history.size(); i++) {
+            if (history[i] != expected[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    BatchLane m_sequential;
+    BatchLane m_batch;
+    BatchLane m_buffer;
+    //Bytes after the last complete message, carried into the next buffer as a reader would.
+    std::string m_strPending;
+    std::size_t m_uMessages = 0;
+    std::size_t m_uBatches = 0;
+};
+
+//Console text of each result, split by the default priority of the opcode it came from, as a pipeline only keeps the order within a priority.
+class PriorityLogSink : public ResultSink {
+public:
+    void onResult(const ParseResult& result) override {
+        const ParseError* pError = std::get_if<ParseError>(&result);
+        bool bHigh = std::holds_alternative<RunNumber>(result) || std::holds_alternative<PolarNumber>(result) || std::holds_alternative<UserMessage>(result)
+            || (pError != nullptr && (pError->eReason == ParseErrorReason::InvalidRunNumber || pError->eReason == ParseErrorReason::InvalidPolarNumber));
+        writeResult(bHigh ? m_ssHigh : m_ssNormal, result);
+    }
+
+    std::string high() const {
+        return m_ssHigh.str();
+    }
+
+    std::string normal() const {
+        return m_ssNormal.str();
+    }
+
+    void clear() {
+        m_ssHigh.str(std::string());
+        m_ssNormal.str(std::string());
+    }
+
+private:
+    std::ostringstream m_ssHigh;
+    std::ostringstream m_ssNormal;
+};
+
+//Checks a CommandPipeline with the default priorities against parse() one message at a time, flushing the pipeline after each group of messages.
+class PipelineRunner {
+public:
+    PipelineRunner()
+        : m_sequentialCaptureSink(m_sequentialCapture, &m_sequentialLog), m_sequentialParser(m_sequentialCaptureSink),
+          m_pipelineCaptureSink(m_pipelineCapture, &m_pipelineLog), m_pipelineParser(m_pipelineCaptureSink),
+          //Few slots, so the reader often waits on the commit thread and High messages get ahead of Normal ones still being decoded.
+          m_pipeline(m_pipelineParser, 3, 64) {}
+
+    //Run messages through both and compare once the pipeline has committed them. Returns false, having described it on os, at a difference.
+    bool check(const std::vector<std::string>& vecMessages, std::ostream& os) {
+        for (const std::string& strMessage : vecMessages) {
+            m_sequentialParser.parse(strMessage);
+            m_pipeline.parse(strMessage);
+        }
+        m_pipeline.flush();
+        m_uMessages += vecMessages.size();
+        m_uBatches++;
+        const RunContext& sequentialContext = m_sequentialParser.runContext();
+        const RunContext& pipelineContext = m_pipelineParser.runContext();
+        const char* szWhat = nullptr;
+        if (m_pipelineLog.high() != m_sequentialLog.high()) {
+            szWhat = "High output";
+        }
+        else if (m_pipelineLog.normal() != m_sequentialLog.normal()) {
+            szWhat = "Normal output";
+        }
+        else if (!sameHistory(m_pipelineParser.history(), m_sequentialParser.history())) {
+            szWhat = "history";
+        }
+        else if (pipelineContext.iRunNumber != sequentialContext.iRunNumber || pipelineContext.iPolarNumber != sequentialContext.iPolarNumber) {
+            szWhat = "run context";
+        }
+        else if (m_pipelineCapture.runNumbers() != m_sequentialCapture.runNumbers() || m_pipelineCapture.polarNumbers() != m_sequentialCapture.polarNumbers()) {
+            szWhat = "captured run or polar numbers";
+        }
+        if (szWhat != nullptr) {
+            os << "Difference in batch " << m_uBatches << ": CommandPipeline " << szWhat << " differs from parsing each message\n"
+                << "parse printed:\n" << m_sequentialLog.high() << m_sequentialLog.normal()
+                << "CommandPipeline printed, High then Normal:\n" << m_pipelineLog.high() << m_pipelineLog.normal() << "Messages:\n";
+            for (const std::string& strMessage : vecMessages) {
+                os << "\"";
+                writeEscaped(os, strMessage);
+                os << "\"\n";
+            }
+            return false;
+        }
+        m_sequentialLog.clear();
+        m_pipelineLog.clear();
+        m_sequentialCapture.clear();
+        m_pipelineCapture.clear();
+        return true;
+    }
+
+    std::size_t messages() const {
+        return m_uMessages;
+    }
+
+    std::size_t batches() const {
+        return m_uBatches;
+    }
+
+    //High messages the pipeline passed on ahead of earlier ones, the case this is meant to check.
+    std::size_t expedited() const {
+        return m_pipeline.expedited();
+    }
+
+private:
+    static bool sameHistory(const CommandHistory& history, const CommandHistory& expected) {
+        if (history.size() != expected.size()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < history.size(); i++) {
+            if (history[i] != expected[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    PriorityLogSink m_sequentialLog;
+    ParameterCapture m_sequentialCapture;
+    CaptureSink m_sequentialCaptureSink;
+    CommandParser m_sequentialParser;
+    PriorityLogSink m_pipelineLog;
+    ParameterCapture m_pipelineCapture;
+    CaptureSink m_pipelineCaptureSink;
+    CommandParser m_pipelineParser;
+    //Declared last so its threads stop before the parser and sinks they use are destroyed.
+    CommandPipeline<> m_pipeline;
+    std::size_t m_uMessages = 0;
+    std::size_t m_uBatches = 0;
+};
+
+//Console text of each result, kept per ingest source.
+class SourceLogSink : public ResultSink {
+public:
+    void setServer(const IngestServer& server) {
+        m_pServer = &server;
+    }
+
+    void onResult(const ParseResult& result) override {
+        writeResult(m_mapOutput[m_pServer->currentSource()->address()], result);
+    }
+
+    std::string output(const std::string& strAddress) {
+        return m_mapOutput[strAddress].str();
+    }
+
+    void clear() {
+        m_mapOutput.clear();
+    }
+
+private:
+    const IngestServer* m_pServer = nullptr;
+    std::unordered_map<std::string, std::ostringstream> m_mapOutput;
+};
+
+//Checks that an IngestServer keeps two connections from the same host apart: each must parse exactly as its own parser fed the bytes sent on it.
+class IngestRunner {
+public:
+    static constexpr std::size_t kConnections = 2;
+
+    explicit IngestRunner(std::uint64_t uSeed) : m_server(m_sink), m_random(uSeed) {
+        m_sink.setServer(m_server);
+        for (Connection& connection : m_arrConnections) {
+            connection.pParser = std::make_unique<CommandParser>(connection.sink);
+        }
+    }
+
+    ~IngestRunner() {
+        for (Connection& connection : m_arrConnections) {
+            if (connection.hSocket != kInvalidSocket) {
+                IngestSocket::close(connection.hSocket);
+            }
+        }
+    }
+
+    //Listen on a loopback port and open every connection to it. Returns false and sets strError if the sockets can't be set up.
+    bool connect(std::string& strError) {
+        if (!m_server.listenTcp(0, strError, "127.0.0.1")) {
+            return false;
+        }
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(m_server.port());
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        for (Connection& connection : m_arrConnections) {
+            connection.hSocket = socket(AF_INET, SOCK_STREAM, 0);
+            if (connection.hSocket == kInvalidSocket || ::connect(connection.hSocket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+                || !IngestSocket::setNonBlocking(connection.hSocket)) {
+                strError = "Can't connect to the ingest server";
+                return false;
+            }
+            connection.strAddress = "tcp://127.0.0.1:" + std::to_string(IngestSocket::localPort(connection.hSocket));
+        }
+        //The server only accepts while polling.
+        for (int i = 0; i < 100 && m_server.connectionCount() < kConnections; i++) {
+            m_server.poll(10);
+        }
+        if (m_server.sourceCount() != kConnections) {
+            strError = "The ingest server made " + std::to_string(m_server.sourceCount()) + " sources for " + std::to_string(kConnections) + " connections";
+            return false;
+        }
+        return true;
+    }
+
+    //Send each message on a random connection, wait for the server to read everything and compare every source. Returns false, having described it on os, at a difference.
+    bool check(const std::vector<std::string>& vecMessages, std::ostream& os) {
+        for (Connection& connection : m_arrConnections) {
+            connection.strPending.clear();
+        }
+        for (const std::string& strMessage : vecMessages) {
+            m_arrConnections[m_random() % kConnections].strPending += strMessage;
+        }
+        for (Connection& connection : m_arrConnections) {
+            connection.framer.feed(connection.strPending, [&connection](std::string_view svMessage) { connection.pParser->parse(svMessage); });
+            connection.uSent += connection.strPending.length();
+        }
+        m_uMessages += vecMessages.size();
+        m_uBatches++;
+        if (!deliver(os)) {
+            return false;
+        }
+        for (Connection& connection : m_arrConnections) {
+            const IngestSource* pSource = m_server.findSource(connection.strAddress);
+            const char* szWhat = nullptr;
+            if (pSource == nullptr) {
+                szWhat = "source";
+            }
+            else if (m_sink.output(connection.strAddress) != connection.ssOutput.str()) {
+                szWhat = "output";
+            }
+            else if (!sameHistory(pSource->parser().history(), connection.pParser->history())) {
+                szWhat = "history";
+            }
+            else if (pSource->parser().runContext().iRunNumber != connection.pParser->runContext().iRunNumber
+                || pSource->parser().runContext().iPolarNumber != connection.pParser->runContext().iPolarNumber) {
+                szWhat = "run context";
+            }
+            if (szWhat != nullptr) {
+                os << "Difference in batch " << m_uBatches << ": " << connection.strAddress << " " << szWhat << " differs from its own parser\n"
+                    << "parser printed:\n" << connection.ssOutput.str() << "source printed:\n" << m_sink.output(connection.strAddress) << "Sent: \"";
+                writeEscaped(os, connection.strPending);
+                os << "\"\n";
+                return false;
+            }
+            connection.ssOutput.str(std::string());
+        }
+        m_sink.clear();
+        return true;
+    }
+
+    std::size_t messages() const {
+        return m_uMessages;
+    }
+
+    std::size_t batches() const {
+        return m_uBatches;
+    }
+
+private:
+    struct Connection {
+        SocketHandle hSocket = kInvalidSocket;
+        std::string strAddress;
+        std::string strPending;
+        std::uint64_t uSent = 0;
+        std::ostringstream ssOutput;
+        ConsoleSink sink{ ssOutput };
+        MessageFramer framer;
+        std::unique_ptr<CommandParser> pParser;
+    };
+
+    //Send the pending bytes on every connection, polling the server in between so neither side's buffers fill, until it has read them all.
+    bool deliver(std::ostream& os) {
+        std::size_t arrOffsets[kConnections] = {};
+        for (int iIdle = 0; iIdle < 1000;) {
+            bool bDone = true;
+            for (std::size_t i = 0; i < kConnections; i++) {
+                Connection& connection = m_arrConnections[i];
+                if (arrOffsets[i] < connection.strPending.length()) {
+                    int iSent = static_cast<int>(send(connection.hSocket, connection.strPending.data() + arrOffsets[i],
+                        static_cast<int>(connection.strPending.length() - arrOffsets[i]), 0));
+                    if (iSent > 0) {
+                        arrOffsets[i] += static_cast<std::size_t>(iSent);
+                    }
+                }
+                const IngestSource* pSource = m_server.findSource(connection.strAddress);
+                bDone = bDone && pSource != nullptr && pSource->bytes() == connection.uSent;
+            }
+            if (bDone) {
+                return true;
+            }
+            m_server.poll(1);
+            iIdle++;
+        }
+        os << "Timed out in batch " << m_uBatches << " waiting for the ingest server to read the messages\n";
+        return false;
+    }
+
+    static bool sameHistory(const CommandHistory& history, const CommandHistory& expected) {
+        if (history.size() != expected.size()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < history.size(); i++) {
+            if (history[i] != expected[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    SourceLogSink m_sink;
+    IngestServer m_server;
+    Connection m_arrConnections[kConnections];
+    std::mt19937_64 m_random;
+    std::size_t m_uMessages = 0;
+    std::size_t m_uBatches = 0;
+};
+
+//Feed generated messages to a BatchRunner, PipelineRunner or IngestRunner in groups of random size. Returns false at the first difference.
+template <typename TRunner>
+static bool checkRandomBatches(TRunner& runner, std::uint64_t uCount, std::uint64_t uSeed, std::ostream& os) {
+    MessageGenerator generator(uSeed);
+    std::mt19937_64 random(uSeed);
+    std::vector<std::string> vecMessages;
+    for (std::uint64_t u = 0; u < uCount;) {
+        //Mostly small groups, now and then one the size of a network read.
+        std::uint64_t uBatch = 1 + random() % (random() % 20 == 0 ? 500 : 16);
+        vecMessages.clear();
+        for (; u < uCount && vecMessages.size() < uBatch; u++) {
+            vecMessages.push_back(generator.next());
+        }
+        if (!runner.check(vecMessages, os)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void printUsage() {
+    std::cerr << "Usage: CommandManagerFuzz [--validate | --batch | --pipeline | --ingest] --random <count> [--seed <n>]\n"
+        << "       CommandManagerFuzz [--validate] --capture <file>...\n"
+        << "       CommandManagerFuzz [--validate] [file...]    (one message per line, stdin without files)\n";
+}
+
+static bool readFile(const char* szPath, std::string& strContent) {
+    std::ifstream file(szPath, std::ios::binary);
+    if (!file) {
+        std::cerr << "Can't open " << szPath << "\n";
+        return false;
+    }
+    std::ostringstream ssContent;
+    ssContent << file.rdbuf();
+    strContent = ssContent.str();
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bool bValidate = false;
+    bool bCapture = false;
+    bool bBatch = false;
+    bool bPipeline = false;
+    bool bIngest = false;
+    std::uint64_t uRandomCount = 0;
+    std::uint64_t uSeed = std::random_device()();
+    std::vector<const char*> vecFiles;
+    for (int i = 1; i < argc; i++) {
+        std::string_view svArgument = argv[i];
+        if (svArgument == "--validate") {
+            bValidate = true;
+        }
+        else if (svArgument == "--capture") {
+            bCapture = true;
+        }
+        else if (svArgument == "--batch") {
+            bBatch = true;
+        }
+        else if (svArgument == "--pipeline") {
+            bPipeline = true;
+        }
+        else if (svArgument == "--ingest") {
+            bIngest = true;
+        }
+        else if ((svArgument == "--random" || svArgument == "--seed") && i + 1 < argc) {
+            (svArgument == "--random" ? uRandomCount : uSeed) = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (svArgument.length() > 1 && svArgument[0] == '-') {
+            printUsage();
+            return 2;
+        }
+        else {
+            vecFiles.push_back(argv[i]);
+        }
+    }
+
+    if (bBatch || bPipeline || bIngest) {
+        if (uRandomCount == 0 || bValidate || bCapture || (bBatch ? 1 : 0) + (bPipeline ? 1 : 0) + (bIngest ? 1 : 0) > 1) {
+            printUsage();
+            return 2;
+        }
+        std::cout << "Random batches with seed " << uSeed << "\n";
+        if (bBatch) {
+            BatchRunner batchRunner;
+            if (!checkRandomBatches(batchRunner, uRandomCount, uSeed, std::cout)) {
+                return 1;
+            }
+            std::cout << batchRunner.messages() << " messages in " << batchRunner.batches() << " batches, no differences\n";
+        }
+        else if (bIngest) {
+            IngestRunner ingestRunner(uSeed);
+            std::string strError;
+            if (!ingestRunner.connect(strError)) {
+                std::cerr << strError << "\n";
+                return 2;
+            }
+            if (!checkRandomBatches(ingestRunner, uRandomCount, uSeed, std::cout)) {
+                return 1;
+            }
+            std::cout << ingestRunner.messages() << " messages in " << ingestRunner.batches() << " batches over " << IngestRunner::kConnections
+                << " connections, no differences\n";
+        }
+        else {
+            PipelineRunner pipelineRunner;
+            if (!checkRandomBatches(pipelineRunner, uRandomCount, uSeed, std::cout)) {
+                return 1;
+            }
+            std::cout << pipelineRunner.messages() << " messages in " << pipelineRunner.batches() << " batches, no differences ("
+                << pipelineRunner.expedited() << " expedited)\n";
+        }
+        return 0;
+    }
+
+    DifferentialRunner runner(bValidate);
+    bool bSame = true;
+    if (uRandomCount != 0) {
+        std::cout << "Random messages with seed " << uSeed << "\n";
+        MessageGenerator generator(uSeed);
+        for (std::uint64_t u = 0; bSame && u < uRandomCount; u++) {
+            bSame = runner.check(generator.next(), std::cout);
+        }
+    }
+    else if (bCapture) {
+        for (const char* szPath : vecFiles) {
+            std::string strCapture;
+            if (!readFile(szPath, strCapture)) {
+                return 2;
+            }
+            MessageFramer framer;
+            framer.feed(strCapture, [&](std::string_view svMessage) {
+                bSame = bSame && runner.check(std::string(svMessage), std::cout);
+            });
+        }
+    }
+    else if (vecFiles.empty()) {
+        std::ostringstream ssInput;
+        ssInput << std::cin.rdbuf();
+        bSame = checkLines(runner, ssInput.str(), std::cout);
+    }
+    else {
+        for (const char* szPath : vecFiles) {
+            std::string strInput;
+            if (!readFile(szPath, strInput)) {
+                return 2;
+            }
+            bSame = bSame && checkLines(runner, strInput, std::cout);
+        }
+    }
+
+    if (!bSame) {
+        //AFL only notices crashes, so a difference in its inputs has to end the process like one.
+        if (uRandomCount == 0 && !bCapture) {
+            std::abort();
+        }
+        return 1;
+    }
+    std::cout << runner.messages() << " messages, no differences";
+    if (bValidate) {
+        std::cout << " (" << runner.rejected() << " rejected by validation)";
+    }
+    std::cout << "\n";
+    return 0;
+}
+
+#endif
@@ -0,0 +1,16 @@
+/*
+    Command Manager Interactive Prompt
+
+    Parses messages typed at the prompt, or piped in, one per line until EXIT or the end of the input.
+*/
+
+#include "CommandManager.h"
+#include "ConsoleSession.h"
+
+int main()
+{
+    ConsoleSink consoleSink;
+    CommandParser parser(consoleSink);
+    runInteractive(parser);
+    return 0;
+}
@@ -0,0 +1,342 @@
+/*
+    Command Manager Parse Pipeline
+
+    Spreads framing, parsing and output over several threads for when one core can't keep up with all the measurement subsystems:
+    - The caller's reader thread feeds raw chunks in, which are framed into messages and copied into slots.
+    - N worker threads decode messages from a lock-free queue in parallel.
+    - A commit thread passes decoded messages to the parser in arrival order, so the history and sink see exactly what a single-threaded parser would.
+    - Opcodes have a priority, set in the parser's handler registry (see CommandPriority). Each priority has its own queue and workers empty the High
+      queue first. The commit thread passes a decoded High message to the sink straight away rather than waiting behind bulk D_USR_FLD_ traffic that
+      arrived before it, with High messages kept in order among themselves. Opcodes are still added to the history, and RUN_NO____ / POLAR_NO__
+      applied to the parser's run context, in arrival order, so HISTORY___, history listeners, runContext() and the context stamped on each D_USR_FLD_
+      result (which CaptureSink tags rows with) are the same as without priorities. A sink does see the High result itself early, e.g. a new RUN_NO____
+      before the D_USR_FLD_ values of the previous run that are still being decoded; use the context on those results rather than the order they arrive in.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+//Wait strategy for pipeline threads: spin briefly, then give up the time slice.
+class Backoff {
+public:
+    void pause() {
+        if (m_uSpins < kSpinLimit) {
+            m_uSpins++;
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+
+    void reset() {
+        m_uSpins = 0;
+    }
+
+private:
+    static constexpr unsigned kSpinLimit = 64;
+    unsigned m_uSpins = 0;
+};
+
+//Bounded lock-free multi-producer multi-consumer queue. Each cell carries a sequence number which tells producers and consumers whose turn it is,
+//so neither side takes a lock. The capacity is rounded up to a power of two.
+template <typename T>
+class BoundedMpmcQueue {
+public:
+    explicit BoundedMpmcQueue(std::size_t uCapacity) {
+        std::size_t uSize = 2;
+        while (uSize < uCapacity) {
+            uSize <<= 1;
+        }
+        m_uMask = uSize - 1;
+        m_pCells.reset(new Cell[uSize]);
+        for (std::size_t i = 0; i < uSize; i++) {
+            m_pCells[i].uSequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedMpmcQueue(const BoundedMpmcQueue&) = delete;
+    BoundedMpmcQueue& operator=(const BoundedMpmcQueue&) = delete;
+
+    std::size_t capacity() const {
+        return m_uMask + 1;
+    }
+
+    //Add a value, returns false if the queue is full.
+    bool tryPush(const T& value) {
+        std::size_t uPosition = m_uEnqueue.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = m_pCells[uPosition & m_uMask];
+            std::size_t uSequence = cell.uSequence.load(std::memory_order_acquire);
+            std::ptrdiff_t iDifference = static_cast<std::ptrdiff_t>(uSequence) - static_cast<std::ptrdiff_t>(uPosition);
+            if (iDifference == 0) {
+                if (m_uEnqueue.compare_exchange_weak(uPosition, uPosition + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.uSequence.store(uPosition + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (iDifference < 0) {
+                return false;
+            }
+            else {
+                uPosition = m_uEnqueue.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    //Take the oldest value, returns false if the queue is empty.
+    bool tryPop(T& value) {
+        std::size_t uPosition = m_uDequeue.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = m_pCells[uPosition & m_uMask];
+            std::size_t uSequence = cell.uSequence.load(std::memory_order_acquire);
+            std::ptrdiff_t iDifference = static_cast<std::ptrdiff_t>(uSequence) - static_cast<std::ptrdiff_t>(uPosition + 1);
+            if (iDifference == 0) {
+                if (m_uDequeue.compare_exchange_weak(uPosition, uPosition + 1, std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.uSequence.store(uPosition + m_uMask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (iDifference < 0) {
+                return false;
+            }
+            else {
+                uPosition = m_uDequeue.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> uSequence{ 0 };
+        T value{};
+    };
+
+    std::unique_ptr<Cell[]> m_pCells;
+    std::size_t m_uMask = 0;
+    //Producers and consumers each have their own cache line.
+    alignas(64) std::atomic<std::size_t> m_uEnqueue{ 0 };
+    alignas(64) std::atomic<std::size_t> m_uDequeue{ 0 };
+};
+
+//Default number of messages that can be in flight between the reader and the commit thread.
+constexpr std::size_t kDefaultPipelineSlots = 1024;
+
+//Multi-threaded front end to a parser. feed() and parse() must be called from a single reader thread, the parser is only used by the commit thread.
+//Results reach the parser's sink on the commit thread, so the sink doesn't need to be thread safe, but it is a different thread to the caller's.
+//Each slot owns a copy of its message and its own parameter storage, so result views stay valid until the sink returns.
+template <typename TParser = CommandParser>
+class CommandPipeline {
+public:
+    CommandPipeline(TParser& parser, std::size_t uWorkers = 2, std::size_t uSlots = kDefaultPipelineSlots)
+        : m_parser(parser), m_arrLanes{ BoundedMpmcQueue<std::size_t>(uSlots), BoundedMpmcQueue<std::size_t>(uSlots) }, m_highOrder(uSlots) {
+        static_assert(kPriorityLanes == 2, "Every priority needs a queue");
+        //Use the queue's rounded capacity so a slot can always be queued once it is claimed.
+        m_vecSlots = std::vector<Slot>(m_arrLanes[0].capacity());
+        m_uSlotMask = m_vecSlots.size() - 1;
+        if (uWorkers == 0) {
+            uWorkers = 1;
+        }
+        for (std::size_t i = 0; i < uWorkers; i++) {
+            m_vecWorkers.emplace_back([this] { runWorker(); });
+        }
+        m_commitThread = std::thread([this] { runCommit(); });
+    }
+
+    CommandPipeline(const CommandPipeline&) = delete;
+    CommandPipeline& operator=(const CommandPipeline&) = delete;
+
+    ~CommandPipeline() {
+        stop();
+    }
+
+    //Frame a chunk of the byte stream and queue every complete message.
+    void feed(std::string_view svChunk) {
+        m_framer.feed(svChunk, [this](std::string_view svMessage) { parse(svMessage); });
+    }
+
+    //Queue one framed message in the lane for its opcode's priority. Blocks (spinning) while every slot is in flight.
+    void parse(std::string_view svMessage) {
+        CommandPriority ePriority = m_parser.extension().priority(svMessage);
+        std::size_t uSequence = m_uNextSequence++;
+        Slot& slot = m_vecSlots[uSequence & m_uSlotMask];
+        Backoff backoff;
+        while (slot.eState.load(std::memory_order_acquire) != SlotState::Free) {
+            backoff.pause();
+        }
+        slot.strMessage.assign(svMessage.data(), svMessage.length());
+        slot.eState.store(SlotState::Framed, std::memory_order_release);
+        //Can't fail as there are never more slots in flight than a queue holds.
+        m_arrLanes[static_cast<std::size_t>(ePriority)].tryPush(uSequence);
+        if (ePriority == CommandPriority::High) {
+            //Entries for messages already committed in sequence are dropped by the commit thread as it goes, so this only waits briefly if at all.
+            while (!m_highOrder.tryPush(uSequence)) {
+                backoff.pause();
+            }
+        }
+    }
+
+    //Wait until every message queued so far has been passed to the parser.
+    void flush() {
+        Backoff backoff;
+        while (m_uCommitted.load(std::memory_order_acquire) != m_uNextSequence) {
+            backoff.pause();
+        }
+    }
+
+    //Flush and then stop the worker and commit threads. The pipeline can't be used afterwards.
+    void stop() {
+        if (m_bStopping.load(std::memory_order_relaxed)) {
+            return;
+        }
+        flush();
+        m_bStopping.store(true, std::memory_order_release);
+        for (std::thread& worker : m_vecWorkers) {
+            worker.join();
+        }
+        m_commitThread.join();
+    }
+
+    //The framer holding any partial message from the last chunk.
+    const MessageFramer& framer() const {
+        return m_framer;
+    }
+
+    //Number of High messages passed to the sink ahead of earlier messages that were still being decoded.
+    std::size_t expedited() const {
+        return m_uExpedited.load(std::memory_order_relaxed);
+    }
+
+private:
+    enum class SlotState : std::uint8_t {
+        Free,
+        Framed,
+        Decoded,
+        //A High message already passed to the sink, waiting for its turn to be added to the history and applied to the run context.
+        Dispatched
+    };
+
+    struct Slot {
+        std::atomic<SlotState> eState{ SlotState::Free };
+        std::string strMessage;
+        std::pmr::vector<Parameter> vecParameters;
+        DecodedCommand command;
+        bool bRecordHistory = false;
+    };
+
+    //Decode messages, High ones first, in whatever order workers pick them up.
+    void runWorker() {
+        Backoff backoff;
+        std::size_t uSequence = 0;
+        while (true) {
+            if (popLane(uSequence)) {
+                Slot& slot = m_vecSlots[uSequence & m_uSlotMask];
+                //Workers time the decode in their own metrics shard, the commit thread counts the message when it is dispatched.
+                LatencyTimer timer;
+                decodeCommand(slot.strMessage, slot.vecParameters, slot.command);
+                timer.stop(static_cast<std::size_t>(slot.command.eOpCode));
+                slot.eState.store(SlotState::Decoded, std::memory_order_release);
+                backoff.reset();
+            }
+            else if (m_bStopping.load(std::memory_order_acquire)) {
+                return;
+            }
+            else {
+                backoff.pause();
+            }
+        }
+    }
+
+    //Take the next message to decode from the highest priority lane that has one.
+    bool popLane(std::size_t& uSequence) {
+        for (BoundedMpmcQueue<std::size_t>& lane : m_arrLanes) {
+            if (lane.tryPop(uSequence)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //Reorder stage: commit slots in sequence, which is the order the reader framed them, apart from passing the next High message to the sink early
+    //once it is decoded. Every opcode is added to the history, and every run or polar number applied, when its turn in the sequence comes.
+    void runCommit() {
+        Backoff backoff;
+        std::size_t uSequence = 0;
+        std::size_t uHighSequence = 0;
+        bool bHighPending = false;
+        while (true) {
+            bool bProgress = false;
+            //The next High message not yet committed in sequence. Its slot can't be reused until it is, so it still holds this message.
+            if (bHighPending && uHighSequence < uSequence) {
+                bHighPending = false;
+            }
+            while (!bHighPending && m_highOrder.tryPop(uHighSequence)) {
+                bHighPending = uHighSequence >= uSequence;
+            }
+            if (bHighPending) {
+                Slot& highSlot = m_vecSlots[uHighSequence & m_uSlotMask];
+                if (highSlot.eState.load(std::memory_order_acquire) == SlotState::Decoded) {
+                    highSlot.bRecordHistory = m_parser.dispatch(highSlot.command, false);
+                    highSlot.eState.store(SlotState::Dispatched, std::memory_order_relaxed);
+                    m_uExpedited.store(m_uExpedited.load(std::memory_order_relaxed) + (uHighSequence != uSequence ? 1 : 0), std::memory_order_relaxed);
+                    bHighPending = false;
+                    bProgress = true;
+                }
+            }
+            Slot& slot = m_vecSlots[uSequence & m_uSlotMask];
+            //A slot is only reused once its previous message is committed, so a decoded slot here always holds this sequence number.
+            SlotState eState = slot.eState.load(std::memory_order_acquire);
+            if (eState == SlotState::Decoded || eState == SlotState::Dispatched) {
+                bool bRecordHistory = slot.bRecordHistory;
+                if (eState == SlotState::Dispatched) {
+                    m_parser.applyRunContext(slot.command);
+                }
+                else {
+                    bRecordHistory = m_parser.dispatch(slot.command);
+                }
+                if (bRecordHistory) {
+                    m_parser.recordHistory(slot.command.svOpCode);
+                }
+                slot.eState.store(SlotState::Free, std::memory_order_release);
+                uSequence++;
+                m_uCommitted.store(uSequence, std::memory_order_release);
+                bProgress = true;
+            }
+            if (bProgress) {
+                backoff.reset();
+            }
+            else if (m_bStopping.load(std::memory_order_acquire)) {
+                return;
+            }
+            else {
+                backoff.pause();
+            }
+        }
+    }
+
+    TParser& m_parser;
+    MessageFramer m_framer;
+    //Sequence numbers of framed messages waiting for a worker, one queue per priority.
+    BoundedMpmcQueue<std::size_t> m_arrLanes[kPriorityLanes];
+    //Sequence numbers of High messages in arrival order, for the commit thread to pass them on early.
+    BoundedMpmcQueue<std::size_t> m_highOrder;
+    std::vector<Slot> m_vecSlots;
+    std::size_t m_uSlotMask = 0;
+    //Only touched by the reader thread.
+    std::size_t m_uNextSequence = 0;
+    alignas(64) std::atomic<std::size_t> m_uCommitted{ 0 };
+    std::atomic<std::size_t> m_uExpedited{ 0 };
+    std::atomic<bool> m_bStopping{ false };
+    std::vector<std::thread> m_vecWorkers;
+    std::thread m_commitThread;
+};
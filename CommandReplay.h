@@ -0,0 +1,225 @@
+/*
+    Command Manager Replay
+
+    Replays recorded captures of raw Command Manager messages for regression testing and post-run analysis.
+    The capture file is memory mapped rather than read, and messages are framed on '#' in place and passed to the batch parser as views into the mapping,
+    so nothing is copied however large the capture is. Replay runs as fast as possible, or paced to a message rate to reproduce the original timing.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    //Map a file, replacing any file already mapped. Returns false and sets error() if it can't be opened or mapped.
+    bool open(const std::string& strPath) {
+        close();
+#if defined(_WIN32)
+        m_hFile = CreateFileA(strPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_hFile == INVALID_HANDLE_VALUE) {
+            return fail("Can't open " + strPath);
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(m_hFile, &fileSize)) {
+            return fail("Can't get the size of " + strPath);
+        }
+        m_uSize = static_cast<std::size_t>(fileSize.QuadPart);
+        //An empty file can't be mapped, but it is a valid (empty) capture.
+        if (m_uSize == 0) {
+            return true;
+        }
+        m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_hMapping == nullptr) {
+            return fail("Can't map " + strPath);
+        }
+        m_pData = static_cast<const char*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+        if (m_pData == nullptr) {
+            return fail("Can't map " + strPath);
+        }
+#else
+        m_iFile = ::open(strPath.c_str(), O_RDONLY);
+        if (m_iFile < 0) {
+            return fail("Can't open " + strPath);
+        }
+        struct stat fileStat;
+        if (fstat(m_iFile, &fileStat) != 0) {
+            return fail("Can't get the size of " + strPath);
+        }
+        m_uSize = static_cast<std::size_t>(fileStat.st_size);
+        if (m_uSize == 0) {
+            return true;
+        }
+        void* pMapping = mmap(nullptr, m_uSize, PROT_READ, MAP_PRIVATE, m_iFile, 0);
+        if (pMapping == MAP_FAILED) {
+            return fail("Can't map " + strPath);
+        }
+        m_pData = static_cast<const char*>(pMapping);
+        //Replay reads front to back, so let the kernel read ahead aggressively.
+        madvise(pMapping, m_uSize, MADV_SEQUENTIAL);
+#endif
+        return true;
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (m_pData != nullptr) {
+            UnmapViewOfFile(m_pData);
+        }
+        if (m_hMapping != nullptr) {
+            CloseHandle(m_hMapping);
+        }
+        if (m_hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_hFile);
+        }
+        m_hMapping = nullptr;
+        m_hFile = INVALID_HANDLE_VALUE;
+#else
+        if (m_pData != nullptr) {
+            munmap(const_cast<char*>(m_pData), m_uSize);
+        }
+        if (m_iFile >= 0) {
+            ::close(m_iFile);
+        }
+        m_iFile = -1;
+#endif
+        m_pData = nullptr;
+        m_uSize = 0;
+    }
+
+    //The file's contents, valid until the file is closed.
+    std::string_view view() const {
+        return std::string_view(m_pData, m_uSize);
+    }
+
+    const std::string& error() const {
+        return m_strError;
+    }
+
+private:
+    bool fail(std::string strError) {
+        close();
+        m_strError = std::move(strError);
+        return false;
+    }
+
+#if defined(_WIN32)
+    HANDLE m_hFile = INVALID_HANDLE_VALUE;
+    HANDLE m_hMapping = nullptr;
+#else
+    int m_iFile = -1;
+#endif
+    const char* m_pData = nullptr;
+    std::size_t m_uSize = 0;
+    std::string m_strError;
+};
+
+//Bytes framed per batch when replaying as fast as possible. Windows end on a '#', so a message is never split.
+constexpr std::size_t kReplayWindowBytes = 1024 * 1024;
+
+//Most messages per batch when replay is paced. Slower rates use smaller batches, down to one message, so a batch is due about every millisecond.
+constexpr std::size_t kPacedReplayBatch = 64;
+
+struct ReplayOptions {
+    //Messages per second to replay at, or 0 to replay as fast as possible.
+    //Captures hold raw messages without timestamps, so the original timing is reproduced by giving the rate they were recorded at.
+    double dblMessagesPerSecond = 0.0;
+};
+
+struct ReplayStats {
+    std::uint64_t uMessages = 0;
+    std::uint64_t uBytes = 0;
+    double dblSeconds = 0.0;
+};
+
+//Replay a buffer of recorded messages through a parser's batch path, returning how much was replayed.
+//A trailing message without its '#' is parsed on its own at the end, the same as the interactive input would.
+template <typename TParser>
+ReplayStats replayBuffer(TParser& parser, std::string_view svCapture, const ReplayOptions& options = ReplayOptions()) {
+    using Clock = std::chrono::steady_clock;
+    ReplayStats stats;
+    Clock::time_point start = Clock::now();
+    std::vector<std::string_view> vecMessages;
+    std::size_t uWindow = kReplayWindowBytes;
+    std::size_t uPacedBatch = std::min(kPacedReplayBatch, std::max<std::size_t>(1, static_cast<std::size_t>(options.dblMessagesPerSecond / 1000.0)));
+    while (!svCapture.empty()) {
+        std::string_view svWindow = svCapture.substr(0, uWindow);
+        vecMessages.clear();
+        std::string_view svRemainder = MessageFramer::frameBuffer(svWindow, [&vecMessages](std::string_view svMessage) { vecMessages.push_back(svMessage); });
+        //A message longer than the window, widen it until the message fits.
+        if (vecMessages.empty() && svWindow.length() < svCapture.length() && !svRemainder.empty()) {
+            uWindow *= 2;
+            continue;
+        }
+        //Anything left at the end of the capture is its last message.
+        bool bLast = svWindow.length() == svCapture.length();
+        svCapture.remove_prefix(svWindow.length() - (bLast ? 0 : svRemainder.length()));
+        if (options.dblMessagesPerSecond <= 0.0) {
+            parser.parseBatch(vecMessages);
+            stats.uMessages += vecMessages.size();
+        }
+        else {
+            for (std::size_t uBegin = 0; uBegin < vecMessages.size(); uBegin += uPacedBatch) {
+                std::size_t uCount = std::min(uPacedBatch, vecMessages.size() - uBegin);
+                //Wait until this batch is due, as it would have arrived on the original link.
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(stats.uMessages / options.dblMessagesPerSecond)));
+                parser.parseBatch(vecMessages.data() + uBegin, uCount);
+                stats.uMessages += uCount;
+            }
+        }
+        if (bLast && !svRemainder.empty()) {
+            parser.parse(svRemainder);
+            stats.uMessages++;
+        }
+        uWindow = kReplayWindowBytes;
+    }
+    stats.dblSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return stats;
+}
+
+//Map and replay a capture file. Returns false and sets strError if the file can't be mapped.
+template <typename TParser>
+bool replayFile(TParser& parser, const std::string& strPath, ReplayStats& stats, std::string& strError, const ReplayOptions& options = ReplayOptions()) {
+    MappedFile file;
+    if (!file.open(strPath)) {
+        strError = file.error();
+        return false;
+    }
+    stats = replayBuffer(parser, file.view(), options);
+    stats.uBytes = file.view().length();
+    return true;
+}
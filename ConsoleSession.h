@@ -0,0 +1,46 @@
+/*
+    Command Manager Console Session
+
+    The example messages and the interactive prompt, shared by the CommandManager, CommandManagerDemo and CommandManagerRepl executables.
+    This is application code rather than part of the parser library, which is the other headers.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+
+#include <iostream>
+#include <istream>
+#include <string>
+
+//Run a test example for each OpCode type, as well as an invalid opcode.
+template <typename TParser>
+void runExampleMessages(TParser& parser) {
+    std::cout << "Running example Command Manager messages...\n\n";
+    parser.parse("RUN_NO____123#");
+    parser.parse("POLAR_NO__2#");
+    parser.parse("USR_MSG___Start Tunnel#");
+    parser.parse("D_USR_FLD_Parameter1,0.004947,Parameter2,0.203044,#");
+    parser.parse("RUN_NO____124#");
+    parser.parse("POLAR_NO__3#");
+    parser.parse("D_USR_FLD_Parameter3,0.02347,Parameter4,0.12343044,ParameterT,1.12345,#");
+    parser.parse("HISTORY___#");
+
+    //Test Unknown and failsafes
+    parser.parse("UNKNOWN___test#");
+    parser.parse("RUN_NO____ABC#");
+    parser.parse("RUN_NO____123");
+}
+
+//Allow user to test functionality by manually adding OpCode, one message per line until they enter EXIT or the input ends.
+template <typename TParser>
+void runInteractive(TParser& parser, std::istream& is = std::cin) {
+    std::cout << "Enter command messages (type EXIT to quit):\n";
+    std::string strUserInput;
+    while (std::getline(is, strUserInput)) {
+        if (strUserInput == "EXIT") {
+            break;
+        }
+        parser.parse(strUserInput);
+    }
+}
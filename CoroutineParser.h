@@ -0,0 +1,368 @@
+/*
+    Command Manager Coroutine Parser
+
+    Lets a C++20 coroutine pull typed results out of a byte stream, so the parser slots into a coroutine based event loop:
+
+        AsyncCommandParser<ChunkChannel> parser(channel);
+        while (std::optional<ParseResult> result = co_await parser.next()) {
+            ...
+        }
+
+    next() frames the stream with a MessageFramer, parses one message at a time and completes with the next result, or std::nullopt once the
+    source has ended. Reads come from the source, which is any type with read(char* pBuffer, std::size_t uSize) returning an awaitable that
+    completes with the byte count (0 at the end). As usual for awaitables, its await_ready() mustn't take anything when it returns false, as
+    next() may then drop it and read again from a coroutine.
+    Nothing here owns a thread or an executor: the coroutine is resumed by whatever completes the source's read, and parses and hands its
+    result back on that thread, so there is no hop between reading and parsing. While messages are already buffered, next() completes
+    without suspending at all.
+    Two sources come with it, ChunkChannel for a stream that something else reads (an event loop's completion handler pushes what it reads)
+    and FileReadSource for a file.
+
+    The rest of the project is C++17, so everything here is only compiled when the compiler supports coroutines (C++20), and this header is
+    empty otherwise. COMMANDMANAGER_HAS_COROUTINES is defined to 1 when it is compiled.
+*/
+
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define COMMANDMANAGER_HAS_COROUTINES 1
+#endif
+#endif
+
+#if defined(COMMANDMANAGER_HAS_COROUTINES)
+
+#include "CommandManager.h"
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+constexpr std::size_t kDefaultAsyncReadSize = 64 * 1024;
+
+//Keeps the memory of the last coroutine frame freed, so an object whose member coroutine is called for every message reuses one frame
+//rather than allocating each time. Frames of coroutines that aren't members of one are allocated as normal.
+//It must outlive the frames allocated from it.
+class CoroutineFrameCache {
+public:
+    CoroutineFrameCache() = default;
+    CoroutineFrameCache(const CoroutineFrameCache&) = delete;
+    CoroutineFrameCache& operator=(const CoroutineFrameCache&) = delete;
+    ~CoroutineFrameCache() { ::operator delete(m_pBlock); }
+
+    static void* allocate(CoroutineFrameCache* pCache, std::size_t uSize) {
+        std::size_t uTotal = sizeof(Header) + uSize;
+        Header* pHeader;
+        if (pCache != nullptr && pCache->m_pBlock != nullptr && pCache->m_pBlock->uSize >= uTotal) {
+            pHeader = pCache->m_pBlock;
+            pCache->m_pBlock = nullptr;
+        }
+        else {
+            pHeader = static_cast<Header*>(::operator new(uTotal));
+            pHeader->uSize = uTotal;
+        }
+        pHeader->pCache = pCache;
+        return pHeader + 1;
+    }
+
+    static void release(void* pFrame) noexcept {
+        Header* pHeader = static_cast<Header*>(pFrame) - 1;
+        CoroutineFrameCache* pCache = pHeader->pCache;
+        if (pCache != nullptr && pCache->m_pBlock == nullptr) {
+            pCache->m_pBlock = pHeader;
+            return;
+        }
+        ::operator delete(pHeader);
+    }
+
+private:
+    //Sized to the strictest fundamental alignment so the frame after it is aligned as operator new would align it.
+    struct alignas(alignof(std::max_align_t)) Header {
+        CoroutineFrameCache* pCache;
+        std::size_t uSize;
+    };
+
+    Header* m_pBlock = nullptr;
+};
+
+//A lazily started coroutine completing with a T. Awaiting it starts it, and when it finishes it resumes the awaiting coroutine directly.
+template <typename T>
+class [[nodiscard]] ParseTask {
+public:
+    class promise_type {
+    public:
+        ParseTask get_return_object() noexcept { return ParseTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        auto final_suspend() const noexcept { return FinalAwaiter(); }
+        void return_value(T value) { m_value.emplace(std::move(value)); }
+        //Nothing in the parser throws, so an exception escaping a task is a bug.
+        void unhandled_exception() const noexcept { std::terminate(); }
+
+        static void* operator new(std::size_t uSize) { return CoroutineFrameCache::allocate(nullptr, uSize); }
+        //A member coroutine's frame is allocated with its object as the first argument, which picks this when the object is a cache.
+        static void* operator new(std::size_t uSize, CoroutineFrameCache& cache) { return CoroutineFrameCache::allocate(&cache, uSize); }
+        static void operator delete(void* pFrame) noexcept { CoroutineFrameCache::release(pFrame); }
+
+    private:
+        friend class ParseTask;
+
+        struct FinalAwaiter {
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) const noexcept { return handle.promise().m_continuation; }
+            void await_resume() const noexcept {}
+        };
+
+        std::optional<T> m_value;
+        std::coroutine_handle<> m_continuation = std::noop_coroutine();
+    };
+
+    ParseTask(ParseTask&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    ParseTask& operator=(ParseTask&& other) noexcept {
+        if (this != &other) {
+            destroy();
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+    ParseTask(const ParseTask&) = delete;
+    ParseTask& operator=(const ParseTask&) = delete;
+    ~ParseTask() { destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        m_handle.promise().m_continuation = caller;
+        return m_handle;
+    }
+    T await_resume() { return std::move(*m_handle.promise().m_value); }
+
+private:
+    explicit ParseTask(std::coroutine_handle<promise_type> handle) noexcept : m_handle(handle) {}
+
+    void destroy() noexcept {
+        if (m_handle) {
+            m_handle.destroy();
+            m_handle = nullptr;
+        }
+    }
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+//A read that has already completed, for sources that never wait.
+struct CompletedRead {
+    std::size_t uBytes;
+
+    bool await_ready() const noexcept { return true; }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    std::size_t await_resume() const noexcept { return uBytes; }
+};
+
+//A source fed by whatever reads the stream, e.g. an event loop's read completion handler.
+//push() hands a chunk to a waiting reader and resumes it there and then, on the pushing thread, so parsing runs inside push() until the
+//reader needs more. Anything the reader didn't take is kept for its next read. close() ends the stream once what was pushed has been read.
+//Not thread safe: push, close and the reader must all run on the one thread (or strand).
+class ChunkChannel {
+public:
+    class ReadAwaiter {
+    public:
+        ReadAwaiter(ChunkChannel& channel, char* pBuffer, std::size_t uSize) : m_channel(channel), m_pBuffer(pBuffer), m_uSize(uSize) {}
+
+        bool await_ready() {
+            if (!m_channel.m_strPending.empty() || m_channel.m_bClosed) {
+                m_uBytes = m_channel.take(m_pBuffer, m_uSize);
+                return true;
+            }
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> reader) noexcept {
+            m_channel.m_pWaiting = this;
+            m_reader = reader;
+        }
+        std::size_t await_resume() const noexcept { return m_uBytes; }
+
+    private:
+        friend class ChunkChannel;
+
+        ChunkChannel& m_channel;
+        char* m_pBuffer;
+        std::size_t m_uSize;
+        std::size_t m_uBytes = 0;
+        std::coroutine_handle<> m_reader;
+    };
+
+    ChunkChannel() = default;
+    ChunkChannel(const ChunkChannel&) = delete;
+    ChunkChannel& operator=(const ChunkChannel&) = delete;
+
+    ReadAwaiter read(char* pBuffer, std::size_t uSize) { return ReadAwaiter(*this, pBuffer, uSize); }
+
+    void push(std::string_view svChunk) {
+        if (svChunk.empty() || m_bClosed) {
+            return;
+        }
+        ReadAwaiter* pWaiting = std::exchange(m_pWaiting, nullptr);
+        if (pWaiting == nullptr) {
+            m_strPending.append(svChunk.data(), svChunk.length());
+            return;
+        }
+        std::size_t uBytes = svChunk.length() < pWaiting->m_uSize ? svChunk.length() : pWaiting->m_uSize;
+        std::memcpy(pWaiting->m_pBuffer, svChunk.data(), uBytes);
+        //Keep the rest before resuming, as the reader reads again from inside resume().
+        m_strPending.append(svChunk.data() + uBytes, svChunk.length() - uBytes);
+        pWaiting->m_uBytes = uBytes;
+        pWaiting->m_reader.resume();
+    }
+
+    void close() {
+        m_bClosed = true;
+        ReadAwaiter* pWaiting = std::exchange(m_pWaiting, nullptr);
+        if (pWaiting != nullptr) {
+            pWaiting->m_uBytes = 0;
+            pWaiting->m_reader.resume();
+        }
+    }
+
+    bool waiting() const noexcept { return m_pWaiting != nullptr; }
+    bool closed() const noexcept { return m_bClosed; }
+
+private:
+    std::size_t take(char* pBuffer, std::size_t uSize) {
+        std::size_t uBytes = m_strPending.length() - m_uPendingOffset < uSize ? m_strPending.length() - m_uPendingOffset : uSize;
+        std::memcpy(pBuffer, m_strPending.data() + m_uPendingOffset, uBytes);
+        m_uPendingOffset += uBytes;
+        if (m_uPendingOffset == m_strPending.length()) {
+            m_strPending.clear();
+            m_uPendingOffset = 0;
+        }
+        return uBytes;
+    }
+
+    std::string m_strPending;
+    std::size_t m_uPendingOffset = 0;
+    ReadAwaiter* m_pWaiting = nullptr;
+    bool m_bClosed = false;
+};
+
+//A source reading an open file. File reads don't wait on readiness, so they complete immediately and the parser runs straight through the file.
+//The file isn't owned, and is left open at the end.
+class FileReadSource {
+public:
+    explicit FileReadSource(std::FILE* pFile) : m_pFile(pFile) {}
+
+    CompletedRead read(char* pBuffer, std::size_t uSize) { return CompletedRead{ std::fread(pBuffer, 1, uSize, m_pFile) }; }
+
+    bool failed() const { return std::ferror(m_pFile) != 0; }
+
+private:
+    std::FILE* m_pFile;
+};
+
+//Parses a source's stream message by message on behalf of a coroutine. A message the parser reports nothing for (e.g. one a handler took)
+//is skipped rather than completing next(). One next() may be in flight at a time, and the views in a result are valid until next() is called again.
+//The parser is exposed for registering handlers, validation and the like, and parse() shouldn't be called on it directly.
+template <typename TSource, typename TExtension>
+class BasicAsyncCommandParser : public CoroutineFrameCache, private ResultSink {
+public:
+    //Completes with the next result. Messages already read, and reads the source completes immediately, are parsed inside await_ready,
+    //so the awaiting coroutine only suspends when a read has to wait, and then a coroutine is started that reads until there is a result.
+    class NextAwaiter {
+    public:
+        explicit NextAwaiter(BasicAsyncCommandParser& owner) : m_owner(owner) {}
+
+        bool await_ready() {
+            while (!m_owner.parseBuffered()) {
+                auto read = m_owner.m_source.read(m_owner.m_vecBuffer.data(), m_owner.m_vecBuffer.size());
+                if (!read.await_ready()) {
+                    return false;
+                }
+                m_owner.accept(read.await_resume());
+            }
+            return true;
+        }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+            m_task.emplace(m_owner.refill());
+            return m_task->await_suspend(caller);
+        }
+        std::optional<ParseResult> await_resume() { return m_task ? m_task->await_resume() : m_owner.take(); }
+
+    private:
+        BasicAsyncCommandParser& m_owner;
+        std::optional<ParseTask<std::optional<ParseResult>>> m_task;
+    };
+
+    explicit BasicAsyncCommandParser(TSource& source, std::size_t uReadSize = kDefaultAsyncReadSize, TExtension extension = TExtension())
+        : m_source(source), m_parser(*this, std::move(extension)), m_vecBuffer(uReadSize > 0 ? uReadSize : 1) {}
+
+    //The next result, or std::nullopt once the source has ended. A partial message left at the end is dropped.
+    NextAwaiter next() { return NextAwaiter(*this); }
+
+    BasicCommandParser<TExtension>& parser() { return m_parser; }
+    const BasicCommandParser<TExtension>& parser() const { return m_parser; }
+    bool ended() const { return m_bEnded; }
+
+private:
+    void onResult(const ParseResult& result) override {
+        m_result = result;
+        m_bHaveResult = true;
+    }
+
+    //Parse what has been read until a message gives a result. Returns false if the source has to be read first.
+    bool parseBuffered() {
+        std::string_view svMessage;
+        while (m_framer.next(m_svChunk, svMessage)) {
+            m_bHaveResult = false;
+            m_parser.parse(svMessage);
+            if (m_bHaveResult) {
+                return true;
+            }
+        }
+        return m_bEnded;
+    }
+
+    void accept(std::size_t uBytes) {
+        if (uBytes == 0) {
+            m_bEnded = true;
+        }
+        else {
+            m_svChunk = std::string_view(m_vecBuffer.data(), uBytes);
+        }
+    }
+
+    std::optional<ParseResult> take() {
+        if (!m_bHaveResult) {
+            return std::nullopt;
+        }
+        m_bHaveResult = false;
+        return m_result;
+    }
+
+    ParseTask<std::optional<ParseResult>> refill() {
+        do {
+            accept(co_await m_source.read(m_vecBuffer.data(), m_vecBuffer.size()));
+        } while (!parseBuffered());
+        co_return take();
+    }
+
+    TSource& m_source;
+    BasicCommandParser<TExtension> m_parser;
+    MessageFramer m_framer;
+    std::vector<char> m_vecBuffer;
+    std::string_view m_svChunk;
+    ParseResult m_result;
+    bool m_bHaveResult = false;
+    bool m_bEnded = false;
+};
+
+template <typename TSource>
+using AsyncCommandParser = BasicAsyncCommandParser<TSource, HandlerRegistry>;
+
+#endif
@@ -0,0 +1,203 @@
+/*
+    Delimiter scanning for Command Manager messages.
+
+    Finds every occurrence of a delimiter (the comma between D_USR_FLD_ names and values) 16 or 32 bytes at a time:
+    - AVX2 when the compiler targets it (-mavx2 or /arch:AVX2, see COMMANDMANAGER_ENABLE_AVX2 in CMakeLists.txt).
+    - SSE2 otherwise on x86 and x64, where it is always available.
+    - A scalar loop on other targets, and for the tail of a buffer too short for a full vector.
+    Each block of bytes is compared against the delimiter at once, and the resulting bit mask is walked to report positions in order.
+    The same blocks count tokens and find control characters for the parser's validation mode, without visiting bytes one by one.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__AVX2__)
+#define COMMANDMANAGER_SCAN_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COMMANDMANAGER_SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+//Index of the lowest set bit, uMask must not be zero.
+inline unsigned countTrailingZeros(std::uint32_t uMask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long uIndex = 0;
+    _BitScanForward(&uIndex, uMask);
+    return static_cast<unsigned>(uIndex);
+#else
+    return static_cast<unsigned>(__builtin_ctz(uMask));
+#endif
+}
+
+//Name of the scanner compiled in, for benchmark and diagnostic output.
+constexpr const char* kDelimiterScanner =
+#if defined(COMMANDMANAGER_SCAN_AVX2)
+    "AVX2";
+#elif defined(COMMANDMANAGER_SCAN_SSE2)
+    "SSE2";
+#else
+    "scalar";
+#endif
+
+//Call callback(uPosition) for every chDelimiter in svText, in order, one byte at a time.
+template <typename TCallback>
+void scanDelimitersScalar(std::string_view svText, char chDelimiter, TCallback&& callback, std::size_t uFrom = 0) {
+    for (std::size_t i = uFrom; i < svText.length(); i++) {
+        if (svText[i] == chDelimiter) {
+            callback(i);
+        }
+    }
+}
+
+//Call callback(uPosition) for every chDelimiter in svText, in order, using the widest vector compare available.
+template <typename TCallback>
+void scanDelimiters(std::string_view svText, char chDelimiter, TCallback&& callback) {
+    const char* pText = svText.data();
+    std::size_t uLength = svText.length();
+    std::size_t uOffset = 0;
+#if defined(COMMANDMANAGER_SCAN_AVX2)
+    const __m256i vecDelimiter = _mm256_set1_epi8(chDelimiter);
+    for (; uOffset + 32 <= uLength; uOffset += 32) {
+        __m256i vecBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pText + uOffset));
+        std::uint32_t uMask = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(vecBlock, vecDelimiter)));
+        //Report each match and clear its bit.
+        while (uMask != 0) {
+            callback(uOffset + countTrailingZeros(uMask));
+            uMask &= uMask - 1;
+        }
+    }
+#endif
+#if defined(COMMANDMANAGER_SCAN_AVX2) || defined(COMMANDMANAGER_SCAN_SSE2)
+    const __m128i vecDelimiter16 = _mm_set1_epi8(chDelimiter);
+    for (; uOffset + 16 <= uLength; uOffset += 16) {
+        __m128i vecBlock = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pText + uOffset));
+        std::uint32_t uMask = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(vecBlock, vecDelimiter16)));
+        while (uMask != 0) {
+            callback(uOffset + countTrailingZeros(uMask));
+            uMask &= uMask - 1;
+        }
+    }
+#endif
+    //Whatever is left is shorter than a vector.
+    scanDelimitersScalar(svText, chDelimiter, callback, uOffset);
+}
+
+//Position of the first chDelimiter in svText at or after uFrom, or npos if there is none. Meant for short spans, e.g. one value,
+//so it uses 16 byte blocks only: a wider block would mostly be bytes past the delimiter.
+inline std::size_t findDelimiter(std::string_view svText, char chDelimiter, std::size_t uFrom = 0) {
+    const char* pText = svText.data();
+    std::size_t uLength = svText.length();
+    std::size_t uOffset = uFrom;
+#if defined(COMMANDMANAGER_SCAN_AVX2) || defined(COMMANDMANAGER_SCAN_SSE2)
+    const __m128i vecDelimiter16 = _mm_set1_epi8(chDelimiter);
+    for (; uOffset + 16 <= uLength; uOffset += 16) {
+        __m128i vecBlock = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pText + uOffset));
+        std::uint32_t uMask = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(vecBlock, vecDelimiter16)));
+        if (uMask != 0) {
+            return uOffset + countTrailingZeros(uMask);
+        }
+    }
+#endif
+    for (; uOffset < uLength; uOffset++) {
+        if (pText[uOffset] == chDelimiter) {
+            return uOffset;
+        }
+    }
+    return std::string_view::npos;
+}
+
+//Number of set bits, counted in registers as MSVC's __popcnt needs a processor check on older CPUs.
+inline unsigned countSetBits(std::uint32_t uMask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    uMask = uMask - ((uMask >> 1) & 0x55555555u);
+    uMask = (uMask & 0x33333333u) + ((uMask >> 2) & 0x33333333u);
+    return static_cast<unsigned>((((uMask + (uMask >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+#else
+    return static_cast<unsigned>(__builtin_popcount(uMask));
+#endif
+}
+
+//Number of non-empty tokens between chDelimiter in svText, the tokens tokenizeParameters would take, counted without visiting them.
+//A token starts at every byte that isn't a delimiter but follows one (or the start of the text), so a block's token starts are one mask expression.
+inline std::size_t countTokens(std::string_view svText, char chDelimiter) {
+    const char* pText = svText.data();
+    std::size_t uLength = svText.length();
+    std::size_t uOffset = 0;
+    std::size_t uTokens = 0;
+    //Whether the byte before the current block was a delimiter, the start of the text counts as one.
+    std::uint32_t uPreviousDelimiter = 1;
+#if defined(COMMANDMANAGER_SCAN_AVX2)
+    const __m256i vecDelimiter = _mm256_set1_epi8(chDelimiter);
+    for (; uOffset + 32 <= uLength; uOffset += 32) {
+        __m256i vecBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pText + uOffset));
+        std::uint32_t uMask = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(vecBlock, vecDelimiter)));
+        uTokens += countSetBits(~uMask & ((uMask << 1) | uPreviousDelimiter));
+        uPreviousDelimiter = uMask >> 31;
+    }
+#endif
+#if defined(COMMANDMANAGER_SCAN_AVX2) || defined(COMMANDMANAGER_SCAN_SSE2)
+    const __m128i vecDelimiter16 = _mm_set1_epi8(chDelimiter);
+    for (; uOffset + 16 <= uLength; uOffset += 16) {
+        __m128i vecBlock = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pText + uOffset));
+        std::uint32_t uMask = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(vecBlock, vecDelimiter16)));
+        uTokens += countSetBits(~uMask & ((uMask << 1) | uPreviousDelimiter) & 0xFFFFu);
+        uPreviousDelimiter = (uMask >> 15) & 1u;
+    }
+#endif
+    //Whatever is left is shorter than a vector.
+    for (; uOffset < uLength; uOffset++) {
+        std::uint32_t uDelimiter = pText[uOffset] == chDelimiter ? 1u : 0u;
+        uTokens += ~uDelimiter & uPreviousDelimiter & 1u;
+        uPreviousDelimiter = uDelimiter;
+    }
+    return uTokens;
+}
+
+//Position of the first control character (below 0x20, or DEL) in svText, or npos if there are none. Bytes from 0x80 up are UTF-8 and allowed.
+inline std::size_t findControlCharacter(std::string_view svText) {
+    const char* pText = svText.data();
+    std::size_t uLength = svText.length();
+    std::size_t uOffset = 0;
+#if defined(COMMANDMANAGER_SCAN_AVX2)
+    const __m256i vecLastControl = _mm256_set1_epi8(0x1F);
+    const __m256i vecDelete = _mm256_set1_epi8(0x7F);
+    for (; uOffset + 32 <= uLength; uOffset += 32) {
+        __m256i vecBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pText + uOffset));
+        //A byte is at most 0x1F exactly when the unsigned maximum of it and 0x1F is 0x1F.
+        __m256i vecControl = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(vecBlock, vecLastControl), vecLastControl), _mm256_cmpeq_epi8(vecBlock, vecDelete));
+        std::uint32_t uMask = static_cast<std::uint32_t>(_mm256_movemask_epi8(vecControl));
+        if (uMask != 0) {
+            return uOffset + countTrailingZeros(uMask);
+        }
+    }
+#endif
+#if defined(COMMANDMANAGER_SCAN_AVX2) || defined(COMMANDMANAGER_SCAN_SSE2)
+    const __m128i vecLastControl16 = _mm_set1_epi8(0x1F);
+    const __m128i vecDelete16 = _mm_set1_epi8(0x7F);
+    for (; uOffset + 16 <= uLength; uOffset += 16) {
+        __m128i vecBlock = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pText + uOffset));
+        __m128i vecControl = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(vecBlock, vecLastControl16), vecLastControl16), _mm_cmpeq_epi8(vecBlock, vecDelete16));
+        std::uint32_t uMask = static_cast<std::uint32_t>(_mm_movemask_epi8(vecControl));
+        if (uMask != 0) {
+            return uOffset + countTrailingZeros(uMask);
+        }
+    }
+#endif
+    for (; uOffset < uLength; uOffset++) {
+        unsigned char uByte = static_cast<unsigned char>(pText[uOffset]);
+        if (uByte < 0x20 || uByte == 0x7F) {
+            return uOffset;
+        }
+    }
+    return std::string_view::npos;
+}
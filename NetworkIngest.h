@@ -0,0 +1,553 @@
+/*
+    Command Manager Network Ingest
+
+    Serves several subsystem controllers from one thread: a single event loop accepts TCP connections and reads TCP streams and UDP datagrams
+    without a thread per connection. Reads go into one reused buffer. Each TCP connection is framed by its own MessageFramer, as a stream can
+    split a message anywhere, while UDP datagrams are framed in place and always end a message.
+
+    Messages are parsed per source. Each source has its own parser and so its own history and run context. By default a source is one peer address,
+    protocol, host and port, so every TCP connection is a source of its own, even alongside another from the same host, and is dropped when it closes.
+    With SourceGrouping::Host everything from a host shares one source instead, and a controller that reconnects carries on with the history it had.
+    Results go to the server's sink, or to a sink set per source, and currentSource() tells a shared sink which source a result came from.
+
+    Readiness is waited for with epoll on Linux and poll (WSAPoll on Windows) elsewhere. Sockets are non-blocking, every ready socket gets one read
+    per loop iteration, and so a busy controller can't starve the others.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#endif
+
+#if defined(_WIN32)
+using SocketHandle = SOCKET;
+constexpr SocketHandle kInvalidSocket = INVALID_SOCKET;
+#else
+using SocketHandle = int;
+constexpr SocketHandle kInvalidSocket = -1;
+#endif
+
+//Size of the buffer every socket is read into. A UDP datagram longer than this is truncated.
+constexpr std::size_t kIngestReadBufferSize = 64 * 1024;
+
+//Longest wait in run() before checking whether stop() was called.
+constexpr int kIngestStopCheckMilliseconds = 100;
+
+//Thin portability layer over the socket calls the server uses.
+namespace IngestSocket {
+    inline void close(SocketHandle hSocket) {
+#if defined(_WIN32)
+        closesocket(hSocket);
+#else
+        ::close(hSocket);
+#endif
+    }
+
+    inline bool setNonBlocking(SocketHandle hSocket) {
+#if defined(_WIN32)
+        u_long uNonBlocking = 1;
+        return ioctlsocket(hSocket, FIONBIO, &uNonBlocking) == 0;
+#else
+        int iFlags = fcntl(hSocket, F_GETFL, 0);
+        return iFlags >= 0 && fcntl(hSocket, F_SETFL, iFlags | O_NONBLOCK) == 0;
+#endif
+    }
+
+    //True if the last call failed only because it would have blocked, or was interrupted.
+    inline bool wouldBlock() {
+#if defined(_WIN32)
+        int iError = WSAGetLastError();
+        return iError == WSAEWOULDBLOCK || iError == WSAEINTR;
+#else
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+    }
+
+    //Numeric host of an address.
+    inline std::string hostOf(const sockaddr_storage& address, socklen_t uLength) {
+        char szHost[NI_MAXHOST] = {};
+        if (getnameinfo(reinterpret_cast<const sockaddr*>(&address), uLength, szHost, sizeof(szHost), nullptr, 0, NI_NUMERICHOST) != 0) {
+            return "unknown";
+        }
+        return szHost;
+    }
+
+    //Port of an address.
+    inline std::uint16_t portOf(const sockaddr_storage& address) {
+        if (address.ss_family == AF_INET6) {
+            return ntohs(reinterpret_cast<const sockaddr_in6*>(&address)->sin6_port);
+        }
+        return ntohs(reinterpret_cast<const sockaddr_in*>(&address)->sin_port);
+    }
+
+    //Port a socket is bound to, e.g. after binding port 0.
+    inline std::uint16_t localPort(SocketHandle hSocket) {
+        sockaddr_storage address{};
+        socklen_t uLength = sizeof(address);
+        if (getsockname(hSocket, reinterpret_cast<sockaddr*>(&address), &uLength) != 0) {
+            return 0;
+        }
+        return portOf(address);
+    }
+}
+
+//What makes messages come from the same source, and so share a parser and history.
+enum class SourceGrouping : std::uint8_t {
+    //Protocol, host and port, e.g. "tcp://10.0.0.5:40112": each TCP connection, and each UDP sending socket, is its own source.
+    PeerAddress,
+    //Host only, e.g. "10.0.0.5": every connection and datagram from a host shares one source, which outlives its connections.
+    Host
+};
+
+//One controller sending to the server, with its own parser and history.
+template <typename TExtension>
+class BasicIngestSource {
+public:
+    BasicIngestSource(std::uint32_t uId, std::string strAddress, std::string strHost, ResultSink& sink)
+        : m_uId(uId), m_strAddress(std::move(strAddress)), m_strHost(std::move(strHost)), m_parser(sink) {}
+
+    std::uint32_t id() const {
+        return m_uId;
+    }
+
+    //Key of the source, as findSource() takes it: the peer address, or the host with SourceGrouping::Host.
+    const std::string& address() const {
+        return m_strAddress;
+    }
+
+    //Numeric address of the controller's host.
+    const std::string& host() const {
+        return m_strHost;
+    }
+
+    //The source's parser, e.g. to register handlers or set a sink or history listener when the source is created.
+    BasicCommandParser<TExtension>& parser() {
+        return m_parser;
+    }
+
+    const BasicCommandParser<TExtension>& parser() const {
+        return m_parser;
+    }
+
+    std::uint64_t messages() const {
+        return m_uMessages;
+    }
+
+    std::uint64_t bytes() const {
+        return m_uBytes;
+    }
+
+private:
+    template <typename>
+    friend class BasicIngestServer;
+
+    const std::uint32_t m_uId;
+    const std::string m_strAddress;
+    const std::string m_strHost;
+    BasicCommandParser<TExtension> m_parser;
+    std::uint64_t m_uMessages = 0;
+    std::uint64_t m_uBytes = 0;
+};
+
+//Event loop reading Command Manager messages from TCP and UDP sockets. Everything but stop() must be called from the thread running the loop.
+template <typename TExtension>
+class BasicIngestServer {
+public:
+    using Source = BasicIngestSource<TExtension>;
+
+    explicit BasicIngestServer(ResultSink& sink) : m_pSink(&sink), m_vecBuffer(kIngestReadBufferSize) {
+#if defined(_WIN32)
+        WSADATA wsaData;
+        m_bStarted = WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+#endif
+#if defined(__linux__)
+        m_hPoller = epoll_create1(0);
+#endif
+    }
+
+    BasicIngestServer(const BasicIngestServer&) = delete;
+    BasicIngestServer& operator=(const BasicIngestServer&) = delete;
+
+    ~BasicIngestServer() {
+        for (const auto& entry : m_mapEndpoints) {
+            IngestSocket::close(entry.first);
+        }
+#if defined(__linux__)
+        if (m_hPoller >= 0) {
+            ::close(m_hPoller);
+        }
+#endif
+#if defined(_WIN32)
+        if (m_bStarted) {
+            WSACleanup();
+        }
+#endif
+    }
+
+    //Called with every new source before its first message, e.g. to register its handlers.
+    void setSourceSetup(std::function<void(Source&)> fnSetup) {
+        m_fnSetup = std::move(fnSetup);
+    }
+
+    //Choose what counts as one source, SourceGrouping::PeerAddress by default. Set it before the first source arrives.
+    void setSourceGrouping(SourceGrouping eGrouping) {
+        m_eGrouping = eGrouping;
+    }
+
+    //Accept TCP connections on a port, 0 for any free port (see port()). Returns false and sets strError if the socket can't be set up.
+    bool listenTcp(std::uint16_t uPort, std::string& strError, const std::string& strAddress = "0.0.0.0") {
+        SocketHandle hSocket = openSocket(strAddress, uPort, SOCK_STREAM, strError);
+        if (hSocket == kInvalidSocket) {
+            return false;
+        }
+        if (listen(hSocket, SOMAXCONN) != 0) {
+            IngestSocket::close(hSocket);
+            strError = "Can't listen on port " + std::to_string(uPort);
+            return false;
+        }
+        return addEndpoint(hSocket, EndpointKind::Listener, strError);
+    }
+
+    //Receive UDP datagrams on a port, 0 for any free port. Returns false and sets strError if the socket can't be set up.
+    bool bindUdp(std::uint16_t uPort, std::string& strError, const std::string& strAddress = "0.0.0.0") {
+        SocketHandle hSocket = openSocket(strAddress, uPort, SOCK_DGRAM, strError);
+        if (hSocket == kInvalidSocket) {
+            return false;
+        }
+        return addEndpoint(hSocket, EndpointKind::Datagram, strError);
+    }
+
+    //Port of the most recently opened TCP or UDP socket.
+    std::uint16_t port() const {
+        return m_uLastPort;
+    }
+
+    //Wait up to iTimeoutMilliseconds (-1 for no limit) for sockets to become ready and handle them. Returns false if waiting fails.
+    bool poll(int iTimeoutMilliseconds) {
+        m_vecReady.clear();
+#if defined(__linux__)
+        epoll_event arrEvents[64];
+        int iReady = epoll_wait(m_hPoller, arrEvents, 64, iTimeoutMilliseconds);
+        if (iReady < 0) {
+            return errno == EINTR;
+        }
+        for (int i = 0; i < iReady; i++) {
+            m_vecReady.push_back(arrEvents[i].data.fd);
+        }
+#else
+        if (m_bPollSetChanged) {
+            m_vecPollSet.clear();
+            for (const auto& entry : m_mapEndpoints) {
+                pollfd descriptor{};
+                descriptor.fd = entry.first;
+                descriptor.events = POLLIN;
+                m_vecPollSet.push_back(descriptor);
+            }
+            m_bPollSetChanged = false;
+        }
+#if defined(_WIN32)
+        int iReady = WSAPoll(m_vecPollSet.data(), static_cast<ULONG>(m_vecPollSet.size()), iTimeoutMilliseconds);
+#else
+        int iReady = ::poll(m_vecPollSet.data(), static_cast<nfds_t>(m_vecPollSet.size()), iTimeoutMilliseconds);
+#endif
+        if (iReady < 0) {
+            return IngestSocket::wouldBlock();
+        }
+        for (const pollfd& descriptor : m_vecPollSet) {
+            if (descriptor.revents != 0) {
+                m_vecReady.push_back(descriptor.fd);
+            }
+        }
+#endif
+        //A socket closed while handling an earlier one is no longer in the map and is skipped.
+        for (SocketHandle hSocket : m_vecReady) {
+            auto it = m_mapEndpoints.find(hSocket);
+            if (it == m_mapEndpoints.end()) {
+                continue;
+            }
+            switch (it->second.eKind) {
+            case EndpointKind::Listener:
+                acceptConnections(hSocket);
+                break;
+            case EndpointKind::Connection:
+                readConnection(hSocket, it->second);
+                break;
+            case EndpointKind::Datagram:
+                readDatagram(hSocket);
+                break;
+            }
+        }
+        return true;
+    }
+
+    //Run the loop until stop() is called. Returns false if waiting fails.
+    bool run() {
+        while (!m_bStopping.load(std::memory_order_acquire)) {
+            if (!poll(kIngestStopCheckMilliseconds)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //Ask run() to return. Safe from any thread, e.g. a signal handler's.
+    void stop() {
+        m_bStopping.store(true, std::memory_order_release);
+    }
+
+    //The source whose message is being parsed, nullptr outside the loop's parsing. Lets a sink shared by every source tell them apart.
+    const Source* currentSource() const {
+        return m_pCurrentSource;
+    }
+
+    //Source for an address as Source::address() gives it, nullptr if nothing has arrived from it yet or its connection has closed.
+    Source* findSource(const std::string& strAddress) {
+        auto it = m_mapSources.find(strAddress);
+        return it == m_mapSources.end() ? nullptr : it->second.get();
+    }
+
+    //Number of sources held now.
+    std::size_t sourceCount() const {
+        return m_mapSources.size();
+    }
+
+    //Number of sources created since the server started, including those dropped when their connection closed.
+    std::size_t sourcesSeen() const {
+        return m_uNextSourceId;
+    }
+
+    //Number of open TCP connections.
+    std::size_t connectionCount() const {
+        return m_uConnections;
+    }
+
+private:
+    enum class EndpointKind : std::uint8_t {
+        Listener,
+        Connection,
+        Datagram
+    };
+
+    struct Endpoint {
+        EndpointKind eKind = EndpointKind::Listener;
+        Source* pSource = nullptr;
+        //Only connections frame, datagrams always end on a message boundary.
+        std::unique_ptr<MessageFramer> pFramer;
+    };
+
+    //Create and bind a non-blocking socket.
+    SocketHandle openSocket(const std::string& strAddress, std::uint16_t uPort, int iType, std::string& strError) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = iType;
+        hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+        addrinfo* pAddresses = nullptr;
+        std::string strPort = std::to_string(uPort);
+        if (getaddrinfo(strAddress.c_str(), strPort.c_str(), &hints, &pAddresses) != 0 || pAddresses == nullptr) {
+            strError = "Invalid address " + strAddress;
+            return kInvalidSocket;
+        }
+        SocketHandle hSocket = socket(pAddresses->ai_family, pAddresses->ai_socktype, pAddresses->ai_protocol);
+        if (hSocket == kInvalidSocket) {
+            freeaddrinfo(pAddresses);
+            strError = "Can't create a socket";
+            return kInvalidSocket;
+        }
+        //Let the server restart straight away rather than wait for old connections to time out.
+        int iReuse = 1;
+        setsockopt(hSocket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&iReuse), sizeof(iReuse));
+        bool bBound = bind(hSocket, pAddresses->ai_addr, static_cast<socklen_t>(pAddresses->ai_addrlen)) == 0;
+        freeaddrinfo(pAddresses);
+        if (!bBound || !IngestSocket::setNonBlocking(hSocket)) {
+            IngestSocket::close(hSocket);
+            strError = "Can't bind " + strAddress + ":" + strPort;
+            return kInvalidSocket;
+        }
+        m_uLastPort = IngestSocket::localPort(hSocket);
+        return hSocket;
+    }
+
+    bool addEndpoint(SocketHandle hSocket, EndpointKind eKind, std::string& strError, Source* pSource = nullptr) {
+#if defined(__linux__)
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = hSocket;
+        if (epoll_ctl(m_hPoller, EPOLL_CTL_ADD, hSocket, &event) != 0) {
+            IngestSocket::close(hSocket);
+            strError = "Can't watch the socket";
+            return false;
+        }
+#else
+        m_bPollSetChanged = true;
+#endif
+        static_cast<void>(strError);
+        Endpoint& endpoint = m_mapEndpoints[hSocket];
+        endpoint.eKind = eKind;
+        endpoint.pSource = pSource;
+        if (eKind == EndpointKind::Connection) {
+            endpoint.pFramer = std::make_unique<MessageFramer>();
+            m_uConnections++;
+        }
+        return true;
+    }
+
+    void closeEndpoint(SocketHandle hSocket) {
+#if defined(__linux__)
+        epoll_ctl(m_hPoller, EPOLL_CTL_DEL, hSocket, nullptr);
+#else
+        m_bPollSetChanged = true;
+#endif
+        auto it = m_mapEndpoints.find(hSocket);
+        if (it != m_mapEndpoints.end() && it->second.eKind == EndpointKind::Connection) {
+            m_uConnections--;
+            //A connection's own source goes with it, the next connection from that port is a new controller.
+            if (m_eGrouping == SourceGrouping::PeerAddress) {
+                m_mapSources.erase(it->second.pSource->address());
+            }
+        }
+        m_mapEndpoints.erase(hSocket);
+        IngestSocket::close(hSocket);
+    }
+
+    //The source for a peer, created on its first message or connection. szProtocol is "tcp" or "udp".
+    Source& sourceFor(const char* szProtocol, const sockaddr_storage& address, socklen_t uLength) {
+        std::string strHost = IngestSocket::hostOf(address, uLength);
+        std::string strAddress = strHost;
+        if (m_eGrouping == SourceGrouping::PeerAddress) {
+            bool bIPv6 = address.ss_family == AF_INET6;
+            strAddress = std::string(szProtocol) + "://" + (bIPv6 ? "[" + strHost + "]" : strHost) + ":" + std::to_string(IngestSocket::portOf(address));
+        }
+        std::unique_ptr<Source>& pSource = m_mapSources[strAddress];
+        if (!pSource) {
+            pSource = std::make_unique<Source>(m_uNextSourceId++, std::move(strAddress), std::move(strHost), *m_pSink);
+            if (m_fnSetup) {
+                m_fnSetup(*pSource);
+            }
+        }
+        return *pSource;
+    }
+
+    void acceptConnections(SocketHandle hListener) {
+        while (true) {
+            sockaddr_storage address{};
+            socklen_t uLength = sizeof(address);
+            SocketHandle hSocket = accept(hListener, reinterpret_cast<sockaddr*>(&address), &uLength);
+            if (hSocket == kInvalidSocket) {
+                return;
+            }
+            std::string strError;
+            if (!IngestSocket::setNonBlocking(hSocket)) {
+                IngestSocket::close(hSocket);
+                continue;
+            }
+            Source& source = sourceFor("tcp", address, uLength);
+            if (!addEndpoint(hSocket, EndpointKind::Connection, strError, &source) && m_eGrouping == SourceGrouping::PeerAddress) {
+                m_mapSources.erase(source.address());
+            }
+        }
+    }
+
+    void readConnection(SocketHandle hSocket, Endpoint& endpoint) {
+        int iRead = static_cast<int>(recv(hSocket, m_vecBuffer.data(), static_cast<int>(m_vecBuffer.size()), 0));
+        if (iRead < 0 && IngestSocket::wouldBlock()) {
+            return;
+        }
+        //Closed by the controller or failed. A partial message left in the framer is dropped with it.
+        if (iRead <= 0) {
+            closeEndpoint(hSocket);
+            return;
+        }
+        Source& source = *endpoint.pSource;
+        source.m_uBytes += static_cast<std::uint64_t>(iRead);
+        m_pCurrentSource = &source;
+        endpoint.pFramer->feed(std::string_view(m_vecBuffer.data(), static_cast<std::size_t>(iRead)), [&source](std::string_view svMessage) {
+            source.m_parser.parse(svMessage);
+            source.m_uMessages++;
+        });
+        m_pCurrentSource = nullptr;
+    }
+
+    void readDatagram(SocketHandle hSocket) {
+        sockaddr_storage address{};
+        socklen_t uLength = sizeof(address);
+        int iRead = static_cast<int>(recvfrom(hSocket, m_vecBuffer.data(), static_cast<int>(m_vecBuffer.size()), 0, reinterpret_cast<sockaddr*>(&address), &uLength));
+        if (iRead <= 0) {
+            return;
+        }
+        Source& source = sourceFor("udp", address, uLength);
+        source.m_uBytes += static_cast<std::uint64_t>(iRead);
+        m_pCurrentSource = &source;
+        std::string_view svRemainder = MessageFramer::frameBuffer(std::string_view(m_vecBuffer.data(), static_cast<std::size_t>(iRead)), [&source](std::string_view svMessage) {
+            source.m_parser.parse(svMessage);
+            source.m_uMessages++;
+        });
+        //The datagram ends whatever is left, which is parsed (and rejected) like unterminated input rather than held for the next datagram.
+        if (!svRemainder.empty()) {
+            source.m_parser.parse(svRemainder);
+            source.m_uMessages++;
+        }
+        m_pCurrentSource = nullptr;
+    }
+
+    ResultSink* m_pSink;
+    std::function<void(Source&)> m_fnSetup;
+    SourceGrouping m_eGrouping = SourceGrouping::PeerAddress;
+    std::unordered_map<std::string, std::unique_ptr<Source>> m_mapSources;
+    std::uint32_t m_uNextSourceId = 0;
+    std::unordered_map<SocketHandle, Endpoint> m_mapEndpoints;
+    //Read buffer shared by every socket, as each read is parsed before the next.
+    std::vector<char> m_vecBuffer;
+    std::vector<SocketHandle> m_vecReady;
+    const Source* m_pCurrentSource = nullptr;
+    std::size_t m_uConnections = 0;
+    std::uint16_t m_uLastPort = 0;
+    std::atomic<bool> m_bStopping{ false };
+#if defined(__linux__)
+    int m_hPoller = -1;
+#else
+    std::vector<pollfd> m_vecPollSet;
+    bool m_bPollSetChanged = false;
+#endif
+#if defined(_WIN32)
+    bool m_bStarted = false;
+#endif
+};
+
+//Ingest server whose sources register site-specific opcodes at runtime.
+using IngestServer = BasicIngestServer<HandlerRegistry>;
+using IngestSource = BasicIngestSource<HandlerRegistry>;
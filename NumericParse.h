@@ -0,0 +1,149 @@
+/*
+    Numeric field parsing for Command Manager messages.
+
+    Run numbers, polar numbers and D_USR_FLD_ parameter values are parsed with std::from_chars,
+    which doesn't allocate, doesn't depend on the locale and reports failure as an error code rather than an exception.
+    The accepted input matches std::stoi / std::stod (as the parser originally used), so the same messages are accepted and rejected:
+    - Leading whitespace is skipped and a leading + or - sign is allowed.
+    - Anything after the number is ignored, e.g. "12abc" parses as 12.
+    - Values that don't fit are out of range, including doubles that lose precision by underflowing to a subnormal.
+      A hexadecimal subnormal that is exactly representable, e.g. "0x1p-1074", is accepted as strtod accepts it.
+    - A hexadecimal exponent with two signs, e.g. "0x1p+-3", ends the number before the p, as in strtod.
+    Where this differs from glibc's strtod, for input no real sender writes:
+    - A decimal value below DBL_MIN is always taken as inexact, so the exact decimal expansion of a subnormal (hundreds of digits) is rejected.
+    - A decimal value just below DBL_MIN that rounds up to it is accepted, where strtod may still report it as underflowing.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cfloat>
+#include <charconv>
+#include <cmath>
+#include <string_view>
+#include <system_error>
+
+//Skip leading whitespace the way strtol/strtod do in the "C" locale.
+inline std::string_view skipLeadingSpace(std::string_view svText) {
+    std::size_t uStart = 0;
+    while (uStart < svText.length() && (svText[uStart] == ' ' || (svText[uStart] >= '\t' && svText[uStart] <= '\r'))) {
+        uStart++;
+    }
+    return svText.substr(uStart);
+}
+
+//std::from_chars only accepts a leading -, so strip a leading + first. Returns false for a + followed by another sign, which isn't a number.
+inline bool stripPlusSign(std::string_view& svText) {
+    if (!svText.empty() && svText.front() == '+') {
+        svText.remove_prefix(1);
+        return svText.empty() || (svText.front() != '+' && svText.front() != '-');
+    }
+    return true;
+}
+
+//Parse an int from the start of svText. Returns std::errc() on success, std::errc::invalid_argument if there is no number,
+//or std::errc::result_out_of_range if it doesn't fit in an int. iValue is only written on success.
+inline std::errc parseInt(std::string_view svText, int& iValue) {
+    svText = skipLeadingSpace(svText);
+    if (!stripPlusSign(svText)) {
+        return std::errc::invalid_argument;
+    }
+    return std::from_chars(svText.data(), svText.data() + svText.length(), iValue).ec;
+}
+
+//Whether svHex, the part of a hexadecimal float after 0x that from_chars read, is below DBL_MIN and has a set bit below the smallest subnormal
+//(2^-1074), which strtod reports as underflow. The first and last non-zero digits give the highest and lowest bits of the exact value, four bits
+//per place either side of the point, so this doesn't depend on how from_chars rounded.
+inline bool hexUnderflows(std::string_view svHex) {
+    std::size_t uExponent = svHex.find_first_of("pP");
+    long long iExponent = 0;
+    if (uExponent != std::string_view::npos) {
+        std::string_view svExponent = svHex.substr(uExponent + 1);
+        if (!svExponent.empty() && svExponent.front() == '+') {
+            svExponent.remove_prefix(1);
+        }
+        //An exponent too large for a long long gives zero or infinity, which from_chars has already reported.
+        if (std::from_chars(svExponent.data(), svExponent.data() + svExponent.length(), iExponent).ec != std::errc()) {
+            return false;
+        }
+    }
+    std::string_view svDigits = svHex.substr(0, uExponent);
+    std::size_t uPoint = std::min(svDigits.find('.'), svDigits.length());
+    std::size_t uFirst = svDigits.find_first_not_of("0.");
+    if (uFirst == std::string_view::npos) {
+        return false;
+    }
+    std::size_t uLast = svDigits.find_last_not_of("0.");
+    auto digitValue = [&](std::size_t i) {
+        unsigned char uDigit = static_cast<unsigned char>(svDigits[i]);
+        return static_cast<unsigned>(std::isdigit(uDigit) ? uDigit - '0' : std::tolower(uDigit) - 'a' + 10);
+    };
+    //Power of two of a digit's lowest bit.
+    auto digitPlace = [&](std::size_t i) {
+        return i > uPoint ? iExponent - 4 * static_cast<long long>(i - uPoint) : iExponent + 4 * static_cast<long long>(uPoint - 1 - i);
+    };
+    long long iHighestBit = digitPlace(uFirst);
+    for (unsigned uValue = digitValue(uFirst); uValue > 1; uValue >>= 1) {
+        iHighestBit++;
+    }
+    long long iLowestBit = digitPlace(uLast);
+    for (unsigned uValue = digitValue(uLast); (uValue & 1) == 0; uValue >>= 1) {
+        iLowestBit++;
+    }
+    return iHighestBit < DBL_MIN_EXP - 1 && iLowestBit < DBL_MIN_EXP - DBL_MANT_DIG;
+}
+
+//Parse a double from the start of svText, accepting the same forms as strtod (decimal, hexadecimal "0x1p3", inf and nan).
+//Returns std::errc() on success, std::errc::invalid_argument if there is no number,
+//or std::errc::result_out_of_range if it overflows or underflows. dblValue is only written on success.
+inline std::errc parseDouble(std::string_view svText, double& dblValue) {
+    svText = skipLeadingSpace(svText);
+    if (!stripPlusSign(svText)) {
+        return std::errc::invalid_argument;
+    }
+    double dblParsed = 0.0;
+    //The digits of a hexadecimal float that were read, empty for decimal input.
+    std::string_view svHexRead;
+    std::size_t uSign = (!svText.empty() && svText.front() == '-') ? 1 : 0;
+    //Hexadecimal floats need the 0x prefix removed before from_chars will read them.
+    if (svText.length() >= uSign + 2 && svText[uSign] == '0' && (svText[uSign + 1] == 'x' || svText[uSign + 1] == 'X')) {
+        std::string_view svHex = svText.substr(uSign + 2);
+        //strtod stops at a p followed by two signs, from_chars reads it as a signed exponent.
+        std::size_t uExponent = svHex.find_first_not_of("0123456789abcdefABCDEF.");
+        if (uExponent != std::string_view::npos && (svHex[uExponent] == 'p' || svHex[uExponent] == 'P') && uExponent + 2 < svHex.length()
+            && (svHex[uExponent + 1] == '+' || svHex[uExponent + 1] == '-') && (svHex[uExponent + 2] == '+' || svHex[uExponent + 2] == '-')) {
+            svHex = svHex.substr(0, uExponent);
+        }
+        std::from_chars_result result{ svHex.data(), std::errc::invalid_argument };
+        //Only digits or a point may follow the prefix, from_chars would also take a sign, inf or nan here.
+        if (!svHex.empty() && (std::isxdigit(static_cast<unsigned char>(svHex.front())) || svHex.front() == '.')) {
+            result = std::from_chars(svHex.data(), svHex.data() + svHex.length(), dblParsed, std::chars_format::hex);
+        }
+        //With no hex digits after the prefix strtod reads just the leading 0.
+        if (result.ec == std::errc::invalid_argument) {
+            dblParsed = 0.0;
+        }
+        else if (result.ec != std::errc()) {
+            return result.ec;
+        }
+        svHexRead = svHex.substr(0, static_cast<std::size_t>(result.ptr - svHex.data()));
+        if (uSign == 1) {
+            dblParsed = -dblParsed;
+        }
+    }
+    else {
+        std::errc ec = std::from_chars(svText.data(), svText.data() + svText.length(), dblParsed).ec;
+        if (ec != std::errc()) {
+            return ec;
+        }
+    }
+    //strtod reports values below DBL_MIN as out of range unless they are exact. Only hexadecimal input is checked exactly: a decimal subnormal
+    //is taken as inexact, as only a full expansion of hundreds of digits isn't.
+    bool bUnderflow = svHexRead.empty() ? dblParsed != 0.0 && std::fabs(dblParsed) < DBL_MIN : hexUnderflows(svHexRead);
+    if (bUnderflow) {
+        return std::errc::result_out_of_range;
+    }
+    dblValue = dblParsed;
+    return std::errc();
+}
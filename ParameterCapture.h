@@ -0,0 +1,212 @@
+/*
+    Command Manager Parameter Capture
+
+    Optional capture stage that keeps D_USR_FLD_ values as time series instead of printing and discarding them.
+    Every D_USR_FLD_ message becomes a row, tagged with the RUN_NO____ and POLAR_NO__ values the parser stamped on it, and every parameter name becomes a column of doubles.
+    Columns are contiguous per parameter so post-processing can read a whole series at once, and they can be flushed to a compact binary file.
+
+    Capture file layout, all integers and doubles in the writing machine's byte order (little endian on x86/x64):
+    - 8 byte magic "CMCAPT01"
+    - uint64 row count, uint32 column count
+    - for each column: uint8 type (1 = int32, 2 = float64), uint8 name length, then the name
+    - for each column in the same order: row count values of its type
+    The first two columns are RUN_NO____ and POLAR_NO__ (int32, kNoContext before the first one arrives), followed by one float64 column per parameter
+    in the order they were first seen. A parameter missing from a row, or with an invalid value, is NaN in that row.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+#include "ParameterTable.h"
+
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//Columnar store of captured D_USR_FLD_ rows.
+class ParameterCapture {
+public:
+    //Add a row for one D_USR_FLD_ message, tagged with its context. Only valid parameters are captured.
+    void capture(const ParameterList& parameters) {
+        beginRow(parameters.context);
+        std::size_t uPosition = 0;
+        for (const Parameter& parameter : parameters) {
+            if (parameter.eStatus == ParameterStatus::Valid) {
+                setValue(uPosition++, parameter.svName, parameter.dblValue);
+            }
+        }
+    }
+
+    //Add a row for a D_USR_FLD_ message that matched a schema.
+    void capture(const SchemaFrame& frame) {
+        beginRow(frame.context);
+        const ParameterSchema& schema = frame.pBuffer->schema();
+        for (std::size_t uField = 0; uField < schema.size(); uField++) {
+            setValue(uField, schema.name(uField), frame.pBuffer->value(uField, frame.uRow));
+        }
+    }
+
+    std::size_t rows() const {
+        return m_vecRunNumbers.size();
+    }
+
+    //Number of parameter columns, not counting the run and polar number columns.
+    std::size_t parameterCount() const {
+        return m_vecColumns.size();
+    }
+
+    std::string_view parameterName(std::size_t uColumn) const {
+        return m_interner.name(static_cast<std::uint32_t>(uColumn));
+    }
+
+    //Column of a parameter by name, nullptr if it hasn't been captured. Has rows() values.
+    const std::vector<double>* column(std::string_view svName) const {
+        std::uint32_t uId = m_interner.find(svName);
+        return uId == kInvalidParameterId ? nullptr : &m_vecColumns[uId];
+    }
+
+    const std::vector<double>& column(std::size_t uColumn) const {
+        return m_vecColumns[uColumn];
+    }
+
+    const std::vector<std::int32_t>& runNumbers() const {
+        return m_vecRunNumbers;
+    }
+
+    const std::vector<std::int32_t>& polarNumbers() const {
+        return m_vecPolarNumbers;
+    }
+
+    //Write every captured row in the capture file layout. Returns false if the stream fails.
+    bool write(std::ostream& os) const {
+        std::uint64_t uRows = rows();
+        std::uint32_t uColumns = static_cast<std::uint32_t>(m_vecColumns.size() + 2);
+        os.write(kMagic, sizeof(kMagic) - 1);
+        writeValue(os, uRows);
+        writeValue(os, uColumns);
+        writeColumnHeader(os, kTypeInt32, "RUN_NO____");
+        writeColumnHeader(os, kTypeInt32, "POLAR_NO__");
+        for (std::size_t i = 0; i < m_vecColumns.size(); i++) {
+            writeColumnHeader(os, kTypeFloat64, parameterName(i));
+        }
+        writeColumn(os, m_vecRunNumbers);
+        writeColumn(os, m_vecPolarNumbers);
+        for (const std::vector<double>& vecColumn : m_vecColumns) {
+            writeColumn(os, vecColumn);
+        }
+        return static_cast<bool>(os);
+    }
+
+    //Write to a file, replacing it. Returns false if it can't be written.
+    bool writeFile(const std::string& strPath) const {
+        std::ofstream file(strPath, std::ios::binary | std::ios::trunc);
+        return file && write(file) && file.flush();
+    }
+
+    //Drop the captured rows, keeping the columns and their capacity so capture can continue without reallocating.
+    void clear() {
+        m_vecRunNumbers.clear();
+        m_vecPolarNumbers.clear();
+        for (std::vector<double>& vecColumn : m_vecColumns) {
+            vecColumn.clear();
+        }
+    }
+
+    //Write the captured rows and then clear them, e.g. at the end of each polar. Nothing is cleared if the write fails.
+    bool flush(std::ostream& os) {
+        if (!write(os)) {
+            return false;
+        }
+        clear();
+        return true;
+    }
+
+private:
+    static constexpr char kMagic[] = "CMCAPT01";
+    static constexpr std::uint8_t kTypeInt32 = 1;
+    static constexpr std::uint8_t kTypeFloat64 = 2;
+
+    //Start a row with every parameter missing until it is set.
+    void beginRow(const RunContext& context) {
+        m_vecRunNumbers.push_back(context.iRunNumber);
+        m_vecPolarNumbers.push_back(context.iPolarNumber);
+        for (std::vector<double>& vecColumn : m_vecColumns) {
+            vecColumn.push_back(std::numeric_limits<double>::quiet_NaN());
+        }
+    }
+
+    //Set the value of the parameter at uPosition among the row's valid parameters.
+    void setValue(std::size_t uPosition, std::string_view svName, double dblValue) {
+        ParameterNameKey key = makeParameterNameKey(svName);
+        //As in ParameterTable, try the column used at this position in the previous row before hashing.
+        std::uint32_t uId = kInvalidParameterId;
+        if (uPosition < m_vecLayout.size() && m_interner.key(m_vecLayout[uPosition]) == key) {
+            uId = m_vecLayout[uPosition];
+        }
+        else {
+            uId = m_interner.intern(key);
+            if (uPosition < m_vecLayout.size()) {
+                m_vecLayout[uPosition] = uId;
+            }
+            else {
+                m_vecLayout.push_back(uId);
+            }
+        }
+        //A new parameter gets a column that is missing in every earlier row.
+        if (uId == m_vecColumns.size()) {
+            m_vecColumns.emplace_back(rows(), std::numeric_limits<double>::quiet_NaN());
+        }
+        m_vecColumns[uId].back() = dblValue;
+    }
+
+    template <typename T>
+    static void writeValue(std::ostream& os, const T& value) {
+        os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void writeColumnHeader(std::ostream& os, std::uint8_t uType, std::string_view svName) {
+        writeValue(os, uType);
+        writeValue(os, static_cast<std::uint8_t>(svName.length()));
+        os.write(svName.data(), static_cast<std::streamsize>(svName.length()));
+    }
+
+    template <typename T>
+    static void writeColumn(std::ostream& os, const std::vector<T>& vecColumn) {
+        os.write(reinterpret_cast<const char*>(vecColumn.data()), static_cast<std::streamsize>(vecColumn.size() * sizeof(T)));
+    }
+
+    ParameterInterner m_interner;
+    //One column per interned parameter, indexed by ID.
+    std::vector<std::vector<double>> m_vecColumns;
+    //Column of each valid parameter in the previous row, in message order.
+    std::vector<std::uint32_t> m_vecLayout;
+    std::vector<std::int32_t> m_vecRunNumbers;
+    std::vector<std::int32_t> m_vecPolarNumbers;
+};
+
+//Sink that captures D_USR_FLD_ rows, then passes every result on to another sink, if there is one.
+//Rows take their run and polar numbers from the result rather than the last RUN_NO____ / POLAR_NO__ the sink saw, so they stay right whatever order results arrive in.
+class CaptureSink : public ResultSink {
+public:
+    explicit CaptureSink(ParameterCapture& capture, ResultSink* pNext = nullptr) : m_capture(capture), m_pNext(pNext) {}
+
+    void onResult(const ParseResult& result) override {
+        if (const ParameterList* pParameters = std::get_if<ParameterList>(&result)) {
+            m_capture.capture(*pParameters);
+        }
+        else if (const SchemaFrame* pFrame = std::get_if<SchemaFrame>(&result)) {
+            m_capture.capture(*pFrame);
+        }
+        if (m_pNext != nullptr) {
+            m_pNext->onResult(result);
+        }
+    }
+
+private:
+    ParameterCapture& m_capture;
+    ResultSink* m_pNext;
+};
@@ -0,0 +1,358 @@
+/*
+    Command Manager Parameter Table
+
+    Interns D_USR_FLD_ parameter names to dense integer IDs and keeps the latest value of every parameter in an array indexed by ID.
+    The same few hundred names arrive in every frame, so consumers look a name up once, keep its ID and then read values in O(1) without hashing strings.
+    - Names are at most 15 characters, so each fits in a 16 byte key (the characters zero padded, with the length in the last byte) compared as two 64-bit words.
+    - Frames usually repeat the previous frame's layout, so each parameter is first checked against the ID at the same position last time before the hash table is used.
+    - Each frame also records which IDs changed, by more than a per-ID threshold from the value last reported as a change, so consumers can do work in
+      proportion to the changes rather than the frame. ParameterDeltaSink passes on only those parameters.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+//ID returned for names that haven't been interned, or can't be (over kMaxParameterNameLength).
+constexpr std::uint32_t kInvalidParameterId = std::numeric_limits<std::uint32_t>::max();
+
+//A parameter name packed into 16 bytes, the characters zero padded with the length in the last byte, which keeps names that differ only by trailing zero bytes apart.
+struct ParameterNameKey {
+    std::uint64_t uLow = 0;
+    std::uint64_t uHigh = 0;
+
+    bool operator==(const ParameterNameKey& other) const {
+        return uLow == other.uLow && uHigh == other.uHigh;
+    }
+
+    bool operator!=(const ParameterNameKey& other) const {
+        return !(*this == other);
+    }
+
+    //The characters, in the order they were packed.
+    std::string_view name() const {
+        const char* pBytes = reinterpret_cast<const char*>(this);
+        return std::string_view(pBytes, static_cast<unsigned char>(pBytes[15]));
+    }
+};
+
+//Pack a name of at most kMaxParameterNameLength characters into a key.
+inline ParameterNameKey makeParameterNameKey(std::string_view svName) {
+    static_assert(kMaxParameterNameLength < 16, "Parameter names must fit in a 16 byte key with their length");
+    unsigned char arrBytes[16] = {};
+    std::memcpy(arrBytes, svName.data(), svName.length());
+    arrBytes[15] = static_cast<unsigned char>(svName.length());
+    ParameterNameKey key;
+    std::memcpy(&key.uLow, arrBytes, 8);
+    std::memcpy(&key.uHigh, arrBytes + 8, 8);
+    return key;
+}
+
+//Maps parameter names to dense IDs in the order they were first seen. The names are stored in their keys, so they don't need the input to stay alive.
+class ParameterInterner {
+public:
+    //The ID of a name, adding it if it is new. Names over kMaxParameterNameLength give kInvalidParameterId.
+    std::uint32_t intern(std::string_view svName) {
+        if (svName.length() > kMaxParameterNameLength) {
+            return kInvalidParameterId;
+        }
+        return intern(makeParameterNameKey(svName));
+    }
+
+    std::uint32_t intern(const ParameterNameKey& key) {
+        //Keep the table at most half full so probes stay short.
+        if ((m_vecKeys.size() + 1) * 2 > m_vecSlots.size()) {
+            grow();
+        }
+        std::size_t uSlot = findSlot(key);
+        if (m_vecSlots[uSlot] == kInvalidParameterId) {
+            m_vecSlots[uSlot] = static_cast<std::uint32_t>(m_vecKeys.size());
+            m_vecKeys.push_back(key);
+        }
+        return m_vecSlots[uSlot];
+    }
+
+    //The ID of a name without adding it, kInvalidParameterId if it hasn't been seen.
+    std::uint32_t find(std::string_view svName) const {
+        if (svName.length() > kMaxParameterNameLength || m_vecSlots.empty()) {
+            return kInvalidParameterId;
+        }
+        return m_vecSlots[findSlot(makeParameterNameKey(svName))];
+    }
+
+    //The name of an interned ID, viewed in the interner.
+    std::string_view name(std::uint32_t uId) const {
+        return m_vecKeys[uId].name();
+    }
+
+    const ParameterNameKey& key(std::uint32_t uId) const {
+        return m_vecKeys[uId];
+    }
+
+    //Number of interned names, IDs run from 0 to size() - 1.
+    std::size_t size() const {
+        return m_vecKeys.size();
+    }
+
+private:
+    static std::size_t hashKey(const ParameterNameKey& key) {
+        std::uint64_t uHash = (key.uLow ^ (key.uHigh * 0xC2B2AE3D27D4EB4Full)) * 0x9E3779B97F4A7C15ull;
+        return static_cast<std::size_t>(uHash ^ (uHash >> 32));
+    }
+
+    //Slot holding key, or the empty slot where it belongs. Linear probing, the table is never full.
+    std::size_t findSlot(const ParameterNameKey& key) const {
+        std::size_t uMask = m_vecSlots.size() - 1;
+        std::size_t uSlot = hashKey(key) & uMask;
+        while (m_vecSlots[uSlot] != kInvalidParameterId && m_vecKeys[m_vecSlots[uSlot]] != key) {
+            uSlot = (uSlot + 1) & uMask;
+        }
+        return uSlot;
+    }
+
+    void grow() {
+        m_vecSlots.assign(m_vecSlots.empty() ? 64 : m_vecSlots.size() * 2, kInvalidParameterId);
+        for (std::uint32_t uId = 0; uId < m_vecKeys.size(); uId++) {
+            m_vecSlots[findSlot(m_vecKeys[uId])] = uId;
+        }
+    }
+
+    std::vector<ParameterNameKey> m_vecKeys;
+    std::vector<std::uint32_t> m_vecSlots;
+};
+
+//Latest value of every parameter, indexed by interned ID. Feed it D_USR_FLD_ results with update(), or attach a ParameterTableSink to a parser.
+class ParameterTable {
+public:
+    //Intern the parameters of one D_USR_FLD_ message and store their values. Invalid values and over-long names are skipped.
+    //Returns the number of values stored.
+    std::size_t update(const ParameterList& parameters) {
+        m_uFrame++;
+        m_vecChanged.clear();
+        std::size_t uStored = 0;
+        for (const Parameter& parameter : parameters) {
+            if (parameter.eStatus == ParameterStatus::Valid) {
+                store(uStored++, parameter.svName, parameter.dblValue);
+            }
+        }
+        return uStored;
+    }
+
+    //Store the values of a D_USR_FLD_ message that matched a schema.
+    std::size_t update(const SchemaFrame& frame) {
+        m_uFrame++;
+        m_vecChanged.clear();
+        const ParameterSchema& schema = frame.pBuffer->schema();
+        for (std::size_t uField = 0; uField < schema.size(); uField++) {
+            store(uField, schema.name(uField), frame.pBuffer->value(uField, frame.uRow));
+        }
+        return schema.size();
+    }
+
+    //The ID of a name, adding it if it is new, so a consumer can look it up before its first value arrives.
+    std::uint32_t id(std::string_view svName) {
+        std::uint32_t uId = m_interner.intern(svName);
+        if (uId != kInvalidParameterId) {
+            reserve(uId);
+        }
+        return uId;
+    }
+
+    //How far a value must move from the one last reported as a change before it counts as changed again, for every ID including those not seen yet.
+    //0.0, the default, counts any change. The first value of an ID always counts, and so does NaN.
+    void setChangeThreshold(double dblThreshold) {
+        m_dblChangeThreshold = dblThreshold;
+        m_vecThresholds.assign(m_vecThresholds.size(), dblThreshold);
+    }
+
+    //Threshold for one ID, overriding the table wide one.
+    void setChangeThreshold(std::uint32_t uId, double dblThreshold) {
+        reserve(uId);
+        m_vecThresholds[uId] = dblThreshold;
+    }
+
+    //IDs whose value changed in the latest D_USR_FLD_ message, in message order.
+    const std::vector<std::uint32_t>& changed() const {
+        return m_vecChanged;
+    }
+
+    //Whether the latest D_USR_FLD_ message changed an ID.
+    bool changedInLastFrame(std::uint32_t uId) const {
+        return m_uFrame != 0 && m_vecChangeFrames[uId] == m_uFrame;
+    }
+
+    //Value of an ID last reported as a change, which the next value is compared against.
+    double reportedValue(std::uint32_t uId) const {
+        return m_vecReported[uId];
+    }
+
+    //Put back the state of an ID saved from another table, e.g. from a snapshot (see ParserSnapshot.h). uLastFrame is its lastFrame(), 0 if it was never set.
+    void restore(std::uint32_t uId, double dblValue, double dblReported, std::uint64_t uLastFrame) {
+        reserve(uId);
+        m_vecValues[uId] = dblValue;
+        m_vecReported[uId] = dblReported;
+        m_vecFrames[uId] = uLastFrame;
+    }
+
+    //Put back the D_USR_FLD_ message count, so frame numbers carry on from the saved table.
+    void restoreFrame(std::uint64_t uFrame) {
+        m_uFrame = uFrame;
+        m_vecChanged.clear();
+    }
+
+    //Latest value of an ID, 0.0 until the first value arrives.
+    double value(std::uint32_t uId) const {
+        return m_vecValues[uId];
+    }
+
+    //All values, indexed by ID.
+    const std::vector<double>& values() const {
+        return m_vecValues;
+    }
+
+    //Frame (counting D_USR_FLD_ messages from 1) that last set an ID, 0 if none has.
+    std::uint64_t lastFrame(std::uint32_t uId) const {
+        return m_vecFrames[uId];
+    }
+
+    //Number of D_USR_FLD_ messages seen.
+    std::uint64_t frame() const {
+        return m_uFrame;
+    }
+
+    //Whether the latest D_USR_FLD_ message set an ID.
+    bool updatedInLastFrame(std::uint32_t uId) const {
+        return m_uFrame != 0 && m_vecFrames[uId] == m_uFrame;
+    }
+
+    const ParameterInterner& interner() const {
+        return m_interner;
+    }
+
+    //Number of IDs, values() has this many entries.
+    std::size_t size() const {
+        return m_vecValues.size();
+    }
+
+private:
+    //Store the value of the parameter at uPosition among the message's valid parameters.
+    void store(std::size_t uPosition, std::string_view svName, double dblValue) {
+        ParameterNameKey key = makeParameterNameKey(svName);
+        //Most frames have the same layout as the last one, so try the ID seen at this position first.
+        std::uint32_t uId = kInvalidParameterId;
+        if (uPosition < m_vecLayout.size() && m_interner.key(m_vecLayout[uPosition]) == key) {
+            uId = m_vecLayout[uPosition];
+        }
+        else {
+            uId = m_interner.intern(key);
+            if (uPosition < m_vecLayout.size()) {
+                m_vecLayout[uPosition] = uId;
+            }
+            else {
+                m_vecLayout.push_back(uId);
+            }
+        }
+        reserve(uId);
+        //Compared against the value last reported rather than the previous one, so a slow drift is still reported once it passes the threshold.
+        if (m_vecFrames[uId] == 0 || !(std::fabs(dblValue - m_vecReported[uId]) <= m_vecThresholds[uId])) {
+            m_vecReported[uId] = dblValue;
+            if (m_vecChangeFrames[uId] != m_uFrame) {
+                m_vecChangeFrames[uId] = m_uFrame;
+                m_vecChanged.push_back(uId);
+            }
+        }
+        m_vecValues[uId] = dblValue;
+        m_vecFrames[uId] = m_uFrame;
+    }
+
+    void reserve(std::uint32_t uId) {
+        if (uId >= m_vecValues.size()) {
+            m_vecValues.resize(uId + 1, 0.0);
+            m_vecFrames.resize(uId + 1, 0);
+            m_vecReported.resize(uId + 1, 0.0);
+            m_vecThresholds.resize(uId + 1, m_dblChangeThreshold);
+            m_vecChangeFrames.resize(uId + 1, 0);
+        }
+    }
+
+    ParameterInterner m_interner;
+    std::vector<double> m_vecValues;
+    std::vector<std::uint64_t> m_vecFrames;
+    //Value last reported as a change, the change threshold and the frame that last changed, per ID.
+    std::vector<double> m_vecReported;
+    std::vector<double> m_vecThresholds;
+    std::vector<std::uint64_t> m_vecChangeFrames;
+    std::vector<std::uint32_t> m_vecChanged;
+    double m_dblChangeThreshold = 0.0;
+    //ID of each valid parameter in the previous frame, in message order.
+    std::vector<std::uint32_t> m_vecLayout;
+    std::uint64_t m_uFrame = 0;
+};
+
+//Sink that stores D_USR_FLD_ values in a ParameterTable and then passes every result on to another sink, if there is one.
+class ParameterTableSink : public ResultSink {
+public:
+    explicit ParameterTableSink(ParameterTable& table, ResultSink* pNext = nullptr) : m_table(table), m_pNext(pNext) {}
+
+    void onResult(const ParseResult& result) override {
+        if (const ParameterList* pParameters = std::get_if<ParameterList>(&result)) {
+            m_table.update(*pParameters);
+        }
+        else if (const SchemaFrame* pFrame = std::get_if<SchemaFrame>(&result)) {
+            m_table.update(*pFrame);
+        }
+        if (m_pNext != nullptr) {
+            m_pNext->onResult(result);
+        }
+    }
+
+private:
+    ParameterTable& m_table;
+    ResultSink* m_pNext;
+};
+
+//Sink that stores D_USR_FLD_ values in a ParameterTable and passes on only the parameters that changed, as a ParameterList, to the next sink.
+//Frames with no changes aren't passed on at all, and every other result is passed on unchanged.
+//Invalid parameters are dropped, and the changed parameters carry their interned name and value but no value text.
+class ParameterDeltaSink : public ResultSink {
+public:
+    ParameterDeltaSink(ParameterTable& table, ResultSink& next) : m_table(table), m_next(next) {}
+
+    void onResult(const ParseResult& result) override {
+        if (const ParameterList* pParameters = std::get_if<ParameterList>(&result)) {
+            m_table.update(*pParameters);
+            forwardChanges(pParameters->context);
+        }
+        else if (const SchemaFrame* pFrame = std::get_if<SchemaFrame>(&result)) {
+            m_table.update(*pFrame);
+            forwardChanges(pFrame->context);
+        }
+        else {
+            m_next.onResult(result);
+        }
+    }
+
+private:
+    void forwardChanges(const RunContext& context) {
+        const std::vector<std::uint32_t>& vecChanged = m_table.changed();
+        if (vecChanged.empty()) {
+            return;
+        }
+        m_vecDelta.clear();
+        for (std::uint32_t uId : vecChanged) {
+            m_vecDelta.push_back({ m_table.interner().name(uId), std::string_view(), m_table.value(uId), ParameterStatus::Valid });
+        }
+        m_next.onResult(ParameterList{ m_vecDelta.data(), m_vecDelta.size(), context });
+    }
+
+    ParameterTable& m_table;
+    ResultSink& m_next;
+    std::vector<Parameter> m_vecDelta;
+};
@@ -0,0 +1,143 @@
+/*
+    Command Manager Parse Arena
+
+    Monotonic memory resource for the parser's per-message and per-batch scratch storage.
+    Allocations bump a pointer through a chain of blocks and deallocation does nothing. reset() rewinds to the first block
+    in O(1) but keeps every block, so once the arena has grown to fit the largest message or batch seen, parsing stops calling the global allocator.
+    Unlike std::pmr::monotonic_buffer_resource, whose release() hands its blocks back upstream, the blocks are only freed when the arena is destroyed.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <string_view>
+
+//Default size of the arena's first block. Later blocks double in size.
+constexpr std::size_t kDefaultArenaBlockSize = 16 * 1024;
+
+class ParseArena : public std::pmr::memory_resource {
+public:
+    explicit ParseArena(std::size_t uInitialBlockSize = kDefaultArenaBlockSize, std::pmr::memory_resource* pUpstream = std::pmr::new_delete_resource())
+        : m_uNextBlockSize(uInitialBlockSize < kMinBlockSize ? kMinBlockSize : uInitialBlockSize), m_pUpstream(pUpstream) {}
+
+    ParseArena(const ParseArena&) = delete;
+    ParseArena& operator=(const ParseArena&) = delete;
+
+    ~ParseArena() override {
+        Block* pBlock = m_pFirst;
+        while (pBlock != nullptr) {
+            Block* pNext = pBlock->pNext;
+            m_pUpstream->deallocate(pBlock, sizeof(Block) + pBlock->uSize, alignof(std::max_align_t));
+            pBlock = pNext;
+        }
+    }
+
+    //Rewind to the start of the first block. Everything allocated since the last reset is invalidated, but no memory is returned upstream.
+    void reset() {
+        m_pCurrent = m_pFirst;
+        m_uOffset = 0;
+        m_uInUse = 0;
+    }
+
+    //Copy text into the arena, e.g. to keep message content after the input buffer has been reused. Valid until the next reset.
+    std::string_view copy(std::string_view svText) {
+        if (svText.empty()) {
+            return {};
+        }
+        char* pText = static_cast<char*>(allocate(svText.length(), 1));
+        std::memcpy(pText, svText.data(), svText.length());
+        return std::string_view(pText, svText.length());
+    }
+
+    //Bytes handed out since the last reset, including alignment padding.
+    std::size_t bytesInUse() const {
+        return m_uInUse;
+    }
+
+    //Bytes held in blocks, used or not.
+    std::size_t bytesReserved() const {
+        return m_uReserved;
+    }
+
+    //Number of blocks requested from the upstream resource, which stops rising once the arena has warmed up.
+    std::size_t upstreamAllocations() const {
+        return m_uUpstreamAllocations;
+    }
+
+private:
+    //Header at the start of each block, followed by the block's usable bytes.
+    struct alignas(std::max_align_t) Block {
+        Block* pNext;
+        std::size_t uSize;
+
+        unsigned char* data() {
+            return reinterpret_cast<unsigned char*>(this + 1);
+        }
+    };
+
+    static constexpr std::size_t kMinBlockSize = 256;
+
+    void* do_allocate(std::size_t uBytes, std::size_t uAlignment) override {
+        while (m_pCurrent != nullptr) {
+            std::uintptr_t uBase = reinterpret_cast<std::uintptr_t>(m_pCurrent->data());
+            std::size_t uStart = ((uBase + m_uOffset + uAlignment - 1) & ~(static_cast<std::uintptr_t>(uAlignment) - 1)) - uBase;
+            if (uStart + uBytes <= m_pCurrent->uSize) {
+                m_uInUse += uStart + uBytes - m_uOffset;
+                m_uOffset = uStart + uBytes;
+                return m_pCurrent->data() + uStart;
+            }
+            //Move on to the next block kept from before the last reset, or grow.
+            if (m_pCurrent->pNext == nullptr) {
+                break;
+            }
+            m_uInUse += m_pCurrent->uSize - m_uOffset;
+            m_pCurrent = m_pCurrent->pNext;
+            m_uOffset = 0;
+        }
+        appendBlock(uBytes + uAlignment);
+        m_uOffset = 0;
+        return do_allocate(uBytes, uAlignment);
+    }
+
+    //Memory is only reclaimed by reset().
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    //Add a block of at least uMinSize bytes after the current one.
+    void appendBlock(std::size_t uMinSize) {
+        std::size_t uSize = m_uNextBlockSize;
+        while (uSize < uMinSize) {
+            uSize *= 2;
+        }
+        m_uNextBlockSize = uSize * 2;
+        Block* pBlock = static_cast<Block*>(m_pUpstream->allocate(sizeof(Block) + uSize, alignof(std::max_align_t)));
+        pBlock->pNext = nullptr;
+        pBlock->uSize = uSize;
+        m_uReserved += uSize;
+        m_uUpstreamAllocations++;
+        if (m_pCurrent == nullptr) {
+            m_pFirst = pBlock;
+        }
+        else {
+            m_uInUse += m_pCurrent->uSize - m_uOffset;
+            m_pCurrent->pNext = pBlock;
+        }
+        m_pCurrent = pBlock;
+    }
+
+    Block* m_pFirst = nullptr;
+    Block* m_pCurrent = nullptr;
+    //Offset of the first free byte in the current block.
+    std::size_t m_uOffset = 0;
+    std::size_t m_uNextBlockSize;
+    std::size_t m_uInUse = 0;
+    std::size_t m_uReserved = 0;
+    std::size_t m_uUpstreamAllocations = 0;
+    std::pmr::memory_resource* m_pUpstream;
+};
@@ -0,0 +1,350 @@
+/*
+    Command Manager Parser Metrics
+
+    Low-overhead instrumentation of the parse path: messages per opcode, site-specific messages taken by a handler, rejected messages by reason,
+    and parse latency histograms per opcode. Each thread that parses counts into its own shard, so recording never shares a cache line with
+    another thread or takes a lock; snapshot() adds the shards up, and writePrometheus exports a snapshot in the Prometheus text format.
+    Latency is timed for one message in kLatencySampleInterval on each thread, so the clock isn't read for every message. Every path times the same span,
+    validating and decoding the message, and stops before it is committed, so the history, handlers and the sink's own work (e.g. console output) aren't included.
+
+    Build with COMMANDMANAGER_ENABLE_METRICS=0 (the CMake option of the same name) to compile the recording out of the parser entirely.
+    The types below stay available, snapshots are then always empty.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+#ifndef COMMANDMANAGER_ENABLE_METRICS
+#define COMMANDMANAGER_ENABLE_METRICS 1
+#endif
+
+//Counter slots per opcode and per rejection reason, indexed by the OpCode and ParseErrorReason values (checked in CommandManager.h).
+constexpr std::size_t kMetricsOpCodeSlots = 6;
+constexpr std::size_t kMetricsReasonSlots = 10;
+
+//Labels the slots are exported with. Site-specific opcodes share the Unknown slot.
+inline constexpr std::array<std::string_view, kMetricsOpCodeSlots> kMetricsOpCodeLabels = { {
+    "other", "RUN_NO____", "POLAR_NO__", "USR_MSG___", "D_USR_FLD_", "HISTORY___"
+} };
+
+inline constexpr std::array<std::string_view, kMetricsReasonSlots> kMetricsReasonLabels = { {
+    "missing_terminator", "too_short", "unknown_opcode", "invalid_run_number", "invalid_polar_number", "odd_parameter_count", "invalid_binary_payload",
+    "message_too_long", "invalid_character", "too_many_parameters"
+} };
+
+//One message in this many is timed on each thread.
+constexpr std::uint32_t kLatencySampleInterval = 16;
+
+//Latency histograms are log-linear like an HDR histogram: 8 buckets per power of two, so any value is within 12.5% of its bucket's bounds.
+//Values below 8ns get a bucket each and values from 2^36ns (about 69s) up share the last bucket.
+constexpr unsigned kLatencySubBucketBits = 3;
+constexpr unsigned kLatencyMaxExponent = 36;
+constexpr std::size_t kLatencyBuckets = (kLatencyMaxExponent - kLatencySubBucketBits + 1) << kLatencySubBucketBits;
+
+//Index of the highest set bit, uValue must not be zero.
+inline unsigned floorLog2(std::uint64_t uValue) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long uIndex = 0;
+    _BitScanReverse64(&uIndex, uValue);
+    return static_cast<unsigned>(uIndex);
+#else
+    return 63u - static_cast<unsigned>(__builtin_clzll(uValue));
+#endif
+}
+
+//Histogram bucket holding a latency in nanoseconds.
+inline std::size_t latencyBucket(std::uint64_t uNanoseconds) {
+    constexpr std::uint64_t kSubBuckets = 1u << kLatencySubBucketBits;
+    if (uNanoseconds < kSubBuckets) {
+        return static_cast<std::size_t>(uNanoseconds);
+    }
+    unsigned uExponent = floorLog2(uNanoseconds);
+    if (uExponent >= kLatencyMaxExponent) {
+        return kLatencyBuckets - 1;
+    }
+    std::size_t uSubBucket = static_cast<std::size_t>((uNanoseconds >> (uExponent - kLatencySubBucketBits)) & (kSubBuckets - 1));
+    return ((uExponent - kLatencySubBucketBits + 1) << kLatencySubBucketBits) + uSubBucket;
+}
+
+//Exclusive upper bound of a histogram bucket in nanoseconds.
+inline std::uint64_t latencyBucketUpperBound(std::size_t uBucket) {
+    constexpr std::size_t kSubBuckets = 1u << kLatencySubBucketBits;
+    if (uBucket < kSubBuckets) {
+        return uBucket + 1;
+    }
+    unsigned uShift = static_cast<unsigned>(uBucket >> kLatencySubBucketBits) - 1;
+    std::uint64_t uLower = static_cast<std::uint64_t>(kSubBuckets + (uBucket & (kSubBuckets - 1))) << uShift;
+    return uLower + (std::uint64_t(1) << uShift);
+}
+
+//Latencies of one opcode, added up over every thread.
+struct LatencySnapshot {
+    std::array<std::uint64_t, kLatencyBuckets> arrBuckets{};
+    std::uint64_t uCount = 0;
+    std::uint64_t uTotalNanoseconds = 0;
+    std::uint64_t uMaxNanoseconds = 0;
+
+    //Latency in nanoseconds that dblQuantile (0 to 1) of the samples are below, to within a bucket. 0 if there are no samples.
+    std::uint64_t quantile(double dblQuantile) const {
+        if (uCount == 0) {
+            return 0;
+        }
+        std::uint64_t uRank = static_cast<std::uint64_t>(dblQuantile * static_cast<double>(uCount));
+        if (uRank >= uCount) {
+            return uMaxNanoseconds;
+        }
+        std::uint64_t uSeen = 0;
+        for (std::size_t i = 0; i < kLatencyBuckets; i++) {
+            uSeen += arrBuckets[i];
+            if (uSeen > uRank) {
+                std::uint64_t uUpper = latencyBucketUpperBound(i);
+                return uUpper < uMaxNanoseconds ? uUpper : uMaxNanoseconds;
+            }
+        }
+        return uMaxNanoseconds;
+    }
+
+    double meanNanoseconds() const {
+        return uCount == 0 ? 0.0 : static_cast<double>(uTotalNanoseconds) / static_cast<double>(uCount);
+    }
+};
+
+//Every thread's metrics added up.
+struct MetricsSnapshot {
+    //Messages passed on by a parser, by opcode slot.
+    std::array<std::uint64_t, kMetricsOpCodeSlots> arrMessages{};
+    //Site-specific messages taken by a registered or static handler.
+    std::uint64_t uHandled = 0;
+    //Messages that produced a ParseError, by reason. Unknown opcodes no handler took count as unknown_opcode.
+    std::array<std::uint64_t, kMetricsReasonSlots> arrRejected{};
+    //Sampled parse latencies, by opcode slot.
+    std::array<LatencySnapshot, kMetricsOpCodeSlots> arrLatency{};
+};
+
+//Counters of one thread. Only the owning thread writes them, so each update is a plain load and store; the atomics only make snapshots from other threads safe.
+class MetricsShard {
+public:
+    //The calling thread's shard.
+    static MetricsShard& local();
+
+    void countMessage(std::size_t uOpCode) {
+        add(m_arrMessages[uOpCode], 1);
+    }
+
+    void countHandled() {
+        add(m_uHandled, 1);
+    }
+
+    void countRejected(std::size_t uReason) {
+        add(m_arrRejected[uReason], 1);
+    }
+
+    //True for the messages whose latency should be timed.
+    bool sampleLatency() {
+        if (--m_uSampleCountdown != 0) {
+            return false;
+        }
+        m_uSampleCountdown = kLatencySampleInterval;
+        return true;
+    }
+
+    void recordLatency(std::size_t uOpCode, std::uint64_t uNanoseconds) {
+        Histogram& histogram = m_arrLatency[uOpCode];
+        add(histogram.arrBuckets[latencyBucket(uNanoseconds)], 1);
+        add(histogram.uCount, 1);
+        add(histogram.uTotalNanoseconds, uNanoseconds);
+        if (uNanoseconds > histogram.uMaxNanoseconds.load(std::memory_order_relaxed)) {
+            histogram.uMaxNanoseconds.store(uNanoseconds, std::memory_order_relaxed);
+        }
+    }
+
+    //Add this shard's counters to a snapshot. Safe from any thread.
+    void addTo(MetricsSnapshot& snapshot) const {
+        for (std::size_t i = 0; i < kMetricsOpCodeSlots; i++) {
+            snapshot.arrMessages[i] += m_arrMessages[i].load(std::memory_order_relaxed);
+            const Histogram& histogram = m_arrLatency[i];
+            LatencySnapshot& latency = snapshot.arrLatency[i];
+            for (std::size_t uBucket = 0; uBucket < kLatencyBuckets; uBucket++) {
+                latency.arrBuckets[uBucket] += histogram.arrBuckets[uBucket].load(std::memory_order_relaxed);
+            }
+            latency.uCount += histogram.uCount.load(std::memory_order_relaxed);
+            latency.uTotalNanoseconds += histogram.uTotalNanoseconds.load(std::memory_order_relaxed);
+            std::uint64_t uMax = histogram.uMaxNanoseconds.load(std::memory_order_relaxed);
+            if (uMax > latency.uMaxNanoseconds) {
+                latency.uMaxNanoseconds = uMax;
+            }
+        }
+        snapshot.uHandled += m_uHandled.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < kMetricsReasonSlots; i++) {
+            snapshot.arrRejected[i] += m_arrRejected[i].load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct Histogram {
+        std::array<std::atomic<std::uint64_t>, kLatencyBuckets> arrBuckets{};
+        std::atomic<std::uint64_t> uCount{ 0 };
+        std::atomic<std::uint64_t> uTotalNanoseconds{ 0 };
+        std::atomic<std::uint64_t> uMaxNanoseconds{ 0 };
+    };
+
+    static void add(std::atomic<std::uint64_t>& uCounter, std::uint64_t uAmount) {
+        uCounter.store(uCounter.load(std::memory_order_relaxed) + uAmount, std::memory_order_relaxed);
+    }
+
+    //Keep shards of different threads from sharing a cache line.
+    alignas(64) std::array<std::atomic<std::uint64_t>, kMetricsOpCodeSlots> m_arrMessages{};
+    std::atomic<std::uint64_t> m_uHandled{ 0 };
+    std::array<std::atomic<std::uint64_t>, kMetricsReasonSlots> m_arrRejected{};
+    std::uint32_t m_uSampleCountdown = kLatencySampleInterval;
+    std::array<Histogram, kMetricsOpCodeSlots> m_arrLatency{};
+};
+
+//Process-wide set of shards. A thread's shard is kept when it exits, with its counts, and given to the next new thread.
+class ParserMetrics {
+public:
+    static ParserMetrics& instance() {
+        //Never destroyed, so threads exiting during shutdown can still hand their shards back.
+        static ParserMetrics* pInstance = new ParserMetrics();
+        return *pInstance;
+    }
+
+    //Add up every thread's counters. Counts made while the snapshot is taken may or may not be included.
+    MetricsSnapshot snapshot() const {
+        MetricsSnapshot snapshot;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const MetricsShard& shard : m_shards) {
+            shard.addTo(snapshot);
+        }
+        return snapshot;
+    }
+
+    MetricsShard& acquireShard() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_vecFree.empty()) {
+            MetricsShard* pShard = m_vecFree.back();
+            m_vecFree.pop_back();
+            return *pShard;
+        }
+        return m_shards.emplace_back();
+    }
+
+    void releaseShard(MetricsShard& shard) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_vecFree.push_back(&shard);
+    }
+
+private:
+    ParserMetrics() = default;
+
+    mutable std::mutex m_mutex;
+    //A deque so shards never move once handed out.
+    std::deque<MetricsShard> m_shards;
+    std::vector<MetricsShard*> m_vecFree;
+};
+
+//Takes a shard for the thread on first use and hands it back when the thread exits.
+struct MetricsShardLease {
+    MetricsShard* pShard = &ParserMetrics::instance().acquireShard();
+    ~MetricsShardLease();
+};
+
+//The calling thread's shard once it has one. A plain pointer needs no initialisation check, unlike the lease, so this is all the hot path reads.
+inline thread_local MetricsShard* g_pLocalMetricsShard = nullptr;
+
+inline MetricsShardLease::~MetricsShardLease() {
+    g_pLocalMetricsShard = nullptr;
+    ParserMetrics::instance().releaseShard(*pShard);
+}
+
+inline MetricsShard& MetricsShard::local() {
+    if (g_pLocalMetricsShard == nullptr) {
+        thread_local MetricsShardLease lease;
+        g_pLocalMetricsShard = lease.pShard;
+    }
+    return *g_pLocalMetricsShard;
+}
+
+#if COMMANDMANAGER_ENABLE_METRICS
+//Times one message if it is sampled. stop() records the time against the message's opcode.
+class LatencyTimer {
+public:
+    LatencyTimer() {
+        MetricsShard& shard = MetricsShard::local();
+        if (shard.sampleLatency()) {
+            m_pShard = &shard;
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    void stop(std::size_t uOpCode) {
+        if (m_pShard != nullptr) {
+            std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - m_start;
+            m_pShard->recordLatency(uOpCode, static_cast<std::uint64_t>(elapsed.count()));
+        }
+    }
+
+private:
+    MetricsShard* m_pShard = nullptr;
+    std::chrono::steady_clock::time_point m_start;
+};
+#else
+class LatencyTimer {
+public:
+    void stop(std::size_t) {}
+};
+#endif
+
+//Write a snapshot in the Prometheus text exposition format. Latency buckets are exported up to one nanosecond below each power of two from 32ns to about 1s.
+inline void writePrometheus(std::ostream& os, const MetricsSnapshot& snapshot) {
+    os << "# HELP commandmanager_messages_total Messages parsed, by opcode.\n";
+    os << "# TYPE commandmanager_messages_total counter\n";
+    for (std::size_t i = 0; i < kMetricsOpCodeSlots; i++) {
+        os << "commandmanager_messages_total{opcode=\"" << kMetricsOpCodeLabels[i] << "\"} " << snapshot.arrMessages[i] << "\n";
+    }
+    os << "# HELP commandmanager_handled_total Site-specific messages taken by a registered handler.\n";
+    os << "# TYPE commandmanager_handled_total counter\n";
+    os << "commandmanager_handled_total " << snapshot.uHandled << "\n";
+    os << "# HELP commandmanager_rejected_total Messages rejected, by reason.\n";
+    os << "# TYPE commandmanager_rejected_total counter\n";
+    for (std::size_t i = 0; i < kMetricsReasonSlots; i++) {
+        os << "commandmanager_rejected_total{reason=\"" << kMetricsReasonLabels[i] << "\"} " << snapshot.arrRejected[i] << "\n";
+    }
+    os << "# HELP commandmanager_parse_latency_seconds Decode latency of sampled messages, by opcode, not including the sink.\n";
+    os << "# TYPE commandmanager_parse_latency_seconds histogram\n";
+    char szNumber[32];
+    for (std::size_t i = 0; i < kMetricsOpCodeSlots; i++) {
+        const LatencySnapshot& latency = snapshot.arrLatency[i];
+        //A power of two is always a bucket boundary, so each exported bucket is an exact sum of histogram buckets: those below 2^e ns.
+        //Latencies are whole nanoseconds, so that is every sample of at most 2^e - 1 ns, which is the inclusive bound Prometheus's le needs.
+        std::size_t uBucket = 0;
+        std::uint64_t uCumulative = 0;
+        for (unsigned uExponent = 5; uExponent <= 30; uExponent++) {
+            std::uint64_t uLimit = std::uint64_t(1) << uExponent;
+            std::size_t uEnd = latencyBucket(uLimit);
+            for (; uBucket < uEnd; uBucket++) {
+                uCumulative += latency.arrBuckets[uBucket];
+            }
+            std::snprintf(szNumber, sizeof(szNumber), "%.10g", static_cast<double>(uLimit - 1) * 1e-9);
+            os << "commandmanager_parse_latency_seconds_bucket{opcode=\"" << kMetricsOpCodeLabels[i] << "\",le=\"" << szNumber << "\"} " << uCumulative << "\n";
+        }
+        os << "commandmanager_parse_latency_seconds_bucket{opcode=\"" << kMetricsOpCodeLabels[i] << "\",le=\"+Inf\"} " << latency.uCount << "\n";
+        std::snprintf(szNumber, sizeof(szNumber), "%.9g", static_cast<double>(latency.uTotalNanoseconds) * 1e-9);
+        os << "commandmanager_parse_latency_seconds_sum{opcode=\"" << kMetricsOpCodeLabels[i] << "\"} " << szNumber << "\n";
+        os << "commandmanager_parse_latency_seconds_count{opcode=\"" << kMetricsOpCodeLabels[i] << "\"} " << latency.uCount << "\n";
+    }
+}
@@ -0,0 +1,177 @@
+/*
+    Command Manager Parser Snapshot
+
+    Saves the state a parser builds up over a run, so a restarted process carries on where it left off without replaying logs: the history (and its depth),
+    the current RUN_NO____ / POLAR_NO__ context and, if one is given, a ParameterTable's interned names and latest values.
+    Snapshots are small and written in one go to a temporary file that then replaces the previous snapshot, so a crash mid-write leaves the last one intact.
+    Restoring maps the file and copies fixed size records straight out of the mapping.
+
+    Snapshot file layout, all integers and doubles in the writing machine's byte order (little endian on x86/x64):
+    - 8 byte magic "CMSNAP01"
+    - uint32 history depth, uint32 history entry count, then the entries oldest first, 10 characters each
+    - int32 run number, int32 polar number (kNoContext if none has arrived)
+    - uint64 D_USR_FLD_ message count, uint32 parameter count
+    - for each parameter in ID order: the 16 byte ParameterNameKey (name zero padded, length in the last byte), float64 latest value,
+      float64 value last reported as a change, uint64 message that last set it
+    Registered handlers, schemas, validation rules and change thresholds are configuration rather than state, and are set up again as at startup.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+#include "CommandReplay.h"
+#include "ParameterTable.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+namespace SnapshotFormat {
+    constexpr char kMagic[] = "CMSNAP01";
+    constexpr std::size_t kMagicLength = sizeof(kMagic) - 1;
+    constexpr std::size_t kHistoryHeaderLength = 8;
+    constexpr std::size_t kContextLength = 8;
+    constexpr std::size_t kTableHeaderLength = 12;
+    constexpr std::size_t kParameterRecordLength = sizeof(ParameterNameKey) + 24;
+
+    static_assert(sizeof(ParameterNameKey) == 16, "Parameter name keys are written as 16 bytes");
+
+    template <typename T>
+    void appendValue(std::string& strSnapshot, T value) {
+        strSnapshot.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    T readValue(const char* pData) {
+        T value;
+        std::memcpy(&value, pData, sizeof(value));
+        return value;
+    }
+}
+
+//Append a snapshot of a parser, and of a ParameterTable if one is given, to strSnapshot.
+template <typename TExtension>
+void appendSnapshot(std::string& strSnapshot, const BasicCommandParser<TExtension>& parser, const ParameterTable* pTable = nullptr) {
+    using namespace SnapshotFormat;
+    const CommandHistory& history = parser.history();
+    std::size_t uParameters = pTable != nullptr ? pTable->size() : 0;
+    strSnapshot.reserve(strSnapshot.size() + kMagicLength + kHistoryHeaderLength + history.size() * kOpCodeLength + kContextLength + kTableHeaderLength
+        + uParameters * kParameterRecordLength);
+    strSnapshot.append(kMagic, kMagicLength);
+    appendValue(strSnapshot, static_cast<std::uint32_t>(history.depth()));
+    appendValue(strSnapshot, static_cast<std::uint32_t>(history.size()));
+    for (std::size_t i = history.size(); i-- > 0;) {
+        strSnapshot.append(history[i].data(), kOpCodeLength);
+    }
+    appendValue(strSnapshot, parser.runContext().iRunNumber);
+    appendValue(strSnapshot, parser.runContext().iPolarNumber);
+    appendValue(strSnapshot, static_cast<std::uint64_t>(pTable != nullptr ? pTable->frame() : 0));
+    appendValue(strSnapshot, static_cast<std::uint32_t>(uParameters));
+    for (std::uint32_t uId = 0; uId < uParameters; uId++) {
+        const ParameterNameKey& key = pTable->interner().key(uId);
+        strSnapshot.append(reinterpret_cast<const char*>(&key), sizeof(key));
+        appendValue(strSnapshot, pTable->value(uId));
+        appendValue(strSnapshot, pTable->reportedValue(uId));
+        appendValue(strSnapshot, pTable->lastFrame(uId));
+    }
+}
+
+//Write a snapshot to strPath, replacing any previous one only once the new one is complete. Returns false and sets strError if it can't be written.
+//Call it from the thread using the parser, between messages.
+template <typename TExtension>
+bool writeSnapshotFile(const std::string& strPath, const BasicCommandParser<TExtension>& parser, const ParameterTable* pTable, std::string& strError) {
+    std::string strSnapshot;
+    appendSnapshot(strSnapshot, parser, pTable);
+    std::string strTemporaryPath = strPath + ".tmp";
+    {
+        std::ofstream file(strTemporaryPath, std::ios::binary | std::ios::trunc);
+        if (!file || !file.write(strSnapshot.data(), static_cast<std::streamsize>(strSnapshot.size())) || !file.flush()) {
+            strError = "Can't write " + strTemporaryPath;
+            return false;
+        }
+    }
+#if defined(_WIN32)
+    bool bReplaced = MoveFileExA(strTemporaryPath.c_str(), strPath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool bReplaced = std::rename(strTemporaryPath.c_str(), strPath.c_str()) == 0;
+#endif
+    if (!bReplaced) {
+        strError = "Can't replace " + strPath;
+        std::remove(strTemporaryPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+//Restore a parser, and a ParameterTable if one is given, from a snapshot. The table should be empty, parameters are added to it by name.
+//The snapshot is checked in full before anything is changed, so if it is truncated or malformed this returns false, sets strError and leaves both as they were.
+//The history is replayed oldest first through recordHistory, so a HistoryListener attached beforehand (e.g. a SharedHistory) is emptied and seeded with it.
+template <typename TExtension>
+bool restoreSnapshot(std::string_view svSnapshot, BasicCommandParser<TExtension>& parser, ParameterTable* pTable, std::string& strError) {
+    using namespace SnapshotFormat;
+    const char* pData = svSnapshot.data();
+    std::size_t uLength = svSnapshot.length();
+    if (uLength < kMagicLength + kHistoryHeaderLength || std::memcmp(pData, kMagic, kMagicLength) != 0) {
+        strError = "Not a parser snapshot";
+        return false;
+    }
+    std::size_t uOffset = kMagicLength;
+    std::uint32_t uDepth = readValue<std::uint32_t>(pData + uOffset);
+    std::uint32_t uEntries = readValue<std::uint32_t>(pData + uOffset + 4);
+    uOffset += kHistoryHeaderLength;
+    if (uDepth > CommandHistory::capacity() || uEntries > uDepth || uLength - uOffset < uEntries * kOpCodeLength + kContextLength + kTableHeaderLength) {
+        strError = "Parser snapshot history is malformed or truncated";
+        return false;
+    }
+    std::size_t uHistoryOffset = uOffset;
+    uOffset += uEntries * kOpCodeLength;
+    RunContext context;
+    context.iRunNumber = readValue<std::int32_t>(pData + uOffset);
+    context.iPolarNumber = readValue<std::int32_t>(pData + uOffset + 4);
+    uOffset += kContextLength;
+    std::uint64_t uFrame = readValue<std::uint64_t>(pData + uOffset);
+    std::uint32_t uParameters = readValue<std::uint32_t>(pData + uOffset + 8);
+    uOffset += kTableHeaderLength;
+    if ((uLength - uOffset) / kParameterRecordLength < uParameters || uLength - uOffset != uParameters * kParameterRecordLength) {
+        strError = "Parser snapshot parameter table is truncated";
+        return false;
+    }
+    for (std::uint32_t u = 0; u < uParameters; u++) {
+        if (static_cast<unsigned char>(pData[uOffset + u * kParameterRecordLength + 15]) > kMaxParameterNameLength) {
+            strError = "Parser snapshot parameter name is malformed";
+            return false;
+        }
+    }
+
+    parser.history().setDepth(uDepth);
+    parser.clearHistory();
+    for (std::uint32_t u = 0; u < uEntries; u++) {
+        parser.recordHistory(std::string_view(pData + uHistoryOffset + u * kOpCodeLength, kOpCodeLength));
+    }
+    parser.setRunContext(context);
+    if (pTable != nullptr) {
+        for (std::uint32_t u = 0; u < uParameters; u++) {
+            const char* pRecord = pData + uOffset + u * kParameterRecordLength;
+            ParameterNameKey key = readValue<ParameterNameKey>(pRecord);
+            std::uint32_t uId = pTable->id(key.name());
+            pTable->restore(uId, readValue<double>(pRecord + 16), readValue<double>(pRecord + 24), readValue<std::uint64_t>(pRecord + 32));
+        }
+        pTable->restoreFrame(uFrame);
+    }
+    return true;
+}
+
+//Map a snapshot file and restore from it, see restoreSnapshot.
+template <typename TExtension>
+bool restoreSnapshotFile(const std::string& strPath, BasicCommandParser<TExtension>& parser, ParameterTable* pTable, std::string& strError) {
+    MappedFile file;
+    if (!file.open(strPath)) {
+        strError = file.error();
+        return false;
+    }
+    return restoreSnapshot(file.view(), parser, pTable, strError);
+}
@@ -0,0 +1,146 @@
+/*
+    Command Manager Shared History
+
+    A copy of the command history that other threads (e.g. a monitoring UI) can read while parsing continues.
+    There is a single writer, the thread committing messages, and any number of readers. Readers take consistent
+    snapshots under a sequence lock: the writer bumps a version counter before and after each update, and a reader
+    retries if the version changed while it was copying. The writer never waits for readers.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+//The 10 characters of an opcode, as held in a history snapshot.
+using OpCodeName = std::array<char, kOpCodeLength>;
+
+//Unpack a key made by makeOpCodeKey back into its characters.
+constexpr OpCodeName unpackOpCodeKey(const OpCodeKey& key) {
+    OpCodeName arrName{};
+    for (std::size_t i = 0; i < 8; i++) {
+        arrName[i] = static_cast<char>((key.uLow >> (8 * i)) & 0xFF);
+    }
+    arrName[8] = static_cast<char>(key.uHigh & 0xFF);
+    arrName[9] = static_cast<char>(key.uHigh >> 8);
+    return arrName;
+}
+
+//View an opcode name as a string.
+inline std::string_view toStringView(const OpCodeName& arrName) {
+    return std::string_view(arrName.data(), arrName.size());
+}
+
+//Single-writer, multi-reader history of recognised opcodes, newest first. Attach it to a parser with setHistoryListener to mirror the parser's history.
+//Entries are stored as packed opcode keys in atomics, so a reader racing the writer sees stale or torn data it then discards, never undefined behaviour.
+template <std::size_t N>
+class SharedHistory : public HistoryListener {
+public:
+    static_assert(N > 0, "SharedHistory needs a capacity of at least one entry");
+
+    explicit SharedHistory(std::size_t uDepth = kDefaultHistoryDepth) : m_uDepth(uDepth < N ? uDepth : N) {}
+
+    static constexpr std::size_t capacity() {
+        return N;
+    }
+
+    std::size_t depth() const {
+        return m_uDepth.load(std::memory_order_relaxed);
+    }
+
+    //Record an opcode as the newest entry. Only one thread may write.
+    void push(std::string_view svOpCode) {
+        OpCodeKey key = svOpCode.length() >= kOpCodeLength ? makeOpCodeKey(svOpCode) : OpCodeKey{};
+        std::uint64_t uVersion = m_uVersion.load(std::memory_order_relaxed);
+        //An odd version tells readers an update is in progress.
+        m_uVersion.store(uVersion + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        Entry& entry = m_arrEntries[m_uNext];
+        entry.uLow.store(key.uLow, std::memory_order_relaxed);
+        entry.uHigh.store(key.uHigh, std::memory_order_relaxed);
+        m_uNext = (m_uNext + 1) % N;
+        m_uPublishedNext.store(m_uNext, std::memory_order_relaxed);
+        std::size_t uSize = m_uPublishedSize.load(std::memory_order_relaxed);
+        if (uSize < m_uDepth.load(std::memory_order_relaxed)) {
+            m_uPublishedSize.store(uSize + 1, std::memory_order_relaxed);
+        }
+        m_uVersion.store(uVersion + 2, std::memory_order_release);
+    }
+
+    //Drop every entry and keep uDepth from now on, clamped to the capacity. Only one thread may write.
+    void reset(std::size_t uDepth) {
+        std::uint64_t uVersion = m_uVersion.load(std::memory_order_relaxed);
+        m_uVersion.store(uVersion + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_uDepth.store(uDepth < N ? uDepth : N, std::memory_order_relaxed);
+        m_uPublishedSize.store(0, std::memory_order_relaxed);
+        m_uVersion.store(uVersion + 2, std::memory_order_release);
+    }
+
+    void onRecord(std::string_view svOpCode) override {
+        push(svOpCode);
+    }
+
+    //Follows the parser's history when it is emptied, e.g. by restoring a snapshot, so the mirror keeps its depth.
+    void onClear(std::size_t uDepth) override {
+        reset(uDepth);
+    }
+
+    //Copy the history into vecOut, newest first. Safe to call from any thread, it retries rather than making the writer wait.
+    //Returns the version the copy was taken at. It goes up by two with every recorded opcode, so it can be compared to see whether anything changed.
+    std::uint64_t snapshot(std::vector<OpCodeName>& vecOut) const {
+        vecOut.reserve(depth());
+        unsigned uSpins = 0;
+        while (true) {
+            std::uint64_t uBefore = m_uVersion.load(std::memory_order_acquire);
+            if ((uBefore & 1) == 0) {
+                std::size_t uNext = m_uPublishedNext.load(std::memory_order_relaxed);
+                std::size_t uSize = m_uPublishedSize.load(std::memory_order_relaxed);
+                vecOut.resize(uSize);
+                for (std::size_t i = 0; i < uSize; i++) {
+                    const Entry& entry = m_arrEntries[(uNext + N - 1 - i) % N];
+                    OpCodeKey key;
+                    key.uLow = entry.uLow.load(std::memory_order_relaxed);
+                    key.uHigh = entry.uHigh.load(std::memory_order_relaxed);
+                    vecOut[i] = unpackOpCodeKey(key);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (m_uVersion.load(std::memory_order_relaxed) == uBefore) {
+                    return uBefore;
+                }
+            }
+            //The writer was part way through an update, try again.
+            if (++uSpins > 64) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    //Version of the history, see snapshot().
+    std::uint64_t version() const {
+        return m_uVersion.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Entry {
+        std::atomic<std::uint64_t> uLow{ 0 };
+        std::atomic<std::uint16_t> uHigh{ 0 };
+    };
+
+    std::array<Entry, N> m_arrEntries;
+    //Writer-only position of the next entry, published for readers in m_uPublishedNext.
+    std::size_t m_uNext = 0;
+    std::atomic<std::size_t> m_uDepth;
+    std::atomic<std::size_t> m_uPublishedNext{ 0 };
+    std::atomic<std::size_t> m_uPublishedSize{ 0 };
+    alignas(64) std::atomic<std::uint64_t> m_uVersion{ 0 };
+};
+
+//Shared history with the same capacity as the parser's own.
+using SharedCommandHistory = SharedHistory<kHistoryCapacity>;
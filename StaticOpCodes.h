@@ -0,0 +1,154 @@
+/*
+    Command Manager Compile-Time OpCodes
+
+    Opcodes known when the code is compiled, as types. Each StaticOpCode carries its key as a constant, so checking a message against it is
+    a 64 bit and a 16 bit compare against immediates, with no string or table lookup, and its payload type is chosen at compile time:
+    RUN_NO____ and POLAR_NO__ give an int, USR_MSG___ its text, D_USR_FLD_ a ParameterList of name/value pairs, anything else its raw content.
+
+    C++17 can't take a string literal as a template argument, so the name is given as a constexpr char array:
+        inline constexpr char kSweepOpCode[] = "SWEEP_____";
+        using SweepOpCode = StaticOpCode<kSweepOpCode>;
+    The array's type fixes its length, so a name that isn't 10 characters doesn't compile.
+*/
+
+#pragma once
+
+#include "CommandManager.h"
+
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+//An opcode as a type. A StaticHandlers handler can derive from its StaticOpCode to get the kOpCode key it needs.
+template <const char (&Name)[kOpCodeLength + 1]>
+struct StaticOpCode {
+    static constexpr std::string_view kName{ Name, kOpCodeLength };
+    static constexpr OpCodeKey kOpCode = makeOpCodeKey(kName);
+    //The built-in opcode this is, Unknown for a site-specific one.
+    static constexpr OpCode kBuiltIn = lookupOpCode(kOpCode);
+
+    //True if svMessage starts with this opcode. A fixed length compare against a constant is lowered to an 8 byte and a 2 byte compare against immediates.
+    static bool matches(std::string_view svMessage) {
+        return svMessage.length() >= kOpCodeLength && std::memcmp(svMessage.data(), Name, kOpCodeLength) == 0;
+    }
+};
+
+//The built-in opcodes.
+inline constexpr char kRunNumberOpCode[] = "RUN_NO____";
+inline constexpr char kPolarNumberOpCode[] = "POLAR_NO__";
+inline constexpr char kUserMessageOpCode[] = "USR_MSG___";
+inline constexpr char kUserFieldsOpCode[] = "D_USR_FLD_";
+inline constexpr char kHistoryOpCode[] = "HISTORY___";
+
+using RunNumberOpCode = StaticOpCode<kRunNumberOpCode>;
+using PolarNumberOpCode = StaticOpCode<kPolarNumberOpCode>;
+using UserMessageOpCode = StaticOpCode<kUserMessageOpCode>;
+using UserFieldsOpCode = StaticOpCode<kUserFieldsOpCode>;
+using HistoryOpCode = StaticOpCode<kHistoryOpCode>;
+
+static_assert(RunNumberOpCode::kBuiltIn == OpCode::RunNumber && PolarNumberOpCode::kBuiltIn == OpCode::PolarNumber
+    && UserMessageOpCode::kBuiltIn == OpCode::UserMessage && UserFieldsOpCode::kBuiltIn == OpCode::UserFields
+    && HistoryOpCode::kBuiltIn == OpCode::History, "Static opcodes must match the built-in opcode table");
+
+//Payload type of an opcode and how its message content is decoded. Opcodes without a typed payload get their message content.
+//decode returns false if the content isn't valid for the opcode; vecParameters is scratch storage only D_USR_FLD_ uses.
+template <OpCode eOpCode>
+struct StaticOpCodePayload {
+    using Type = std::string_view;
+
+    static bool decode(std::string_view svMessageContent, std::pmr::vector<Parameter>&, Type& svContent) {
+        svContent = svMessageContent;
+        return true;
+    }
+};
+
+template <>
+struct StaticOpCodePayload<OpCode::RunNumber> {
+    using Type = int;
+
+    static bool decode(std::string_view svMessageContent, std::pmr::vector<Parameter>&, Type& iRunNumber) {
+        return parseInt(svMessageContent, iRunNumber) == std::errc();
+    }
+};
+
+template <>
+struct StaticOpCodePayload<OpCode::PolarNumber> {
+    using Type = int;
+
+    static bool decode(std::string_view svMessageContent, std::pmr::vector<Parameter>&, Type& iPolarNumber) {
+        return parseInt(svMessageContent, iPolarNumber) == std::errc();
+    }
+};
+
+template <>
+struct StaticOpCodePayload<OpCode::UserFields> {
+    using Type = ParameterList;
+
+    //Individual parameters can still be NameTooLong or InvalidValue, only an odd parameter count fails the message.
+    static bool decode(std::string_view svMessageContent, std::pmr::vector<Parameter>& vecParameters, Type& parameters) {
+        if (!decodeParameters(svMessageContent, vecParameters)) {
+            return false;
+        }
+        parameters = ParameterList{ vecParameters.data(), vecParameters.size(), RunContext{} };
+        return true;
+    }
+};
+
+//Parser for the messages of a single opcode, e.g. on a link that only ever carries one kind of message.
+template <typename TOpCode>
+class StaticOpCodeParser {
+public:
+    using OpCodeType = TOpCode;
+    using Payload = typename StaticOpCodePayload<TOpCode::kBuiltIn>::Type;
+
+    //Parse a '#' terminated message. Returns false if it isn't this opcode or its payload is invalid.
+    //Views in the payload point into the message, or the parser's storage for D_USR_FLD_, until the next call.
+    bool parse(std::string_view svMessage, Payload& payload) {
+        if (svMessage.length() < kOpCodeLength + 1 || svMessage.back() != '#' || !TOpCode::matches(svMessage)) {
+            return false;
+        }
+        return decodeContent(svMessage.substr(kOpCodeLength, svMessage.length() - kOpCodeLength - 1), payload);
+    }
+
+    //Decode the content of a message already known to have this opcode.
+    bool decodeContent(std::string_view svMessageContent, Payload& payload) {
+        return StaticOpCodePayload<TOpCode::kBuiltIn>::decode(svMessageContent, m_vecParameters, payload);
+    }
+
+private:
+    std::pmr::vector<Parameter> m_vecParameters;
+};
+
+//Parser for a fixed set of opcodes. The message is matched against each opcode in turn, an unrolled chain of compares against constants,
+//and the matching opcode's content is decoded into its own payload type.
+template <typename... TOpCodes>
+class StaticOpCodeSwitch {
+public:
+    //Parse a '#' terminated message and call visitor(TOpCode(), payload) for the opcode it matches.
+    //Returns false, without calling the visitor, if it matches none of them or its payload is invalid.
+    template <typename TVisitor>
+    bool parse(std::string_view svMessage, TVisitor&& visitor) {
+        if (svMessage.length() < kOpCodeLength + 1 || svMessage.back() != '#') {
+            return false;
+        }
+        std::string_view svMessageContent = svMessage.substr(kOpCodeLength, svMessage.length() - kOpCodeLength - 1);
+        bool bDecoded = false;
+        static_cast<void>(((TOpCodes::matches(svMessage) && (bDecoded = visit<TOpCodes>(svMessageContent, visitor), true)) || ...));
+        return bDecoded;
+    }
+
+private:
+    template <typename TOpCode, typename TVisitor>
+    bool visit(std::string_view svMessageContent, TVisitor& visitor) {
+        typename StaticOpCodePayload<TOpCode::kBuiltIn>::Type payload{};
+        if (!StaticOpCodePayload<TOpCode::kBuiltIn>::decode(svMessageContent, m_vecParameters, payload)) {
+            return false;
+        }
+        visitor(TOpCode(), payload);
+        return true;
+    }
+
+    std::pmr::vector<Parameter> m_vecParameters;
+};